@@ -39,6 +39,7 @@ struct private_handle_t : public native_handle {
     uint32_t fb_id;
 
     uint64_t usage __attribute__((aligned(8))); /* gralloc1 usage flags */
+    uint64_t modifier; /* DRM format modifier of the layout, 0 is linear */
 
     static inline int sNumInts() {
         return (((sizeof(private_handle_t) - sizeof(native_handle_t))/sizeof(int)) - sNumFds);
@@ -48,7 +49,7 @@ struct private_handle_t : public native_handle {
 
     private_handle_t(int fd) :
         fd(fd), magic(sMagic),
-        fb_id(0)
+        fb_id(0), modifier(0)
     {
         version = sizeof(native_handle);
         numInts = sNumInts();
@@ -59,7 +60,7 @@ struct private_handle_t : public native_handle {
     private_handle_t(int32_t width, int32_t height, int32_t hal_format,
 		     int64_t usage) :
   	fd(-1), magic(sMagic), width(width), height(height), format(hal_format),
-        fb_id(0), usage(usage)
+        fb_id(0), usage(usage), modifier(0)
     {
         version = sizeof(native_handle);
         numInts = sNumInts();
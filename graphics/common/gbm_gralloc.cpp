@@ -32,6 +32,7 @@
 #include <hardware/gralloc1.h>
 
 #include <gbm.h>
+#include <drm_fourcc.h>
 
 #include "gbm_gralloc.h"
 #include "drm_handle.h"
@@ -167,6 +168,23 @@ static struct gbm_bo *gbm_import(struct gbm_device *gbm,
 
 	data.fd = handle->fd;
 	data.stride = handle->stride;
+
+	/* tiled layouts can't be described by GBM_BO_IMPORT_FD */
+	if (handle->modifier != DRM_FORMAT_MOD_LINEAR &&
+			handle->modifier != DRM_FORMAT_MOD_INVALID) {
+		struct gbm_import_fd_modifier_data mod_data;
+
+		memset(&mod_data, 0, sizeof(mod_data));
+		mod_data.width = data.width;
+		mod_data.height = data.height;
+		mod_data.format = data.format;
+		mod_data.num_fds = 1;
+		mod_data.fds[0] = data.fd;
+		mod_data.strides[0] = data.stride;
+		mod_data.modifier = handle->modifier;
+		return gbm_bo_import(gbm, GBM_BO_IMPORT_FD_MODIFIER, &mod_data, 0);
+	}
+
 	bo = gbm_bo_import(gbm, GBM_BO_IMPORT_FD, &data, 0);
 
 	return bo;
@@ -204,6 +222,7 @@ static struct gbm_bo *gbm_alloc(struct gbm_device *gbm,
 
 	handle->fd = gbm_bo_get_fd(bo);
 	handle->stride = gbm_bo_get_stride(bo);
+	handle->modifier = gbm_bo_get_modifier(bo);
 
 	return bo;
 }
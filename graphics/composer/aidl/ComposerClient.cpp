@@ -21,7 +21,6 @@
 #include <android-base/logging.h>
 #include <android/binder_ibinder_platform.h>
 #include <hardware/hwcomposer2.h>
-#include <sync/sync.h>
 
 #include "Util.h"
 #include "impl/TranslateHwcAidl.h"
@@ -35,6 +34,8 @@ bool ComposerClient::init() {
         LOG(ERROR) << "failed to create composer resources";
         return false;
     }
+    mResources->setBufferReleasedCallback(
+            [hal = mHal](buffer_handle_t buffer) { hal->releaseBuffer(buffer); });
 
     mCommandEngine = std::make_unique<ComposerCommandEngine>(mHal, mResources.get());
     if (mCommandEngine == nullptr) {
@@ -81,12 +82,22 @@ ndk::ScopedAStatus ComposerClient::createLayer(int64_t display, int32_t bufferSl
     return TO_BINDER_STATUS(err);
 }
 
-ndk::ScopedAStatus ComposerClient::createVirtualDisplay(int32_t /*width*/, int32_t /*height*/,
-                                                        AidlPixelFormat /*formatHint*/,
-                                                        int32_t /*outputBufferSlotCount*/,
-                                                        VirtualDisplay* /*display*/) {
+ndk::ScopedAStatus ComposerClient::createVirtualDisplay(int32_t width, int32_t height,
+                                                        AidlPixelFormat formatHint,
+                                                        int32_t outputBufferSlotCount,
+                                                        VirtualDisplay* display) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_NO_RESOURCES);
+    if (width <= 0 || height <= 0) {
+        return TO_BINDER_STATUS(HWC2_ERROR_BAD_PARAMETER);
+    }
+    auto err = mHal->createVirtualDisplay(width, height, formatHint, display);
+    if (!err) {
+        err = mResources->addVirtualDisplay(display->display, outputBufferSlotCount);
+        if (err) {
+            mHal->destroyVirtualDisplay(display->display);
+        }
+    }
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::destroyLayer(int64_t display, int64_t layer) {
@@ -98,9 +109,13 @@ ndk::ScopedAStatus ComposerClient::destroyLayer(int64_t display, int64_t layer)
     return TO_BINDER_STATUS(err);
 }
 
-ndk::ScopedAStatus ComposerClient::destroyVirtualDisplay(int64_t /*display*/) {
+ndk::ScopedAStatus ComposerClient::destroyVirtualDisplay(int64_t display) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_NONE);
+    auto err = mHal->destroyVirtualDisplay(display);
+    if (!err) {
+        err = mResources->removeDisplay(display);
+    }
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::executeCommands(const std::vector<DisplayCommand>& commands,
@@ -112,9 +127,7 @@ ndk::ScopedAStatus ComposerClient::executeCommands(const std::vector<DisplayComm
 
 ndk::ScopedAStatus ComposerClient::getActiveConfig(int64_t display, int32_t* config) {
     DEBUG_FUNC();
-    config = nullptr;
-    auto err = (0 == display || 1 == display)
-            ? HWC2_ERROR_NONE : HWC2_ERROR_BAD_DISPLAY;
+    auto err = mHal->getActiveConfig(display, config);
     return TO_BINDER_STATUS(err);
 }
 
@@ -123,7 +136,7 @@ ndk::ScopedAStatus ComposerClient::getColorModes(int64_t display,
     DEBUG_FUNC();
     std::vector<int32_t> hwcModes(1);
     auto err = HWC2_ERROR_BAD_DISPLAY;
-    if (0 == display || 1 == display) {
+    if (mResources->hasDisplay(display)) {
         hwcModes.data()[0]=HAL_COLOR_MODE_NATIVE;
         err = HWC2_ERROR_NONE;
     }
@@ -155,22 +168,17 @@ ndk::ScopedAStatus ComposerClient::getDisplayAttribute(int64_t display, int32_t
     return TO_BINDER_STATUS(err);
 }
 
-ndk::ScopedAStatus ComposerClient::getDisplayCapabilities(int64_t /*display*/,
-                                                          std::vector<DisplayCapability>* /*caps*/) {
+ndk::ScopedAStatus ComposerClient::getDisplayCapabilities(int64_t display,
+                                                          std::vector<DisplayCapability>* caps) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_UNSUPPORTED);
+    auto err = mHal->getDisplayCapabilities(display, caps);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::getDisplayConfigs(int64_t display,
                                                      std::vector<int32_t>* configs) {
     DEBUG_FUNC();
-    std::vector<int32_t> hwcConfigs(1);
-    auto err = HWC2_ERROR_BAD_DISPLAY;
-    if (0 == display || 1 == display) {
-        hwcConfigs.data()[0]= 0;
-        err = HWC2_ERROR_NONE;
-    }
-    h2a::translate(hwcConfigs, *configs);
+    auto err = mHal->getDisplayConfigs(display, configs);
     return TO_BINDER_STATUS(err);
 }
 
@@ -198,17 +206,19 @@ ndk::ScopedAStatus ComposerClient::getDisplayVsyncPeriod(int64_t display, int32_
     return TO_BINDER_STATUS(err);
 }
 
-ndk::ScopedAStatus ComposerClient::getDisplayedContentSample(int64_t /*display*/, int64_t /*maxFrames*/,
-                                                             int64_t /*timestamp*/,
-                                                             DisplayContentSample* /*samples*/) {
+ndk::ScopedAStatus ComposerClient::getDisplayedContentSample(int64_t display, int64_t maxFrames,
+                                                             int64_t timestamp,
+                                                             DisplayContentSample* samples) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_UNSUPPORTED);
+    auto err = mHal->getDisplayedContentSample(display, maxFrames, timestamp, samples);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::getDisplayedContentSamplingAttributes(
-        int64_t /*display*/, DisplayContentSamplingAttributes* /*attrs*/) {
+        int64_t display, DisplayContentSamplingAttributes* attrs) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_UNSUPPORTED);
+    auto err = mHal->getDisplayedContentSamplingAttributes(display, attrs);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::getDisplayPhysicalOrientation(int64_t /*display*/,
@@ -230,8 +240,8 @@ ndk::ScopedAStatus ComposerClient::getOverlaySupport(OverlayProperties* /*caps*/
 
 ndk::ScopedAStatus ComposerClient::getMaxVirtualDisplayCount(int32_t* count) {
     DEBUG_FUNC();
-    *count = 0;
-    return TO_BINDER_STATUS(HWC2_ERROR_NONE);
+    auto err = mHal->getMaxVirtualDisplayCount(count);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::getPerFrameMetadataKeys(int64_t /*display*/,
@@ -240,16 +250,18 @@ ndk::ScopedAStatus ComposerClient::getPerFrameMetadataKeys(int64_t /*display*/,
     return TO_BINDER_STATUS(HWC2_ERROR_UNSUPPORTED);
 }
 
-ndk::ScopedAStatus ComposerClient::getReadbackBufferAttributes(int64_t /*display*/,
-                                                               ReadbackBufferAttributes* /*attrs*/) {
+ndk::ScopedAStatus ComposerClient::getReadbackBufferAttributes(int64_t display,
+                                                               ReadbackBufferAttributes* attrs) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_UNSUPPORTED);
+    auto err = mHal->getReadbackBufferAttributes(display, attrs);
+    return TO_BINDER_STATUS(err);
 }
 
-ndk::ScopedAStatus ComposerClient::getReadbackBufferFence(int64_t /*display*/,
-                                                          ndk::ScopedFileDescriptor* /*acquireFence*/) {
+ndk::ScopedAStatus ComposerClient::getReadbackBufferFence(int64_t display,
+                                                          ndk::ScopedFileDescriptor* acquireFence) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_UNSUPPORTED);
+    auto err = mHal->getReadbackBufferFence(display, acquireFence);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::getRenderIntents(int64_t /*display*/, ColorMode /*mode*/,
@@ -258,10 +270,11 @@ ndk::ScopedAStatus ComposerClient::getRenderIntents(int64_t /*display*/, ColorMo
     return TO_BINDER_STATUS(HWC2_ERROR_UNSUPPORTED);
 }
 
-ndk::ScopedAStatus ComposerClient::getSupportedContentTypes(int64_t /*display*/,
-                                                            std::vector<ContentType>* /*types*/) {
+ndk::ScopedAStatus ComposerClient::getSupportedContentTypes(int64_t display,
+                                                            std::vector<ContentType>* types) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_UNSUPPORTED);
+    auto err = mHal->getSupportedContentTypes(display, types);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::getDisplayDecorationSupport(
@@ -292,16 +305,22 @@ ndk::ScopedAStatus ComposerClient::registerCallback(
     return ndk::ScopedAStatus::ok();
 }
 
-ndk::ScopedAStatus ComposerClient::setActiveConfig(int64_t /*display*/, int32_t /*config*/) {
+ndk::ScopedAStatus ComposerClient::setActiveConfig(int64_t display, int32_t config) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_NONE);
+    VsyncPeriodChangeConstraints constraints;
+    constraints.desiredTimeNanos = 0;
+    constraints.seamlessRequired = false;
+    VsyncPeriodChangeTimeline timeline;
+    auto err = mHal->setActiveConfigWithConstraints(display, config, constraints, &timeline);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setActiveConfigWithConstraints(
-        int64_t /*display*/, int32_t /*config*/, const VsyncPeriodChangeConstraints& /*constraints*/,
-        VsyncPeriodChangeTimeline* /*timeline*/) {
+        int64_t display, int32_t config, const VsyncPeriodChangeConstraints& constraints,
+        VsyncPeriodChangeTimeline* timeline) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_NONE);
+    auto err = mHal->setActiveConfigWithConstraints(display, config, constraints, timeline);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setBootDisplayConfig(int64_t /*display*/, int32_t /*config*/) {
@@ -350,20 +369,24 @@ ndk::ScopedAStatus ComposerClient::setColorMode(int64_t /*display*/, ColorMode m
     return TO_BINDER_STATUS(HWC2_ERROR_NONE);
 }
 
-ndk::ScopedAStatus ComposerClient::setContentType(int64_t /*display*/, ContentType /*type*/) {
+ndk::ScopedAStatus ComposerClient::setContentType(int64_t display, ContentType type) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_NONE);
+    auto err = mHal->setContentType(display, type);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setDisplayedContentSamplingEnabled(
-        int64_t /*display*/, bool /*enable*/, FormatColorComponent /*componentMask*/, int64_t /*maxFrames*/) {
+        int64_t display, bool enable, FormatColorComponent componentMask, int64_t maxFrames) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_NONE);
+    auto err = mHal->setDisplayedContentSamplingEnabled(display, enable, componentMask,
+                                                        maxFrames);
+    return TO_BINDER_STATUS(err);
 }
 
-ndk::ScopedAStatus ComposerClient::setPowerMode(int64_t /*display*/, PowerMode /*mode*/) {
+ndk::ScopedAStatus ComposerClient::setPowerMode(int64_t display, PowerMode mode) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_NONE);
+    auto err = mHal->setPowerMode(display, mode);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setReadbackBuffer(
@@ -377,13 +400,7 @@ ndk::ScopedAStatus ComposerClient::setReadbackBuffer(
     auto err = mResources->getDisplayReadbackBuffer(display, buffer,
                                                     readbackBuffer, bufReleaser.get());
     if (!err) {
-        int32_t fence;
-        a2h::translate(releaseFence, fence);
-        if (fence >= 0) {
-            sync_wait(fence, -1);
-            close(fence);
-        }
-        //err = mHal->setReadbackBuffer(display, readbackBuffer, releaseFence);
+        err = mHal->setReadbackBuffer(display, readbackBuffer, releaseFence);
     }
     return TO_BINDER_STATUS(err);
 }
@@ -394,9 +411,10 @@ ndk::ScopedAStatus ComposerClient::setVsyncEnabled(int64_t display, bool enabled
     return TO_BINDER_STATUS(err);
 }
 
-ndk::ScopedAStatus ComposerClient::setIdleTimerEnabled(int64_t /*display*/, int32_t /*timeout*/) {
+ndk::ScopedAStatus ComposerClient::setIdleTimerEnabled(int64_t display, int32_t timeout) {
     DEBUG_FUNC();
-    return TO_BINDER_STATUS(HWC2_ERROR_NONE);
+    auto err = mHal->setIdleTimerEnabled(display, timeout);
+    return TO_BINDER_STATUS(err);
 }
 
 ndk::ScopedAStatus ComposerClient::setRefreshRateChangedCallbackDebugEnabled(int64_t /*display*/,
@@ -512,12 +530,12 @@ void ComposerClient::HalEventCallback::cleanDisplayResources(int64_t display) {
             if (err) {
                 continue;
             }
-            //ndk::ScopedFileDescriptor emptyFd;
-            //err = mHal->setOutputBuffer(display, outputBuffer, /*fence*/ emptyFd);
-            /*if (err) {
+            ndk::ScopedFileDescriptor emptyFd;
+            err = mHal->setOutputBuffer(display, outputBuffer, /*fence*/ emptyFd);
+            if (err) {
                 LOG(ERROR) << "Can't clean slot " << slot
                            << " of the output buffer cache for display " << display;
-            }*/
+            }
         }
     } else {
         LOG(ERROR) << "Can't clean output buffer cache for display " << display;
@@ -546,7 +564,7 @@ void ComposerClient::destroyResources() {
         }
 
         if (isVirtual) {
-            //mHal->destroyVirtualDisplay(display);
+            mHal->destroyVirtualDisplay(display);
         } else {
             LOG(WARNING) << "performing a final presentDisplay";
             std::vector<int64_t> changedLayers;
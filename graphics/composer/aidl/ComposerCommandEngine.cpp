@@ -16,6 +16,7 @@
 
 #define LOG_TAG "composer-CommandEngine"
 
+#include <hardware/hwcomposer2.h>
 #include <set>
 #include <sync/sync.h>
 
@@ -80,6 +81,10 @@ int32_t ComposerCommandEngine::execute(const std::vector<DisplayCommand>& comman
             displaysPendingBrightenssChange.insert(command.display);
         }
     }
+    // a brightness change without a frame to go out with goes out on its own
+    for (auto display : displaysPendingBrightenssChange) {
+        mHal->flushDisplayBrightnessChange(display);
+    }
 
     *result = mWriter->getPendingCommandResults();
     mWriter->reset();
@@ -152,13 +157,13 @@ int32_t ComposerCommandEngine::executeValidateDisplayInternal(int64_t display) {
     return err;
 }
 
-void ComposerCommandEngine::executeSetColorTransform(int64_t /*display*/,
-                                                     const std::vector<float>& /*matrix*/) {
-    /*auto err = mHal->setColorTransform(display, matrix);
+void ComposerCommandEngine::executeSetColorTransform(int64_t display,
+                                                     const std::vector<float>& matrix) {
+    auto err = mHal->setColorTransform(display, matrix);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executeSetClientTarget(int64_t display, const ClientTarget& command) {
@@ -193,16 +198,11 @@ void ComposerCommandEngine::executeSetOutputBuffer(uint64_t display, const Buffe
     auto err = mResources->getDisplayOutputBuffer(display, buffer.slot, useCache, handle,
                                                   outputBuffer, bufferReleaser.get());
     if (!err) {
-        int32_t fence;
-        a2h::translate(buffer.fence, fence);
-        if (fence >= 0) {
-            close(fence);
-        }
-        /*err = mHal->setOutputBuffer(display, outputBuffer, buffer.fence);
+        err = mHal->setOutputBuffer(display, outputBuffer, buffer.fence);
         if (err) {
             LOG(ERROR) << __func__ << " setOutputBuffer: err " << err;
             mWriter->setError(mCommandIndex, err);
-        }*/
+        }
     } else {
         LOG(ERROR) << __func__ << " getDisplayOutputBuffer: err " << err;
         mWriter->setError(mCommandIndex, err);
@@ -210,8 +210,8 @@ void ComposerCommandEngine::executeSetOutputBuffer(uint64_t display, const Buffe
 }
 
 void ComposerCommandEngine::executeSetExpectedPresentTimeInternal(
-        int64_t /*display*/, const std::optional<ClockMonotonicTimestamp> /*expectedPresentTime*/) {
-   //mHal->setExpectedPresentTime(display, expectedPresentTime);
+        int64_t display, const std::optional<ClockMonotonicTimestamp> expectedPresentTime) {
+    mHal->setExpectedPresentTime(display, expectedPresentTime);
 }
 
 void ComposerCommandEngine::executeValidateDisplay(
@@ -220,19 +220,33 @@ void ComposerCommandEngine::executeValidateDisplay(
     executeValidateDisplayInternal(display);
 }
 
-void ComposerCommandEngine::executeSetDisplayBrightness(uint64_t /*display*/,
-                                        const DisplayBrightness& /*command*/) {
-    /*auto err = mHal->setDisplayBrightness(display, command.brightness);
+void ComposerCommandEngine::executeSetDisplayBrightness(uint64_t display,
+                                        const DisplayBrightness& command) {
+    auto err = mHal->setDisplayBrightness(display, command.brightness);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executePresentOrValidateDisplay(
         int64_t display, const std::optional<ClockMonotonicTimestamp> expectedPresentTime) {
     executeSetExpectedPresentTimeInternal(display, expectedPresentTime);
 
+    // Present right away if nothing changed since the last validation
+    if (!mResources->mustValidateDisplay(display)) {
+        int err = executePresentDisplay(display);
+        if (!err) {
+            mWriter->setPresentOrValidateResult(display, PresentOrValidate::Result::Presented);
+            return;
+        }
+        if (err != HWC2_ERROR_NOT_VALIDATED) {
+            LOG(ERROR) << __func__ << ": present err " << err;
+            mWriter->setError(mCommandIndex, err);
+            return;
+        }
+    }
+
     // Fallback to validate
     int err = executeValidateDisplayInternal(display);
     if (!err) {
@@ -261,13 +275,13 @@ int ComposerCommandEngine::executePresentDisplay(int64_t display) {
     return err;
 }
 
-void ComposerCommandEngine::executeSetLayerCursorPosition(int64_t /*display*/, int64_t /*layer*/,
-                                       const common::Point& /*cursorPosition*/) {
-    /*auto err = mHal->setLayerCursorPosition(display, layer, cursorPosition.x, cursorPosition.y);
+void ComposerCommandEngine::executeSetLayerCursorPosition(int64_t display, int64_t layer,
+                                       const common::Point& cursorPosition) {
+    auto err = mHal->setLayerCursorPosition(display, layer, cursorPosition.x, cursorPosition.y);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executeSetLayerBuffer(int64_t display, int64_t layer,
@@ -282,39 +296,33 @@ void ComposerCommandEngine::executeSetLayerBuffer(int64_t display, int64_t layer
                                           handle, hwcBuffer, bufferReleaser.get());
 
     if (!err) {
-        int32_t fence;
-        a2h::translate(buffer.fence, fence);
-        if (fence >= 0) {
-            sync_wait(fence, -1);
-            close(fence);
-        }
-        /*err = mHal->setLayerBuffer(display, layer, hwcBuffer, buffer.fence);
+        err = mHal->setLayerBuffer(display, layer, hwcBuffer, buffer.fence);
         if (err) {
             LOG(ERROR) << __func__ << ": setLayerBuffer err " << err;
             mWriter->setError(mCommandIndex, err);
-        }*/
+        }
     } else {
         LOG(ERROR) << __func__ << ": getLayerBuffer err " << err;
         mWriter->setError(mCommandIndex, err);
     }
 }
 
-void ComposerCommandEngine::executeSetLayerSurfaceDamage(int64_t /*display*/, int64_t /*layer*/,
-                              const std::vector<std::optional<common::Rect>>& /*damage*/) {
-    /*auto err = mHal->setLayerSurfaceDamage(display, layer, damage);
+void ComposerCommandEngine::executeSetLayerSurfaceDamage(int64_t display, int64_t layer,
+                              const std::vector<std::optional<common::Rect>>& damage) {
+    auto err = mHal->setLayerSurfaceDamage(display, layer, damage);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
-void ComposerCommandEngine::executeSetLayerBlendMode(int64_t /*display*/, int64_t /*layer*/,
-                                                     const ParcelableBlendMode& /*blendMode*/) {
-    /*auto err = mHal->setLayerBlendMode(display, layer, blendMode.blendMode);
+void ComposerCommandEngine::executeSetLayerBlendMode(int64_t display, int64_t layer,
+                                                     const ParcelableBlendMode& blendMode) {
+    auto err = mHal->setLayerBlendMode(display, layer, blendMode.blendMode);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executeSetLayerColor(int64_t /*display*/, int64_t /*layer*/,
@@ -344,22 +352,22 @@ void ComposerCommandEngine::executeSetLayerDataspace(int64_t /*display*/, int64_
     }*/
 }
 
-void ComposerCommandEngine::executeSetLayerDisplayFrame(int64_t /*display*/, int64_t /*layer*/,
-                                                        const common::Rect& /*rect*/) {
-    /*auto err = mHal->setLayerDisplayFrame(display, layer, rect);
+void ComposerCommandEngine::executeSetLayerDisplayFrame(int64_t display, int64_t layer,
+                                                        const common::Rect& rect) {
+    auto err = mHal->setLayerDisplayFrame(display, layer, rect);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
-void ComposerCommandEngine::executeSetLayerPlaneAlpha(int64_t /*display*/, int64_t /*layer*/,
-                                                      const PlaneAlpha& /*planeAlpha*/) {
-    /*auto err = mHal->setLayerPlaneAlpha(display, layer, planeAlpha.alpha);
+void ComposerCommandEngine::executeSetLayerPlaneAlpha(int64_t display, int64_t layer,
+                                                      const PlaneAlpha& planeAlpha) {
+    auto err = mHal->setLayerPlaneAlpha(display, layer, planeAlpha.alpha);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executeSetLayerSidebandStream(int64_t display, int64_t layer,
@@ -379,22 +387,22 @@ void ComposerCommandEngine::executeSetLayerSidebandStream(int64_t display, int64
     }
 }
 
-void ComposerCommandEngine::executeSetLayerSourceCrop(int64_t /*display*/, int64_t /*layer*/,
-                                                      const common::FRect& /*sourceCrop*/) {
-    /*auto err = mHal->setLayerSourceCrop(display, layer, sourceCrop);
+void ComposerCommandEngine::executeSetLayerSourceCrop(int64_t display, int64_t layer,
+                                                      const common::FRect& sourceCrop) {
+    auto err = mHal->setLayerSourceCrop(display, layer, sourceCrop);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
-void ComposerCommandEngine::executeSetLayerTransform(int64_t /*display*/, int64_t /*layer*/,
-                                                     const ParcelableTransform& /*transform*/) {
-    /*auto err = mHal->setLayerTransform(display, layer, transform.transform);
+void ComposerCommandEngine::executeSetLayerTransform(int64_t display, int64_t layer,
+                                                     const ParcelableTransform& transform) {
+    auto err = mHal->setLayerTransform(display, layer, transform.transform);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executeSetLayerVisibleRegion(int64_t /*display*/, int64_t /*layer*/,
@@ -406,13 +414,13 @@ void ComposerCommandEngine::executeSetLayerVisibleRegion(int64_t /*display*/, in
     }*/
 }
 
-void ComposerCommandEngine::executeSetLayerZOrder(int64_t /*display*/, int64_t /*layer*/,
-                                                  const ZOrder& /*zOrder*/) {
-    /*auto err = mHal->setLayerZOrder(display, layer, zOrder.z);
+void ComposerCommandEngine::executeSetLayerZOrder(int64_t display, int64_t layer,
+                                                  const ZOrder& zOrder) {
+    auto err = mHal->setLayerZOrder(display, layer, zOrder.z);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executeSetLayerPerFrameMetadata(int64_t /*display*/, int64_t /*layer*/,
@@ -424,22 +432,22 @@ void ComposerCommandEngine::executeSetLayerPerFrameMetadata(int64_t /*display*/,
     }*/
 }
 
-void ComposerCommandEngine::executeSetLayerColorTransform(int64_t /*display*/, int64_t /*layer*/,
-                                                       const std::vector<float>& /*matrix*/) {
-    /*auto err = mHal->setLayerColorTransform(display, layer, matrix);
+void ComposerCommandEngine::executeSetLayerColorTransform(int64_t display, int64_t layer,
+                                                       const std::vector<float>& matrix) {
+    auto err = mHal->setLayerColorTransform(display, layer, matrix);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
-void ComposerCommandEngine::executeSetLayerBrightness(int64_t /*display*/, int64_t /*layer*/,
-                                                      const LayerBrightness& /*brightness*/) {
-    /*auto err = mHal->setLayerBrightness(display, layer, brightness.brightness);
+void ComposerCommandEngine::executeSetLayerBrightness(int64_t display, int64_t layer,
+                                                      const LayerBrightness& brightness) {
+    auto err = mHal->setLayerBrightness(display, layer, brightness.brightness);
     if (err) {
         LOG(ERROR) << __func__ << ": err " << err;
         mWriter->setError(mCommandIndex, err);
-    }*/
+    }
 }
 
 void ComposerCommandEngine::executeSetLayerPerFrameMetadataBlobs(int64_t /*display*/, int64_t /*layer*/,
@@ -50,13 +50,29 @@ void ComposerHal::registerEventCallback(ComposerHal::EventCallback* callback) {
 
     mDevice->registerCallback(HWC2_CALLBACK_HOTPLUG, this,
                                reinterpret_cast<hwc2_function_pointer_t>(hotplugHook));
-    mDevice->registerCallback(HWC2_CALLBACK_VSYNC, this,
+    mDevice->registerCallback(HWC2_CALLBACK_VSYNC_2_4, this,
                                reinterpret_cast<hwc2_function_pointer_t>(vsyncHook));
+    mDevice->registerCallback(HWC2_CALLBACK_VSYNC_PERIOD_TIMING_CHANGED, this,
+                               reinterpret_cast<hwc2_function_pointer_t>(
+                                       vsyncPeriodTimingChangedHook));
+    mDevice->registerCallback(Hwc2Device::CALLBACK_VSYNC_IDLE, this,
+                               reinterpret_cast<hwc2_function_pointer_t>(vsyncIdleHook));
+}
+
+void ComposerHal::vsyncPeriodTimingChangedHook(hwc2_callback_data_t callbackData,
+                                               hwc2_display_t display,
+                                               hwc_vsync_period_change_timeline_t* hwcTimeline) {
+    auto hal = static_cast<ComposerHal*>(callbackData);
+    VsyncPeriodChangeTimeline timeline;
+    h2a::translate(*hwcTimeline, timeline);
+    hal->mEventCallback->onVsyncPeriodTimingChanged(display, timeline);
 }
 
 void ComposerHal::unregisterEventCallback() {
     mDevice->registerCallback(HWC2_CALLBACK_HOTPLUG, this, nullptr);
-    mDevice->registerCallback(HWC2_CALLBACK_VSYNC, this, nullptr);
+    mDevice->registerCallback(HWC2_CALLBACK_VSYNC_2_4, this, nullptr);
+    mDevice->registerCallback(HWC2_CALLBACK_VSYNC_PERIOD_TIMING_CHANGED, this, nullptr);
+    mDevice->registerCallback(Hwc2Device::CALLBACK_VSYNC_IDLE, this, nullptr);
 
     mEventCallback = nullptr;
 }
@@ -99,28 +115,278 @@ int32_t ComposerHal::getDisplayAttribute(int64_t display, int32_t config,
 }
 
 int32_t ComposerHal::getDisplayVsyncPeriod(int64_t display, int32_t* outVsyncPeriod) {
-    return mDevice->getDisplayAttribute(display, 0,
-            HWC2_ATTRIBUTE_VSYNC_PERIOD, outVsyncPeriod);
+    hwc2_vsync_period_t hwcVsyncPeriod;
+    int32_t err = mDevice->getDisplayVsyncPeriod(display, &hwcVsyncPeriod);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    *outVsyncPeriod = int32_t(hwcVsyncPeriod);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::getDisplayConfigs(int64_t display, std::vector<int32_t>* outConfigs) {
+    uint32_t count = 0;
+    int32_t err = mDevice->getDisplayConfigs(display, &count, nullptr);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+
+    std::vector<hwc2_config_t> hwcConfigs(count);
+    err = mDevice->getDisplayConfigs(display, &count, hwcConfigs.data());
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    hwcConfigs.resize(count);
+
+    h2a::translate(hwcConfigs, *outConfigs);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::getActiveConfig(int64_t display, int32_t* outConfig) {
+    hwc2_config_t hwcConfig;
+    int32_t err = mDevice->getActiveConfig(display, &hwcConfig);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    *outConfig = int32_t(hwcConfig);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::setActiveConfigWithConstraints(int64_t display, int32_t config,
+                                                    const VsyncPeriodChangeConstraints& constraints,
+                                                    VsyncPeriodChangeTimeline* outTimeline) {
+    hwc_vsync_period_change_constraints_t hwcConstraints;
+    a2h::translate(constraints, hwcConstraints);
+
+    hwc_vsync_period_change_timeline_t hwcTimeline;
+    int32_t err = mDevice->setActiveConfigWithConstraints(display, config, &hwcConstraints,
+                                                          &hwcTimeline);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    h2a::translate(hwcTimeline, *outTimeline);
+    return HWC2_ERROR_NONE;
+}
+
+
+int32_t ComposerHal::getSupportedContentTypes(int64_t display,
+                                              std::vector<ContentType>* outTypes) {
+    uint32_t count = 0;
+    int32_t err = mDevice->getSupportedContentTypes(display, &count, nullptr);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+
+    std::vector<uint32_t> hwcTypes(count);
+    err = mDevice->getSupportedContentTypes(display, &count, hwcTypes.data());
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    hwcTypes.resize(count);
+
+    outTypes->clear();
+    for (auto type : hwcTypes) {
+        outTypes->push_back(static_cast<ContentType>(type));
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::setContentType(int64_t display, ContentType type) {
+    return mDevice->setContentType(display, static_cast<int32_t>(type));
+}
+
+int32_t ComposerHal::setColorTransform(int64_t display, const std::vector<float>& matrix) {
+    if (matrix.size() != 16) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    return mDevice->setColorTransform(display, matrix.data());
+}
+
+int32_t ComposerHal::getDisplayCapabilities(int64_t display,
+                                            std::vector<DisplayCapability>* outCaps) {
+    uint32_t count = 0;
+    int32_t err = mDevice->getDisplayCapabilities(display, &count, nullptr);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+
+    std::vector<uint32_t> hwcCaps(count);
+    err = mDevice->getDisplayCapabilities(display, &count, hwcCaps.data());
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    hwcCaps.resize(count);
+
+    outCaps->clear();
+    for (auto cap : hwcCaps) {
+        outCaps->push_back(static_cast<DisplayCapability>(cap));
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::setDisplayBrightness(int64_t display, float brightness) {
+    return mDevice->setDisplayBrightness(display, brightness);
+}
+
+int32_t ComposerHal::flushDisplayBrightnessChange(int64_t display) {
+    return mDevice->flushDisplayBrightnessChange(display);
 }
 
+int32_t ComposerHal::getDisplayedContentSamplingAttributes(
+        int64_t display, DisplayContentSamplingAttributes* outAttrs) {
+    int32_t format;
+    int32_t dataspace;
+    uint8_t componentMask;
+    int32_t err = mDevice->getDisplayedContentSamplingAttributes(display, &format, &dataspace,
+                                                                 &componentMask);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    outAttrs->format = static_cast<common::PixelFormat>(format);
+    outAttrs->dataspace = static_cast<common::Dataspace>(dataspace);
+    outAttrs->componentMask = static_cast<FormatColorComponent>(componentMask);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::setDisplayedContentSamplingEnabled(int64_t display, bool enable,
+                                                        FormatColorComponent componentMask,
+                                                        int64_t maxFrames) {
+    if (maxFrames < 0) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    return mDevice->setDisplayedContentSamplingEnabled(
+            display,
+            enable ? HWC2_DISPLAYED_CONTENT_SAMPLING_ENABLE
+                   : HWC2_DISPLAYED_CONTENT_SAMPLING_DISABLE,
+            static_cast<uint8_t>(componentMask), uint64_t(maxFrames));
+}
+
+int32_t ComposerHal::getDisplayedContentSample(int64_t display, int64_t maxFrames,
+                                               int64_t timestamp,
+                                               DisplayContentSample* outSamples) {
+    if (maxFrames < 0 || timestamp < 0) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    uint64_t frameCount = 0;
+    int32_t samplesSize[4] = {};
+    int32_t err = mDevice->getDisplayedContentSample(display, uint64_t(maxFrames),
+                                                     uint64_t(timestamp), &frameCount,
+                                                     samplesSize, nullptr);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+
+    std::vector<uint64_t> samples[4];
+    uint64_t* samplesData[4];
+    for (int i = 0; i < 4; i++) {
+        samples[i].resize(samplesSize[i]);
+        samplesData[i] = samples[i].data();
+    }
+    err = mDevice->getDisplayedContentSample(display, uint64_t(maxFrames), uint64_t(timestamp),
+                                             &frameCount, samplesSize, samplesData);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+
+    outSamples->frameCount = int64_t(frameCount);
+    outSamples->sampleComponent0.assign(samples[0].begin(), samples[0].end());
+    outSamples->sampleComponent1.assign(samples[1].begin(), samples[1].end());
+    outSamples->sampleComponent2.assign(samples[2].begin(), samples[2].end());
+    outSamples->sampleComponent3.assign(samples[3].begin(), samples[3].end());
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::getReadbackBufferAttributes(int64_t display,
+                                                 ReadbackBufferAttributes* outAttributes) {
+    int32_t format;
+    int32_t dataspace;
+    int32_t err = mDevice->getReadbackBufferAttributes(display, &format, &dataspace);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    outAttributes->format = static_cast<common::PixelFormat>(format);
+    outAttributes->dataspace = static_cast<common::Dataspace>(dataspace);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::setReadbackBuffer(int64_t display, buffer_handle_t buffer,
+                                       const ndk::ScopedFileDescriptor& releaseFence) {
+    int32_t hwcFence;
+    a2h::translate(releaseFence, hwcFence);
+    return mDevice->setReadbackBuffer(display, buffer, hwcFence);
+}
+
+int32_t ComposerHal::getReadbackBufferFence(int64_t display,
+                                            ndk::ScopedFileDescriptor* outFence) {
+    int32_t hwcFence = -1;
+    int32_t err = mDevice->getReadbackBufferFence(display, &hwcFence);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    h2a::translate(hwcFence, *outFence);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::getMaxVirtualDisplayCount(int32_t* outCount) {
+    uint32_t count = 0;
+    int32_t err = mDevice->getMaxVirtualDisplayCount(&count);
+    *outCount = static_cast<int32_t>(count);
+    return err;
+}
+
+int32_t ComposerHal::createVirtualDisplay(uint32_t width, uint32_t height,
+                                          common::PixelFormat format,
+                                          VirtualDisplay* outDisplay) {
+    int32_t hwcFormat = static_cast<int32_t>(format);
+    hwc2_display_t hwcDisplay;
+    int32_t err = mDevice->createVirtualDisplay(width, height, &hwcFormat, &hwcDisplay);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    outDisplay->display = static_cast<int64_t>(hwcDisplay);
+    outDisplay->format = static_cast<common::PixelFormat>(hwcFormat);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t ComposerHal::destroyVirtualDisplay(int64_t display) {
+    return mDevice->destroyVirtualDisplay(display);
+}
+
+int32_t ComposerHal::setOutputBuffer(int64_t display, buffer_handle_t buffer,
+                                     const ndk::ScopedFileDescriptor& releaseFence) {
+    int32_t hwcFence;
+    a2h::translate(releaseFence, hwcFence);
+    return mDevice->setOutputBuffer(display, buffer, hwcFence);
+}
 
 int32_t ComposerHal::setVsyncEnabled(int64_t display, bool enabled) {
     int32_t err = mDevice->setVsyncEnabled(display, static_cast<int32_t>(enabled));
     return err;
 }
 
+int32_t ComposerHal::setIdleTimerEnabled(int64_t display, int32_t timeout) {
+    return mDevice->setIdleTimerEnabled(display, timeout);
+}
+
+int32_t ComposerHal::setPowerMode(int64_t display, PowerMode mode) {
+    return mDevice->setPowerMode(display, static_cast<int32_t>(mode));
+}
+
 int32_t ComposerHal::setClientTarget(int64_t display, buffer_handle_t target,
                                  const ndk::ScopedFileDescriptor& fence,
                                  common::Dataspace dataspace,
-   			     const std::vector<common::Rect>& /*damage*/) {
+   			     const std::vector<common::Rect>& damage) {
 
     int32_t hwcFence;
     int32_t hwcDataspace;
+    std::vector<hwc_rect_t> hwcDamage;
     a2h::translate(fence, hwcFence);
     a2h::translate(dataspace, hwcDataspace);
+    a2h::translate(damage, hwcDamage);
+    hwc_region_t region = {hwcDamage.size(), hwcDamage.data()};
     
     int32_t err =
-        mDevice->setClientTarget(display, target, hwcFence, hwcDataspace);
+        mDevice->setClientTarget(display, target, hwcFence, hwcDataspace, region);
     return err;
 }
 
@@ -130,7 +396,9 @@ int32_t ComposerHal::validateDisplay(int64_t display, std::vector<int64_t>* outC
                                  std::vector<int64_t>* outRequestedLayers,
    			     std::vector<int32_t>* /*outRequestMasks*/,
 				 ClientTargetProperty* /*outClientTargetProperty*/,
-				 DimmingStage* /*outDimmingStage*/) {
+				 DimmingStage* outDimmingStage) {
+    // dimmed layers go to the client, the display dims in its gamma LUT
+    *outDimmingStage = DimmingStage::NONE;
     uint32_t typesCount = 0;
     uint32_t reqsCount = 0;
     int32_t err = mDevice->validateDisplay(display, &typesCount, &reqsCount);
@@ -166,6 +434,12 @@ int32_t ComposerHal::validateDisplay(int64_t display, std::vector<int64_t>* outC
     return err;
 }
 
+int32_t ComposerHal::setExpectedPresentTime(
+        int64_t display, const std::optional<ClockMonotonicTimestamp>& expectedPresentTime) {
+    return mDevice->setExpectedPresentTime(
+            display, expectedPresentTime ? expectedPresentTime->timestampNanos : 0);
+}
+
 int32_t ComposerHal::presentDisplay(int64_t display, ndk::ScopedFileDescriptor& outPresentFence,
                        std::vector<int64_t>* outLayers,
                        std::vector<ndk::ScopedFileDescriptor>* outReleaseFences) {
@@ -180,8 +454,23 @@ int32_t ComposerHal::presentDisplay(int64_t display, ndk::ScopedFileDescriptor&
     }
 
     h2a::translate(hwcFence, outPresentFence);    
-    outLayers->resize(0);
-    std::vector<int32_t> hwcFences(0);
+
+    uint32_t count = 0;
+    err = mDevice->getReleaseFences(display, &count, nullptr, nullptr);
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+
+    std::vector<hwc2_layer_t> hwcLayers(count);
+    std::vector<int32_t> hwcFences(count);
+    err = mDevice->getReleaseFences(display, &count, hwcLayers.data(), hwcFences.data());
+    if (err != HWC2_ERROR_NONE) {
+        return err;
+    }
+    hwcLayers.resize(count);
+    hwcFences.resize(count);
+
+    h2a::translate(hwcLayers, *outLayers);
     h2a::translate(hwcFences, *outReleaseFences);
 
     return HWC2_ERROR_NONE;
@@ -192,6 +481,40 @@ int32_t ComposerHal::acceptDisplayChanges(int64_t display) {
     return err;
 }
 
+int32_t ComposerHal::setLayerBuffer(int64_t display, int64_t layer, buffer_handle_t buffer,
+                                    const ndk::ScopedFileDescriptor& acquireFence) {
+    int32_t hwcFence;
+    a2h::translate(acquireFence, hwcFence);
+
+    int32_t err = mDevice->setLayerBuffer(display, layer, buffer, hwcFence);
+    return err;
+}
+
+int32_t ComposerHal::setLayerCursorPosition(int64_t display, int64_t layer, int32_t x, int32_t y) {
+    int32_t err = mDevice->setLayerCursorPosition(display, layer, x, y);
+    return err;
+}
+
+int32_t ComposerHal::setLayerColorTransform(int64_t display, int64_t layer,
+                                            const std::vector<float>& matrix) {
+    if (matrix.size() != 16) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    return mDevice->setLayerColorTransform(display, layer, matrix.data());
+}
+
+int32_t ComposerHal::setLayerBrightness(int64_t display, int64_t layer, float brightness) {
+    return mDevice->setLayerBrightness(display, layer, brightness);
+}
+
+int32_t ComposerHal::setLayerBlendMode(int64_t display, int64_t layer, common::BlendMode mode) {
+    int32_t hwcMode;
+    a2h::translate(mode, hwcMode);
+
+    int32_t err = mDevice->setLayerBlendMode(display, layer, hwcMode);
+    return err;
+}
+
 int32_t ComposerHal::setLayerCompositionType(int64_t display, int64_t layer, Composition type) {
     int32_t hwcType;
     a2h::translate(type, hwcType);
@@ -200,4 +523,55 @@ int32_t ComposerHal::setLayerCompositionType(int64_t display, int64_t layer, Com
     return err;
 }
 
+int32_t ComposerHal::setLayerDisplayFrame(int64_t display, int64_t layer,
+                                          const common::Rect& frame) {
+    hwc_rect_t hwcFrame;
+    a2h::translate(frame, hwcFrame);
+
+    int32_t err = mDevice->setLayerDisplayFrame(display, layer, hwcFrame);
+    return err;
+}
+
+int32_t ComposerHal::setLayerPlaneAlpha(int64_t display, int64_t layer, float alpha) {
+    int32_t err = mDevice->setLayerPlaneAlpha(display, layer, alpha);
+    return err;
+}
+
+int32_t ComposerHal::setLayerSourceCrop(int64_t display, int64_t layer,
+                                        const common::FRect& crop) {
+    hwc_frect_t hwcCrop;
+    a2h::translate(crop, hwcCrop);
+
+    int32_t err = mDevice->setLayerSourceCrop(display, layer, hwcCrop);
+    return err;
+}
+
+int32_t ComposerHal::setLayerSurfaceDamage(int64_t display, int64_t layer,
+                                           const std::vector<std::optional<common::Rect>>& damage) {
+    std::vector<hwc_rect_t> hwcDamage;
+    a2h::translate(damage, hwcDamage);
+    hwc_region_t region = {hwcDamage.size(), hwcDamage.data()};
+
+    int32_t err = mDevice->setLayerSurfaceDamage(display, layer, region);
+    return err;
+}
+
+int32_t ComposerHal::setLayerTransform(int64_t display, int64_t layer,
+                                       common::Transform transform) {
+    int32_t hwcTransform;
+    a2h::translate(transform, hwcTransform);
+
+    int32_t err = mDevice->setLayerTransform(display, layer, hwcTransform);
+    return err;
+}
+
+int32_t ComposerHal::setLayerZOrder(int64_t display, int64_t layer, uint32_t z) {
+    int32_t err = mDevice->setLayerZOrder(display, layer, z);
+    return err;
+}
+
+void ComposerHal::releaseBuffer(buffer_handle_t buffer) {
+    mDevice->releaseBuffer(buffer);
+}
+
 } // namespace aidl::android::hardware::graphics::composer3::impl
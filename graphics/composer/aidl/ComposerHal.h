@@ -41,7 +41,39 @@ class ComposerHal : public IComposerHal {
                               DisplayAttribute attribute, int32_t* outValue) override;
     int32_t getDisplayName(int64_t display, std::string* outName)override ;
     int32_t getDisplayVsyncPeriod(int64_t display, int32_t* outVsyncPeriod) override;
+    int32_t getDisplayConfigs(int64_t display, std::vector<int32_t>* outConfigs) override;
+    int32_t getActiveConfig(int64_t display, int32_t* outConfig) override;
+    int32_t setActiveConfigWithConstraints(int64_t display, int32_t config,
+                                           const VsyncPeriodChangeConstraints& constraints,
+                                           VsyncPeriodChangeTimeline* outTimeline) override;
+    int32_t getSupportedContentTypes(int64_t display, std::vector<ContentType>* outTypes) override;
+    int32_t setContentType(int64_t display, ContentType type) override;
+    int32_t setColorTransform(int64_t display, const std::vector<float>& matrix) override;
+    int32_t getDisplayCapabilities(int64_t display,
+                                   std::vector<DisplayCapability>* outCaps) override;
+    int32_t setDisplayBrightness(int64_t display, float brightness) override;
+    int32_t flushDisplayBrightnessChange(int64_t display) override;
+    int32_t getDisplayedContentSamplingAttributes(
+            int64_t display, DisplayContentSamplingAttributes* outAttrs) override;
+    int32_t setDisplayedContentSamplingEnabled(int64_t display, bool enable,
+                                               FormatColorComponent componentMask,
+                                               int64_t maxFrames) override;
+    int32_t getDisplayedContentSample(int64_t display, int64_t maxFrames, int64_t timestamp,
+                                      DisplayContentSample* outSamples) override;
+    int32_t getReadbackBufferAttributes(int64_t display,
+                                        ReadbackBufferAttributes* outAttributes) override;
+    int32_t setReadbackBuffer(int64_t display, buffer_handle_t buffer,
+                              const ndk::ScopedFileDescriptor& releaseFence) override;
+    int32_t getReadbackBufferFence(int64_t display, ndk::ScopedFileDescriptor* outFence) override;
+    int32_t getMaxVirtualDisplayCount(int32_t* outCount) override;
+    int32_t createVirtualDisplay(uint32_t width, uint32_t height, common::PixelFormat format,
+                                 VirtualDisplay* outDisplay) override;
+    int32_t destroyVirtualDisplay(int64_t display) override;
+    int32_t setOutputBuffer(int64_t display, buffer_handle_t buffer,
+                            const ndk::ScopedFileDescriptor& releaseFence) override;
     int32_t setVsyncEnabled(int64_t display, bool enabled);
+    int32_t setIdleTimerEnabled(int64_t display, int32_t timeout) override;
+    int32_t setPowerMode(int64_t display, PowerMode mode) override;
     int32_t setClientTarget(int64_t display, buffer_handle_t target,
                             const ndk::ScopedFileDescriptor& fence, common::Dataspace dataspace,
                             const std::vector<common::Rect>& damage) override;  
@@ -52,13 +84,34 @@ class ComposerHal : public IComposerHal {
                             std::vector<int32_t>* outRequestMasks,
                             ClientTargetProperty* outClientTargetProperty,
                             DimmingStage* outDimmingStage) override;
+    int32_t setExpectedPresentTime(
+            int64_t display,
+            const std::optional<ClockMonotonicTimestamp>& expectedPresentTime) override;
     int32_t presentDisplay(int64_t display, ndk::ScopedFileDescriptor& outPresentFence,
                            std::vector<int64_t>* outLayers,
                            std::vector<ndk::ScopedFileDescriptor>* outReleaseFences) override;
   
     int32_t acceptDisplayChanges(int64_t display);
 
+    int32_t setLayerBuffer(int64_t display, int64_t layer, buffer_handle_t buffer,
+                           const ndk::ScopedFileDescriptor& acquireFence) override;
+    int32_t setLayerBlendMode(int64_t display, int64_t layer, common::BlendMode mode) override;
+    int32_t setLayerCursorPosition(int64_t display, int64_t layer, int32_t x, int32_t y) override;
+    int32_t setLayerColorTransform(int64_t display, int64_t layer,
+                                   const std::vector<float>& matrix) override;
+    int32_t setLayerBrightness(int64_t display, int64_t layer, float brightness) override;
     int32_t setLayerCompositionType(int64_t display, int64_t layer, Composition type) override;
+    int32_t setLayerDisplayFrame(int64_t display, int64_t layer,
+                                 const common::Rect& frame) override;
+    int32_t setLayerPlaneAlpha(int64_t display, int64_t layer, float alpha) override;
+    int32_t setLayerSourceCrop(int64_t display, int64_t layer,
+                               const common::FRect& crop) override;
+    int32_t setLayerSurfaceDamage(int64_t display, int64_t layer,
+                                  const std::vector<std::optional<common::Rect>>& damage) override;
+    int32_t setLayerTransform(int64_t display, int64_t layer,
+                              common::Transform transform) override;
+    int32_t setLayerZOrder(int64_t display, int64_t layer, uint32_t z) override;
+    void releaseBuffer(buffer_handle_t buffer) override;
 
   private:
 
@@ -75,6 +128,15 @@ class ComposerHal : public IComposerHal {
         hal->mEventCallback->onVsync(display, timestamp, vsyncPeriodNanos);
     }
 
+    static void vsyncIdleHook(hwc2_callback_data_t callbackData, hwc2_display_t display) {
+        auto hal = static_cast<ComposerHal*>(callbackData);
+        hal->mEventCallback->onVsyncIdle(display);
+    }
+
+    static void vsyncPeriodTimingChangedHook(hwc2_callback_data_t callbackData,
+                                             hwc2_display_t display,
+                                             hwc_vsync_period_change_timeline_t* hwcTimeline);
+
     std::unique_ptr<Hwc2Device> mDevice;
 
     std::unordered_set<hwc2_capability_t> mCapabilities;
@@ -17,217 +17,1576 @@
 #define LOG_TAG "composer-Hwc2Device"
 //#define LOG_NDEBUG 0
 #include <android-base/logging.h>
+#include <cutils/properties.h>
 #include <utils/Log.h>
 #include <utils/Trace.h>
 
+#include <sync/sync.h>
 #include <sys/prctl.h>
+#include <algorithm>
+#include <chrono>
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <iterator>
 #include <sstream>
 
-#include <sync/sync.h>
-
 #include "Hwc2Device.h"
+#include "fence_monitor.h"
 
 namespace aidl::android::hardware::graphics::composer3::impl {
 
+static bool sameRect(const hwc_rect_t& a, const hwc_rect_t& b) {
+    return a.left == b.left && a.top == b.top && a.right == b.right && a.bottom == b.bottom;
+}
+
+static bool sameRect(const hwc_frect_t& a, const hwc_frect_t& b) {
+    return a.left == b.left && a.top == b.top && a.right == b.right && a.bottom == b.bottom;
+}
+
+// Whether the plane assignment made for one buffer holds for the other.
+static bool sameLayout(buffer_handle_t a, buffer_handle_t b) {
+    if (a == b) {
+        return true;
+    }
+    if (private_handle_t::validate(a) < 0 || private_handle_t::validate(b) < 0) {
+        return false;
+    }
+    auto ha = reinterpret_cast<const private_handle_t*>(a);
+    auto hb = reinterpret_cast<const private_handle_t*>(b);
+    return ha->width == hb->width && ha->height == hb->height && ha->format == hb->format &&
+           ha->stride == hb->stride && ha->modifier == hb->modifier;
+}
+
+// bounding box of both
+static hwc_rect_t unionRect(const hwc_rect_t& a, const hwc_rect_t& b) {
+    if (a.left >= a.right || a.top >= a.bottom) {
+        return b;
+    }
+    if (b.left >= b.right || b.top >= b.bottom) {
+        return a;
+    }
+    return {std::min(a.left, b.left), std::min(a.top, b.top),
+            std::max(a.right, b.right), std::max(a.bottom, b.bottom)};
+}
+
+// A rect of a layer buffer on the display, with the pixels next to it that
+// nearest sampling may take from it when scaling.
+static hwc_rect_t bufferToDisplay(const hwc_rect_t& rect, const hwc_frect_t& crop,
+                                  const hwc_rect_t& frame) {
+    float left = std::max(float(rect.left), crop.left);
+    float top = std::max(float(rect.top), crop.top);
+    float right = std::min(float(rect.right), crop.right);
+    float bottom = std::min(float(rect.bottom), crop.bottom);
+    if (left >= right || top >= bottom) {
+        return {};
+    }
+    float scaleX = (frame.right - frame.left) / (crop.right - crop.left);
+    float scaleY = (frame.bottom - frame.top) / (crop.bottom - crop.top);
+    int margin = scaleX == 1.0f && scaleY == 1.0f ? 0 : 1;
+    return {frame.left + int(floorf((left - crop.left) * scaleX)) - margin,
+            frame.top + int(floorf((top - crop.top) * scaleY)) - margin,
+            frame.left + int(ceilf((right - crop.left) * scaleX)) + margin,
+            frame.top + int(ceilf((bottom - crop.top) * scaleY)) + margin};
+}
+
+static std::vector<hwc_rect_t> toRects(const hwc_region_t& region) {
+    return std::vector<hwc_rect_t>(region.rects, region.rects + region.numRects);
+}
+
+#define MAX_DAMAGE_RECTS 16
+
+// No rects is a full damage, as is SurfaceFlinger's invalid rect; a single
+// empty rect is none.
+void Hwc2Device::Damage::add(const std::vector<hwc_rect_t>& damage) {
+    if (full) {
+        return;
+    }
+    if (damage.empty()) {
+        setFull();
+        return;
+    }
+    for (const auto& rect : damage) {
+        if (rect.right < rect.left || rect.bottom < rect.top) {
+            setFull();
+            return;
+        }
+        if (rect.left < rect.right && rect.top < rect.bottom) {
+            rects.push_back(rect);
+        }
+    }
+    if (rects.size() > MAX_DAMAGE_RECTS) {
+        hwc_rect_t bounds{};
+        for (const auto& rect : rects) {
+            bounds = unionRect(bounds, rect);
+        }
+        rects.assign(1, bounds);
+    }
+}
+
+std::vector<hwc_rect_t> Hwc2Device::Damage::region() const {
+    if (full) {
+        return {};
+    }
+    if (rects.empty()) {
+        return {hwc_rect_t{0, 0, 0, 0}};
+    }
+    return rects;
+}
+
+static bool isIdentity(const float* matrix) {
+    for (int i = 0; i < 16; i++) {
+        if (matrix[i] != (i % 5 == 0 ? 1.0f : 0.0f)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a buffer the size of the display that covers it
+static cpu_layer fullScreenLayer(buffer_handle_t buffer, uint32_t width, uint32_t height,
+                                 bool opaque) {
+    return {buffer, -1, {0.0f, 0.0f, float(width), float(height)},
+            {0, 0, int(width), int(height)}, 255, opaque};
+}
+
+static const char* powerModeName(int32_t mode) {
+    switch (mode) {
+        case HWC2_POWER_MODE_OFF:
+            return "off";
+        case HWC2_POWER_MODE_DOZE:
+            return "doze";
+        case HWC2_POWER_MODE_DOZE_SUSPEND:
+            return "doze suspend";
+        default:
+            return "on";
+    }
+}
+
+static int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 Hwc2Device::Hwc2Device()
 {
     ALOGV("Hwc2Device()");
     mHwcContext = std::make_unique<hwc_context>();
+    mCpuComposition = property_get_bool("debug.drm.cpu_composition", true);
+
+    for (hwc2_display_t id = 0; id < mHwcContext->num_displays(); id++) {
+        auto display = std::make_unique<Display>();
+        if (!updateInfo(id, *display)) {
+            break;
+        }
+        mDisplays.push_back(std::move(display));
+    }
+    // without writeback connectors, a virtual display is composed on the CPU
+    if (std::none_of(mDisplays.begin(), mDisplays.end(),
+                     [](const auto& display) { return display->isVirtual; })) {
+        auto display = std::make_unique<Display>();
+        display->info.name = "Virtual-CPU";
+        display->isVirtual = true;
+        mDisplays.push_back(std::move(display));
+    }
+
+    mVsyncThread.start();
+    mIdleThread = std::thread(&Hwc2Device::idleLoop, this);
+    mHwcContext->set_vsync_callback(
+            [this](hwc2_display_t display, int64_t timestamp, int64_t period) {
+                mVsyncThread.post(display, timestamp, int32_t(period));
+            });
+    mHotplugThread = std::thread(&Hwc2Device::hotplugLoop, this);
+    mHwcContext->set_hotplug_callback([this](hwc2_display_t display) {
+        {
+            std::lock_guard<std::mutex> lock(mHotplugMutex);
+            if (std::find(mHotplugQueue.begin(), mHotplugQueue.end(), display) !=
+                    mHotplugQueue.end()) {
+                return;
+            }
+            mHotplugQueue.push_back(display);
+        }
+        mHotplugCondition.notify_all();
+    });
+}
+
+// Fill in what hwc_context reports about a display, returns false for a
+// display it doesn't know.
+bool Hwc2Device::updateInfo(hwc2_display_t displayId, Display& display) {
+    kms_display_info kmsInfo;
+    if (mHwcContext->get_display_info(displayId, &kmsInfo)) {
+        return false;
+    }
+    display.info.name = kmsInfo.name;
+    display.info.format = HAL_PIXEL_FORMAT_RGBA_8888;
+    display.info.configs.clear();
+    for (const auto& kmsConfig : kmsInfo.configs) {
+        display.info.configs.push_back({kmsConfig.width, kmsConfig.height,
+                                        int(kmsConfig.vsync_period_ns),
+                                        int(kmsConfig.xdpi * 1000.0f),
+                                        int(kmsConfig.ydpi * 1000.0f),
+                                        int(kmsConfig.group)});
+    }
+    display.info.activeConfig = kmsInfo.active_config;
+    display.info.contentTypes = kmsInfo.content_types;
+    display.info.cursorPlaneId = kmsInfo.cursor_plane_id;
+    display.info.brightness = kmsInfo.brightness;
+    display.isVirtual = kmsInfo.is_virtual;
+    display.connected = kmsInfo.connected && !display.info.configs.empty();
+    return true;
+}
+
+// Called from the hotplug thread when the connector of a display may have
+// changed. A display that got connected, or another monitor on it, starts
+// over without layers or client target; the client is told after the
+// display mutex is released.
+void Hwc2Device::onHotplug(hwc2_display_t displayId) {
+    auto display = displayId < mDisplays.size() ? mDisplays[displayId].get() : nullptr;
+    if (!display) {
+        return;
+    }
+
+    bool connected;
+    {
+        std::lock_guard<std::mutex> lock(display->mutex);
+        bool wasConnected;
+        if (!mHwcContext->reprobe(displayId, &wasConnected, &connected)) {
+            return;
+        }
+        updateInfo(displayId, *display);
+        connected = display->connected;
+        // the client sets the display up again, its layers go with the old one
+        display->layers.clear();
+        display->dirtyLayers.clear();
+        display->configPending = false;
+        display->clientTarget = nullptr;
+        display->clientTargetFence.reset();
+        display->scanoutLayers.clear();
+        display->releaseLayers.clear();
+        display->releaseFence.reset();
+        freeCpuTargets(*display);
+        display->cpuFailed = false;
+        display->sampling.pending.clear();
+        display->sampling.pendingFences.clear();
+        display->colorTransform.clear();
+        display->colorTransformByClient = false;
+        display->ctmEnabled = false;
+        display->brightness = 1.0f;
+        // the CRTC of the new sink starts out on
+        display->idle = false;
+        display->powerMode = HWC2_POWER_MODE_ON;
+        updateVsync(displayId, *display);
+        display->setState(State::MODIFIED);
+    }
+
+    HWC2_PFN_HOTPLUG callback;
+    hwc2_callback_data_t callbackData;
+    {
+        std::lock_guard<std::mutex> lock(mCallbackMutex);
+        callback = mHotplugCallback;
+        callbackData = mHotplugCallbackData;
+    }
+    ALOGI("display %" PRIu64 " %s", displayId, connected ? "connected" : "disconnected");
+    if (callback) {
+        // a connected display that is connected again changed its monitor
+        callback(callbackData, displayId,
+                 connected ? HWC2_CONNECTION_CONNECTED : HWC2_CONNECTION_DISCONNECTED);
+    }
+}
+
+int32_t Hwc2Device::createLayer(hwc2_display_t displayId, hwc2_layer_t* outLayerId) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    *outLayerId = ++mNextLayerId;
+    display->layers.emplace(*outLayerId, Layer{});
+    display->setState(State::MODIFIED);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::destroyLayer(hwc2_display_t displayId, hwc2_layer_t layerId) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (display->layers.erase(layerId)) {
+        display->dirtyLayers.erase(layerId);
+        display->scanoutLayers.erase(layerId);
+        display->setState(State::MODIFIED);
+        return HWC2_ERROR_NONE;
+    } else {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+}
+
+int32_t Hwc2Device::getClientTargetSupport(hwc2_display_t displayId, uint32_t width, uint32_t height,
+                                      int32_t format, int32_t dataspace) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (dataspace != HAL_DATASPACE_UNKNOWN) {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+    // the client target may already be composed for a pending config
+    const auto& active = display->activeConfig();
+    const auto& next = display->configPending
+            ? display->info.configs[display->pendingConfig] : active;
+    bool sizeMatches = (active.width == width && active.height == height) ||
+                       (next.width == width && next.height == height);
+    return (sizeMatches && display->info.format == format)
+            ? HWC2_ERROR_NONE
+            : HWC2_ERROR_UNSUPPORTED;
+}
+
+
+int32_t Hwc2Device::getDisplayAttribute(hwc2_display_t displayId, hwc2_config_t config,
+        int32_t intAttribute, int32_t* outValue) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (config >= display->info.configs.size()) {
+        return HWC2_ERROR_BAD_CONFIG;
+    }
+    const auto& info = display->info.configs[config];
+    switch (intAttribute) {
+        case HWC2_ATTRIBUTE_WIDTH:
+            *outValue = int32_t(info.width);
+            break;
+        case HWC2_ATTRIBUTE_HEIGHT:
+            *outValue = int32_t(info.height);
+            break;
+        case HWC2_ATTRIBUTE_VSYNC_PERIOD:
+            *outValue = int32_t(info.vsync_period_ns);
+            break;
+        case HWC2_ATTRIBUTE_DPI_X:
+            *outValue = int32_t(info.xdpi_scaled);
+            break;
+        case HWC2_ATTRIBUTE_DPI_Y:
+            *outValue = int32_t(info.ydpi_scaled);
+            break;
+        case HWC2_ATTRIBUTE_CONFIG_GROUP:
+            *outValue = int32_t(info.group);
+            break;
+        default:
+            return HWC2_ERROR_BAD_PARAMETER;
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getDisplayName(hwc2_display_t displayId, uint32_t* outSize, char* outName) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    const auto& info = display->info;
+    if (outName) {
+        *outSize = info.name.copy(outName, *outSize);
+    } else {
+        *outSize = info.name.size();
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getDisplayConfigs(hwc2_display_t displayId, uint32_t* outNumConfigs,
+        hwc2_config_t* outConfigs) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    uint32_t numConfigs = uint32_t(display->info.configs.size());
+    if (outConfigs) {
+        *outNumConfigs = std::min(*outNumConfigs, numConfigs);
+        for (uint32_t i = 0; i < *outNumConfigs; i++) {
+            outConfigs[i] = i;
+        }
+    } else {
+        *outNumConfigs = numConfigs;
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getActiveConfig(hwc2_display_t displayId, hwc2_config_t* outConfig) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    *outConfig = display->info.activeConfig;
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getDisplayVsyncPeriod(hwc2_display_t displayId,
+        hwc2_vsync_period_t* outVsyncPeriod) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    *outVsyncPeriod = hwc2_vsync_period_t(display->activeConfig().vsync_period_ns);
+    return HWC2_ERROR_NONE;
+}
+
+// The switch happens with the first frame presented at or after the desired
+// time, as an atomic modeset. A refresh is always required for it, and the
+// new vsync period applies once that frame is on screen.
+int32_t Hwc2Device::setActiveConfigWithConstraints(hwc2_display_t displayId,
+        hwc2_config_t config, const hwc_vsync_period_change_constraints_t* constraints,
+        hwc_vsync_period_change_timeline_t* outTimeline) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (config >= display->info.configs.size()) {
+        return HWC2_ERROR_BAD_CONFIG;
+    }
+    const auto& active = display->activeConfig();
+    if (constraints->seamlessRequired) {
+        if (display->info.configs[config].group != active.group) {
+            return HWC2_ERROR_SEAMLESS_NOT_ALLOWED;
+        }
+        if (!mHwcContext->config_is_seamless(displayId, config)) {
+            return HWC2_ERROR_SEAMLESS_NOT_POSSIBLE;
+        }
+    }
+
+    int64_t now = nowNs();
+    if (config == display->info.activeConfig) {
+        display->configPending = false;
+        outTimeline->newVsyncAppliedTimeNanos = now;
+        outTimeline->refreshRequired = 0;
+        outTimeline->refreshTimeNanos = 0;
+        return HWC2_ERROR_NONE;
+    }
+
+    display->configPending = true;
+    display->pendingConfig = config;
+    display->pendingConfigTime = std::max(now, constraints->desiredTimeNanos);
+    display->setState(State::MODIFIED);
+    outTimeline->refreshRequired = 1;
+    outTimeline->refreshTimeNanos = display->pendingConfigTime;
+    outTimeline->newVsyncAppliedTimeNanos = display->pendingConfigTime + active.vsync_period_ns;
+    ALOGV("setActiveConfigWithConstraints(%" PRIu64 ", %u) at %" PRId64, displayId, config,
+          display->pendingConfigTime);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getSupportedContentTypes(hwc2_display_t displayId,
+        uint32_t* outNumSupportedContentTypes, uint32_t* outSupportedContentTypes) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    static const uint32_t kContentTypes[] = {
+            HWC2_CONTENT_TYPE_GRAPHICS, HWC2_CONTENT_TYPE_PHOTO,
+            HWC2_CONTENT_TYPE_CINEMA, HWC2_CONTENT_TYPE_GAME,
+    };
+    uint32_t numContentTypes = display->info.contentTypes ? std::size(kContentTypes) : 0;
+    if (outSupportedContentTypes) {
+        *outNumSupportedContentTypes = std::min(*outNumSupportedContentTypes, numContentTypes);
+        std::copy_n(kContentTypes, *outNumSupportedContentTypes, outSupportedContentTypes);
+    } else {
+        *outNumSupportedContentTypes = numContentTypes;
+    }
+    return HWC2_ERROR_NONE;
+}
+
+// The sink is told what it shows through the HDMI content type, DRM uses the
+// same values. Picking a config for the frame rate of the content is left to
+// the client, which sees the content rate configs next to the EDID ones.
+int32_t Hwc2Device::setContentType(hwc2_display_t displayId, int32_t contentType) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if (contentType < HWC2_CONTENT_TYPE_NONE || contentType > HWC2_CONTENT_TYPE_GAME) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    int ret = mHwcContext->set_content_type(displayId, uint32_t(contentType));
+    if (ret == -EOPNOTSUPP) {
+        return contentType == HWC2_CONTENT_TYPE_NONE ? HWC2_ERROR_NONE : HWC2_ERROR_UNSUPPORTED;
+    }
+    return ret ? HWC2_ERROR_BAD_DISPLAY : HWC2_ERROR_NONE;
+}
+
+// The CRTC applies the color transform to all it shows, the client target
+// included. A transform it can't apply leaves all layers to the client.
+int32_t Hwc2Device::setColorTransform(hwc2_display_t displayId, const float* matrix) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    std::vector<float> transform;
+    if (!isIdentity(matrix)) {
+        transform.assign(matrix, matrix + 16);
+    }
+    if (transform == display->colorTransform) {
+        return HWC2_ERROR_NONE;
+    }
+    display->colorTransform = std::move(transform);
+    int ret = display->colorTransform.empty()
+                      ? 0 : mHwcContext->set_color_transform(displayId, matrix);
+    display->ctmEnabled = !display->colorTransform.empty() && ret == 0;
+    if (!display->ctmEnabled) {
+        mHwcContext->set_color_transform(displayId, nullptr);
+    }
+    display->colorTransformByClient = ret != 0;
+    display->setState(State::MODIFIED);
+    return HWC2_ERROR_NONE;
+}
+
+// DisplayCapability::DISPLAY_IDLE_TIMER of composer3, past the HWC2 ones
+#define DISPLAY_CAPABILITY_IDLE_TIMER 7
+
+int32_t Hwc2Device::getDisplayCapabilities(hwc2_display_t displayId,
+        uint32_t* outNumCapabilities, uint32_t* outCapabilities) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    uint32_t capabilities[3];
+    uint32_t numCapabilities = 0;
+    if (display->info.brightness) {
+        capabilities[numCapabilities++] = HWC2_DISPLAY_CAPABILITY_BRIGHTNESS;
+    }
+    if (!display->isVirtual) {
+        capabilities[numCapabilities++] = HWC2_DISPLAY_CAPABILITY_DOZE;
+        capabilities[numCapabilities++] = DISPLAY_CAPABILITY_IDLE_TIMER;
+    }
+    if (outCapabilities) {
+        *outNumCapabilities = std::min(*outNumCapabilities, numCapabilities);
+        std::copy_n(capabilities, *outNumCapabilities, outCapabilities);
+    } else {
+        *outNumCapabilities = numCapabilities;
+    }
+    return HWC2_ERROR_NONE;
+}
+
+// Sinks on HDMI have no backlight to dim, the gamma LUT of the CRTC dims the
+// image instead of the client dimming it on the GPU. It goes out with the
+// next frame, or right away on flushDisplayBrightnessChange().
+int32_t Hwc2Device::setDisplayBrightness(hwc2_display_t displayId, float brightness) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if (brightness != -1.0f && !(brightness >= 0.0f && brightness <= 1.0f)) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (brightness == display->brightness) {
+        return HWC2_ERROR_NONE;
+    }
+    int ret = mHwcContext->set_brightness(displayId, brightness);
+    if (ret == -EOPNOTSUPP) {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+    if (ret) {
+        return ret == -EINVAL ? HWC2_ERROR_BAD_DISPLAY : HWC2_ERROR_NO_RESOURCES;
+    }
+    display->brightness = brightness;
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::flushDisplayBrightnessChange(hwc2_display_t displayId) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    mHwcContext->flush_color(displayId);
+    return HWC2_ERROR_NONE;
+}
+
+// Content sampling takes every step-th pixel of every step-th row, so that a
+// frame costs about this many at most
+#define CONTENT_SAMPLE_MAX_PIXELS 16384
+// frames whose histograms are kept apart, which also bounds the window
+#define CONTENT_SAMPLE_MAX_FRAMES 64
+#define CONTENT_SAMPLE_COMPONENTS \
+    (HWC2_FORMAT_COMPONENT_0 | HWC2_FORMAT_COMPONENT_1 | HWC2_FORMAT_COMPONENT_2)
+
+int32_t Hwc2Device::getDisplayedContentSamplingAttributes(hwc2_display_t displayId,
+        int32_t* outFormat, int32_t* outDataspace, uint8_t* outComponentMask) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    *outFormat = HAL_PIXEL_FORMAT_RGBA_8888;
+    *outDataspace = HAL_DATASPACE_SRGB;
+    *outComponentMask = CONTENT_SAMPLE_COMPONENTS;
+    return HWC2_ERROR_NONE;
+}
+
+// Frames are sampled from what the display shows: the client target or the
+// CPU target and the layers on planes, or the output buffer of a virtual
+// display. Plane layers the CPU can't map, like video, go unsampled.
+int32_t Hwc2Device::setDisplayedContentSamplingEnabled(hwc2_display_t displayId,
+        int32_t enabled, uint8_t componentMask, uint64_t maxFrames) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if ((enabled != HWC2_DISPLAYED_CONTENT_SAMPLING_ENABLE &&
+         enabled != HWC2_DISPLAYED_CONTENT_SAMPLING_DISABLE) ||
+            (componentMask & ~CONTENT_SAMPLE_COMPONENTS)) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    display->sampling = ContentSampling();
+    if (enabled == HWC2_DISPLAYED_CONTENT_SAMPLING_ENABLE) {
+        auto& sampling = display->sampling;
+        sampling.enabled = true;
+        sampling.componentMask = componentMask ? componentMask : CONTENT_SAMPLE_COMPONENTS;
+        sampling.maxFrames = std::min<uint64_t>(maxFrames, CONTENT_SAMPLE_MAX_FRAMES);
+        sampling.total.assign(3 * HISTOGRAM_BUCKETS, 0);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getDisplayedContentSample(hwc2_display_t displayId, uint64_t maxFrames,
+        uint64_t timestamp, uint64_t* outFrameCount, int32_t outSamplesSize[4],
+        uint64_t* outSamples[4]) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto& sampling = display->sampling;
+    takeSample(*display);
+
+    // the newest frames after timestamp, 0 being no bound for either
+    std::vector<uint64_t> sums(3 * HISTOGRAM_BUCKETS);
+    uint64_t frameCount = 0;
+    auto it = sampling.frames.rbegin();
+    for (; it != sampling.frames.rend() && (!maxFrames || frameCount < maxFrames) &&
+                 it->time > int64_t(timestamp);
+         ++it) {
+        for (int c = 0; c < 3; c++) {
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                sums[c * HISTOGRAM_BUCKETS + b] += it->histogram[c][b];
+            }
+        }
+        frameCount++;
+    }
+    if (it == sampling.frames.rend() && sampling.totalFrames &&
+            sampling.totalFirstTime > int64_t(timestamp) &&
+            (!maxFrames || maxFrames - frameCount >= sampling.totalFrames)) {
+        for (size_t i = 0; i < sums.size(); i++) {
+            sums[i] += sampling.total[i];
+        }
+        frameCount += sampling.totalFrames;
+    }
+
+    *outFrameCount = frameCount;
+    for (int c = 0; c < 4; c++) {
+        bool sampled = c < 3 && (sampling.componentMask & (1 << c));
+        outSamplesSize[c] = sampled ? HISTOGRAM_BUCKETS : 0;
+        if (sampled && outSamples && outSamples[c]) {
+            std::copy_n(sums.begin() + c * HISTOGRAM_BUCKETS, HISTOGRAM_BUCKETS, outSamples[c]);
+        }
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getReadbackBufferAttributes(hwc2_display_t displayId, int32_t* outFormat,
+        int32_t* outDataspace) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (mHwcContext->get_readback_format(displayId, outFormat)) {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+    // the composition as it goes to the display
+    *outDataspace = HAL_DATASPACE_SRGB;
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setReadbackBuffer(hwc2_display_t displayId, buffer_handle_t buffer,
+        int32_t releaseFence) {
+    ::android::base::unique_fd fence(releaseFence);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    int ret = mHwcContext->set_readback_buffer(displayId, buffer, fence.get());
+    if (ret == -EOPNOTSUPP) {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+    return ret ? HWC2_ERROR_BAD_PARAMETER : HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getReadbackBufferFence(hwc2_display_t displayId, int32_t* outFence) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    // no fence if the last frame with a readback buffer didn't make it
+    return mHwcContext->get_readback_fence(displayId, outFence) ? HWC2_ERROR_NO_RESOURCES
+                                                                : HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getMaxVirtualDisplayCount(uint32_t* outCount) {
+    *outCount = uint32_t(std::count_if(mDisplays.begin(), mDisplays.end(),
+                                       [](const auto& display) { return display->isVirtual; }));
+    return HWC2_ERROR_NONE;
+}
+
+// A virtual display composes through a writeback connector if it has one
+// with a free CRTC, else layers go to the client and the client target is
+// copied into the output buffer unless it is the output buffer.
+int32_t Hwc2Device::createVirtualDisplay(uint32_t width, uint32_t height, int32_t* format,
+        hwc2_display_t* outDisplay) {
+    for (hwc2_display_t id = 0; id < mDisplays.size(); id++) {
+        auto display = mDisplays[id].get();
+        if (!display->isVirtual || display->connected) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(display->mutex);
+        if (display->connected) {
+            continue;
+        }
+
+        int32_t writebackFormat;
+        display->cpuComposition = id >= mHwcContext->num_displays() ||
+                mHwcContext->create_virtual(id, width, height) ||
+                mHwcContext->get_readback_format(id, &writebackFormat);
+        if (display->cpuComposition) {
+            if (id < mHwcContext->num_displays()) {
+                mHwcContext->destroy_virtual(id);
+            }
+            display->info.format = *format == HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED
+                    ? HAL_PIXEL_FORMAT_RGBA_8888 : *format;
+            display->info.configs.assign(1, {width, height, 16666667, 0, 0, 0});
+            display->info.activeConfig = 0;
+            display->info.contentTypes = false;
+        } else {
+            updateInfo(id, *display);
+            display->info.format = writebackFormat;
+        }
+        *format = display->info.format;
+
+        display->layers.clear();
+        display->dirtyLayers.clear();
+        display->clientTarget = nullptr;
+        display->clientTargetFence.reset();
+        display->outputBuffer = nullptr;
+        display->outputBufferFence.reset();
+        display->configPending = false;
+        display->scanoutLayers.clear();
+        display->releaseLayers.clear();
+        display->releaseFence.reset();
+        display->setState(State::MODIFIED);
+        display->connected = true;
+        ALOGI("virtual display %" PRIu64 " %ux%u format %d, %s composition", id, width,
+              height, *format, display->cpuComposition ? "CPU" : "writeback");
+        *outDisplay = id;
+        return HWC2_ERROR_NONE;
+    }
+    return HWC2_ERROR_NO_RESOURCES;
+}
+
+int32_t Hwc2Device::destroyVirtualDisplay(hwc2_display_t displayId) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if (!display->isVirtual) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    display->connected = false;
+    if (!display->cpuComposition) {
+        mHwcContext->destroy_virtual(displayId);
+    }
+    freeCpuTargets(*display);
+    display->layers.clear();
+    display->dirtyLayers.clear();
+    display->clientTarget = nullptr;
+    display->clientTargetFence.reset();
+    display->outputBuffer = nullptr;
+    display->outputBufferFence.reset();
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setOutputBuffer(hwc2_display_t displayId, buffer_handle_t buffer,
+        int32_t releaseFence) {
+    ::android::base::unique_fd fence(releaseFence);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if (!display->isVirtual) {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    display->outputBuffer = buffer;
+    display->outputBufferFence = std::move(fence);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setVsyncEnabled(hwc2_display_t displayId, int32_t intEnabled) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    display->vsyncEnabled = intEnabled == HWC2_VSYNC_ENABLE;
+    updateVsync(displayId, *display);
+    return HWC2_ERROR_NONE;
+}
+
+// Off switches the CRTC off and frees what scanned out, the frames presented
+// meanwhile are dropped. Sinks on HDMI have no low power mode, DOZE shows
+// like ON and DOZE_SUSPEND keeps showing the last frame without vsync.
+// Switching back on takes the first frame, with the mode kept meanwhile.
+int32_t Hwc2Device::setPowerMode(hwc2_display_t displayId, int32_t intMode) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    switch (intMode) {
+        case HWC2_POWER_MODE_OFF:
+        case HWC2_POWER_MODE_DOZE:
+        case HWC2_POWER_MODE_DOZE_SUSPEND:
+        case HWC2_POWER_MODE_ON:
+            break;
+        default:
+            // ON_SUSPEND, without the SUSPEND capability
+            return intMode < 0 ? HWC2_ERROR_BAD_PARAMETER : HWC2_ERROR_UNSUPPORTED;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (display->isVirtual) {
+        return intMode == HWC2_POWER_MODE_ON ? HWC2_ERROR_NONE : HWC2_ERROR_UNSUPPORTED;
+    }
+    if (intMode == display->powerMode) {
+        return HWC2_ERROR_NONE;
+    }
+
+    bool off = intMode == HWC2_POWER_MODE_OFF;
+    // the mode kept for switching back on is the one of the active config
+    if (off && display->idle) {
+        leaveIdle(displayId, *display);
+    }
+    int ret = mHwcContext->set_power(displayId, !off);
+    if (ret) {
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+    ALOGI("display %" PRIu64 " power mode %s", displayId, powerModeName(intMode));
+    display->powerMode = intMode;
+    armIdleTimer(*display);
+    if (off) {
+        freeCpuTargets(*display);
+        display->sampling.pending.clear();
+        display->sampling.pendingFences.clear();
+        display->clientTargetShown = false;
+        for (auto& [id, layer] : display->layers) {
+            layer.presentedPlaneId = 0;
+            layer.planeDamage.setFull();
+        }
+    }
+    updateVsync(displayId, *display);
+    display->setState(State::MODIFIED);
+    return HWC2_ERROR_NONE;
+}
+
+// Once nothing was presented for timeoutMs, the display drops to the lowest
+// refresh rate it switches to seamlessly and stops its vsync, the client is
+// told through onVsyncIdle. The next present ramps it back up, also after
+// the timer got disabled while idle.
+int32_t Hwc2Device::setIdleTimerEnabled(hwc2_display_t displayId, int32_t timeoutMs) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if (timeoutMs < 0) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (display->isVirtual) {
+        return HWC2_ERROR_UNSUPPORTED;
+    }
+    display->idleTimeoutNs = int64_t(timeoutMs) * 1000000;
+    armIdleTimer(*display);
+    return HWC2_ERROR_NONE;
+}
+
+
+int32_t Hwc2Device::setClientTarget(hwc2_display_t displayId, buffer_handle_t target,
+        int32_t acquireFence, int32_t dataspace, hwc_region_t damage) {
+    ALOGV("setClientTarget(%p, %d)", target, acquireFence);
+    ::android::base::unique_fd fence(acquireFence);
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (dataspace != HAL_DATASPACE_UNKNOWN) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    display->clientTarget = target;
+    display->clientTargetFence = std::move(fence);
+    display->clientTargetDamage = toRects(damage);
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::validateDisplay(hwc2_display_t displayId, uint32_t* outNumTypes,
+        uint32_t* outNumRequests) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    assignPlanes(displayId, *display);
+
+    display->dirtyLayers.clear();
+    for (auto& [id, layer] : display->layers) {
+        layer.validatedType = layer.planeId || layer.cpuComposed ? HWC2_COMPOSITION_DEVICE
+                                                                 : HWC2_COMPOSITION_CLIENT;
+        // only the cursor plane moves without a frame
+        if (layer.planeId && layer.planeId == display->info.cursorPlaneId) {
+            layer.validatedType = HWC2_COMPOSITION_CURSOR;
+        }
+        if (layer.validatedType != layer.compositionType) {
+            display->dirtyLayers.insert(id);
+        }
+    }
+
+    const auto& dirtyLayers = display->dirtyLayers;
+    *outNumTypes = dirtyLayers.size();
+    *outNumRequests = 0;
+    ALOGV("validateDisplay() %u types", *outNumTypes);
+    display->validateCount++;
+    if (*outNumTypes > 0) {
+        display->setState(State::VALIDATED_WITH_CHANGES);
+        return HWC2_ERROR_HAS_CHANGES;
+    } else {
+        display->setState(State::VALIDATED);
+        return HWC2_ERROR_NONE;
+    }
+}
+
+int32_t Hwc2Device::presentDisplay(hwc2_display_t displayId, int32_t* outRetireFence) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (display->getState() != State::VALIDATED) {
+        return HWC2_ERROR_NOT_VALIDATED;
+    }
+    display->presentCount++;
+    takeSample(*display);
+
+    for (auto& [id, layer] : display->layers) {
+        if (layer.surfaceDamageSet) {
+            layer.planeDamage.add(layer.surfaceDamage);
+            layer.cpuDamage.add(layer.surfaceDamage);
+            layer.surfaceDamageSet = false;
+        }
+    }
+
+    std::vector<std::pair<hwc2_layer_t, const Layer*>> scanout;
+    for (const auto& [id, layer] : display->layers) {
+        if (layer.validatedType != HWC2_COMPOSITION_CLIENT && layer.planeId) {
+            scanout.emplace_back(id, &layer);
+        }
+    }
+    std::sort(scanout.begin(), scanout.end(),
+              [](const auto& a, const auto& b) { return a.second->z < b.second->z; });
+
+    // damage is against what the plane showed, all of it if that was something else
+    std::vector<kms_layer> layers;
+    for (const auto& [id, layer] : scanout) {
+        layers.push_back({layer->buffer, layer->sourceCrop, layer->displayFrame, layer->planeId,
+                          0, layer->acquireFence.get(),
+                          layer->presentedPlaneId == layer->planeId
+                                  ? layer->planeDamage.region() : std::vector<hwc_rect_t>(),
+                          layer->validatedType == HWC2_COMPOSITION_CURSOR});
+    }
+
+    if (display->isVirtual && display->cpuComposition) {
+        int32_t err = presentCpu(*display, outRetireFence);
+        if (display->sampling.enabled) {
+            queueOutputSample(*display, *outRetireFence);
+        }
+        return err;
+    }
+    if (display->isVirtual &&
+            mHwcContext->set_readback_buffer(displayId, display->outputBuffer,
+                                             display->outputBufferFence.get())) {
+        ALOGE("no output buffer for virtual display %" PRIu64, displayId);
+        return HWC2_ERROR_NO_RESOURCES;
+    }
+    display->outputBufferFence.reset();
+
+    if (display->idle) {
+        leaveIdle(displayId, *display);
+    }
+    bool configChanged = applyPendingConfig(displayId, *display);
+
+    // the CPU is done with its target before the commit, else the client target
+    // tells how far behind the GPU is
+    buffer_handle_t clientTarget = display->clientTarget;
+    int32_t clientTargetFence = display->clientTargetFence.get();
+    std::vector<hwc_rect_t> clientDamage;
+    hwc_rect_t cpuDamage;
+    bool cpuComposed = composeOnCpu(*display, &clientTarget, &cpuDamage);
+    bool clientComposed = false;
+
+    // the client applied the color transform if it composed everything
+    bool ctm = !display->colorTransform.empty() && !display->colorTransformByClient &&
+               std::any_of(display->layers.begin(), display->layers.end(),
+                       [](const auto& entry) {
+                           return entry.second.validatedType != HWC2_COMPOSITION_CLIENT;
+                       });
+    if (ctm != display->ctmEnabled) {
+        int err = mHwcContext->set_color_transform(displayId,
+                ctm ? display->colorTransform.data() : nullptr);
+        display->ctmEnabled = ctm && err == 0;
+        if (ctm && err) {
+            display->colorTransformByClient = true;
+            display->setState(State::MODIFIED);
+        }
+    }
+    if (cpuComposed) {
+        clientTargetFence = -1;
+        if (display->cpuTargetShown) {
+            clientDamage.assign(1, cpuDamage);
+        }
+    } else {
+        clientComposed = std::any_of(display->layers.begin(), display->layers.end(),
+                [](const auto& entry) {
+                    return entry.second.validatedType == HWC2_COMPOSITION_CLIENT;
+                });
+        if (clientTargetFence >= 0) {
+            display->gpuBusy = sync_wait(clientTargetFence, 0) < 0;
+        }
+        if (display->clientTargetShown) {
+            clientDamage = display->clientTargetDamage;
+        }
+    }
+
+    // what the frame shows, for content sampling
+    std::vector<cpu_layer> sampleLayers;
+    std::vector<::android::base::unique_fd> sampleFences;
+    if (display->sampling.enabled && !display->isVirtual) {
+        const auto& config = display->activeConfig();
+        if (clientTarget && (cpuComposed || clientComposed)) {
+            sampleLayers.push_back(fullScreenLayer(clientTarget, config.width, config.height, false));
+            if (clientTargetFence >= 0) {
+                sampleFences.emplace_back(dup(clientTargetFence));
+            }
+        }
+        for (const auto& [id, layer] : scanout) {
+            if (cpu_compositor::can_compose(layer->buffer)) {
+                sampleLayers.push_back({layer->buffer, -1, layer->sourceCrop, layer->displayFrame,
+                                        255, layer->blendMode == HWC2_BLEND_MODE_NONE});
+                if (layer->acquireFence.ok()) {
+                    sampleFences.emplace_back(dup(layer->acquireFence.get()));
+                }
+            }
+        }
+    }
+
+    // the acquire fences go to the kernel with the commit, nothing waits for them here
+    ALOGV("presentDisplay(%p, %zu layers)", clientTarget, layers.size());
+    mHwcContext->set_expected_present(displayId,
+                                      display->isVirtual ? 0 : display->expectedPresentTime);
+    display->expectedPresentTime = 0;
+    *outRetireFence = -1;
+    int ret = mHwcContext->hwc_post(displayId, clientTarget, clientTargetFence, clientDamage,
+                                    layers, outRetireFence);
+    display->clientTargetFence.reset();
+    display->clientTargetShown = ret == 0 && clientComposed;
+    display->cpuTargetShown = ret == 0 && cpuComposed;
+    // a virtual display is presented once the output buffer is written
+    int32_t writebackFence;
+    if (display->isVirtual && mHwcContext->get_readback_fence(displayId, &writebackFence) == 0) {
+        if (*outRetireFence >= 0) {
+            close(*outRetireFence);
+        }
+        *outRetireFence = writebackFence;
+    }
+    mCpuCompositor.presented(&display->cpuTargets, *outRetireFence);
+    if (display->sampling.enabled && ret == 0) {
+        if (display->isVirtual) {
+            queueOutputSample(*display, *outRetireFence);
+        } else {
+            queueSample(*display, std::move(sampleLayers), std::move(sampleFences));
+        }
+    }
+    if (configChanged) {
+        if (ret == 0) {
+            display->info.activeConfig = display->pendingConfig;
+            display->configPending = false;
+            hwc_vsync_period_change_timeline_t timeline{nowNs(), 0, 0};
+            std::lock_guard<std::mutex> callbackLock(mCallbackMutex);
+            if (mTimingCallback) {
+                mTimingCallback(mTimingCallbackData, displayId, &timeline);
+            }
+        } else {
+            // the next frame sets the mode of the config it had
+            ALOGE("switching display %" PRIu64 " to config %u failed", displayId,
+                  display->pendingConfig);
+            display->configPending = false;
+            mHwcContext->set_config(displayId, display->info.activeConfig);
+        }
+    }
+    for (const auto& [id, layer] : scanout) {
+        display->layers[id].acquireFence.reset();
+    }
+
+    // buffers of this and the previous frame's plane layers are released once
+    // the present fence signals
+    std::unordered_set<hwc2_layer_t> scanoutLayers;
+    for (const auto& entry : scanout) {
+        scanoutLayers.insert(entry.first);
+    }
+    for (auto& [id, layer] : display->layers) {
+        bool shown = ret == 0 && scanoutLayers.count(id);
+        layer.presentedPlaneId = shown ? layer.planeId : 0;
+        if (shown) {
+            layer.planeDamage.clear();
+        } else {
+            layer.planeDamage.setFull();
+        }
+    }
+    display->releaseLayers.assign(scanoutLayers.begin(), scanoutLayers.end());
+    for (auto id : display->scanoutLayers) {
+        if (!scanoutLayers.count(id) && display->hasLayer(id)) {
+            display->releaseLayers.push_back(id);
+        }
+    }
+    display->scanoutLayers = std::move(scanoutLayers);
+    display->releaseFence.reset(*outRetireFence >= 0 ? dup(*outRetireFence) : -1);
+    armIdleTimer(*display);
+    return HWC2_ERROR_NONE;
+}
+
+// All layers of a virtual display composed on the CPU are client layers,
+// the output buffer is ready once the client target is.
+// The frame a present showed is sampled at the next present, while its
+// buffers are still on screen and so neither released nor rewritten.
+void Hwc2Device::queueSample(Display& display, std::vector<cpu_layer> layers,
+                             std::vector<::android::base::unique_fd> fences) {
+    auto& sampling = display.sampling;
+    sampling.pending = std::move(layers);
+    sampling.pendingFences = std::move(fences);
+    sampling.pendingTime = nowNs();
+    sampling.pendingWidth = display.activeConfig().width;
+    sampling.pendingHeight = display.activeConfig().height;
+}
+
+// a virtual display shows what it writes into the output buffer
+void Hwc2Device::queueOutputSample(Display& display, int32_t fence) {
+    if (!cpu_compositor::can_compose(display.outputBuffer)) {
+        return;
+    }
+    std::vector<::android::base::unique_fd> fences;
+    if (fence >= 0) {
+        fences.emplace_back(dup(fence));
+    }
+    const auto& config = display.activeConfig();
+    queueSample(display, {fullScreenLayer(display.outputBuffer, config.width, config.height, true)},
+                std::move(fences));
+}
+
+// A frame whose buffers weren't ready by the next present is skipped.
+void Hwc2Device::takeSample(Display& display) {
+    auto& sampling = display.sampling;
+    if (sampling.pending.empty()) {
+        return;
+    }
+    for (const auto& fence : sampling.pendingFences) {
+        if (fence.ok() && sync_wait(fence.get(), 0) < 0) {
+            return;
+        }
+    }
+
+    uint64_t pixels = uint64_t(sampling.pendingWidth) * sampling.pendingHeight;
+    uint32_t step = std::max(uint32_t(ceil(sqrt(double(pixels) / CONTENT_SAMPLE_MAX_PIXELS))), 1u);
+    sampling.frames.emplace_back();
+    auto& frame = sampling.frames.back();
+    frame.time = sampling.pendingTime;
+    std::fill_n(&frame.histogram[0][0], 3 * HISTOGRAM_BUCKETS, 0);
+    int err = mCpuCompositor.sample(sampling.pendingWidth, sampling.pendingHeight, step,
+                                    sampling.pending, frame.histogram);
+    sampling.pending.clear();
+    sampling.pendingFences.clear();
+    if (err) {
+        ALOGV("sampling a frame failed (%s)", strerror(-err));
+        sampling.frames.pop_back();
+        return;
+    }
+
+    // an unbounded window keeps the frames that fall out of it in the total
+    size_t window = sampling.maxFrames ? sampling.maxFrames : CONTENT_SAMPLE_MAX_FRAMES;
+    while (sampling.frames.size() > window) {
+        const auto& oldest = sampling.frames.front();
+        if (!sampling.maxFrames) {
+            for (int c = 0; c < 3; c++) {
+                for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                    sampling.total[c * HISTOGRAM_BUCKETS + b] += oldest.histogram[c][b];
+                }
+            }
+            if (!sampling.totalFrames) {
+                sampling.totalFirstTime = oldest.time;
+            }
+            sampling.totalFrames++;
+        }
+        sampling.frames.pop_front();
+    }
+}
 
-    mFbInfo.name = "hwc-v3d";
-    mFbInfo.width = mHwcContext->width;
-    mFbInfo.height = mHwcContext->height;
-    mFbInfo.format = mHwcContext->format;
-    mFbInfo.vsync_period_ns = int(1e9 / mHwcContext->fps);
-    mFbInfo.xdpi_scaled = int(mHwcContext->xdpi * 1000.0f);
-    mFbInfo.ydpi_scaled = int(mHwcContext->ydpi * 1000.0f);
+// Set with every validation, the frame isn't committed before the latest
+// commit that still flips at that time.
+int32_t Hwc2Device::setExpectedPresentTime(hwc2_display_t displayId, int64_t timestamp) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    display->expectedPresentTime = timestamp;
+    return HWC2_ERROR_NONE;
+}
 
-    mVsyncThread.start(0, mFbInfo.vsync_period_ns);
+int32_t Hwc2Device::presentCpu(Display& display, int32_t* outRetireFence) {
+    *outRetireFence = -1;
+    if (!display.outputBuffer || display.clientTarget == display.outputBuffer) {
+        *outRetireFence = display.clientTargetFence.ok()
+                ? dup(display.clientTargetFence.get()) : -1;
+    } else if (display.clientTarget) {
+        mCpuCompositor.blit(display.clientTarget, display.clientTargetFence.get(),
+                            display.outputBuffer, display.outputBufferFence.get());
+    }
+    display.clientTargetFence.reset();
+    display.outputBufferFence.reset();
+    return HWC2_ERROR_NONE;
 }
 
-int32_t Hwc2Device::createLayer(hwc2_display_t displayId, hwc2_layer_t* outLayerId) {
-    if (0 != displayId && 1 != displayId ) {
+int32_t Hwc2Device::acceptDisplayChanges(hwc2_display_t displayId) {
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    *outLayerId = addLayer();
-    setState(State::MODIFIED);
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (display->getState() == State::MODIFIED) {
+        return HWC2_ERROR_NOT_VALIDATED;
+    }
+    // the client now composes with the changed types, so requesting the
+    // original ones again is a change
+    for (auto id : display->dirtyLayers) {
+        display->layers[id].compositionType = display->layers[id].validatedType;
+    }
+    display->dirtyLayers.clear();
+    display->setState(State::VALIDATED);
     return HWC2_ERROR_NONE;
 }
 
-int32_t Hwc2Device::destroyLayer(hwc2_display_t displayId, hwc2_layer_t layerId) {
-    if (0 != displayId && 1 != displayId ) {
+int32_t Hwc2Device::getChangedCompositionTypes(hwc2_display_t displayId, uint32_t* outNumElements,
+        hwc2_layer_t* outLayers, int32_t* outTypes){
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (removeLayer(layerId)) {
-        setState(State::MODIFIED);
-        return HWC2_ERROR_NONE;
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (display->getState() == State::MODIFIED) {
+        return HWC2_ERROR_NOT_VALIDATED;
+    }
+    const auto& dirtyLayers = display->dirtyLayers;
+    if (outLayers && outTypes) {
+        *outNumElements = std::min(*outNumElements, uint32_t(dirtyLayers.size()));
+        auto iter = dirtyLayers.cbegin();
+        for (uint32_t i = 0; i < *outNumElements; i++) {
+            outLayers[i] = *iter++;
+            outTypes[i] = display->layers[outLayers[i]].validatedType;
+        }
     } else {
-        return HWC2_ERROR_BAD_LAYER;
+        *outNumElements = dirtyLayers.size();
     }
+    return HWC2_ERROR_NONE;
 }
 
-int32_t Hwc2Device::getClientTargetSupport(hwc2_display_t displayId, uint32_t width, uint32_t height,
-                                      int32_t format, int32_t dataspace) {
-    if (0 != displayId && 1 != displayId ) {
+int32_t Hwc2Device::setLayerCompositionType(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t intType) {
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (dataspace != HAL_DATASPACE_UNKNOWN) {
-        return HWC2_ERROR_UNSUPPORTED;
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
     }
-    const auto& info = getInfo();
-    return (info.width == width && info.height == height && info.format == format)
-            ? HWC2_ERROR_NONE
-            : HWC2_ERROR_UNSUPPORTED;
+    if (layer->compositionType != intType) {
+        layer->compositionType = intType;
+        display->setState(State::MODIFIED);
+    }
+    return HWC2_ERROR_NONE;
 }
 
-
-int32_t Hwc2Device::getDisplayAttribute(hwc2_display_t displayId, hwc2_config_t config,
-        int32_t intAttribute, int32_t* outValue) {
-    if (0 != displayId && 1 != displayId ) {
+int32_t Hwc2Device::setLayerBuffer(hwc2_display_t displayId, hwc2_layer_t layerId,
+        buffer_handle_t buffer, int32_t acquireFence) {
+    ALOGV("setLayerBuffer(%" PRIu64 ", %p, %d)", layerId, buffer, acquireFence);
+    ::android::base::unique_fd fence(acquireFence);
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (0 != config) {
-        return HWC2_ERROR_BAD_CONFIG;
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
     }
-    const auto& info = getInfo();
-    switch (intAttribute) {
-        case HWC2_ATTRIBUTE_WIDTH:
-            *outValue = int32_t(info.width);
-            break;
-        case HWC2_ATTRIBUTE_HEIGHT:
-            *outValue = int32_t(info.height);
-            break;
-        case HWC2_ATTRIBUTE_VSYNC_PERIOD:
-            *outValue = int32_t(info.vsync_period_ns);
-            break;
-        case HWC2_ATTRIBUTE_DPI_X:
-            *outValue = int32_t(info.xdpi_scaled);
-            break;
-        case HWC2_ATTRIBUTE_DPI_Y:
-            *outValue = int32_t(info.ydpi_scaled);
-            break;
-        default:
-            return HWC2_ERROR_BAD_PARAMETER;
+    // a new buffer of the same layout keeps the planes of the last validation
+    if (!sameLayout(layer->buffer, buffer)) {
+        display->setState(State::MODIFIED);
     }
+    layer->buffer = buffer;
+    layer->acquireFence = std::move(fence);
+    layer->surfaceDamageSet = true;
     return HWC2_ERROR_NONE;
 }
 
-int32_t Hwc2Device::getDisplayName(hwc2_display_t displayId, uint32_t* outSize, char* outName) {
-    if (0 != displayId && 1 != displayId ) {
+// Moves the cursor plane right away, the next validation and present find
+// the layer where it moved and keep its planes.
+int32_t Hwc2Device::setLayerCursorPosition(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t x, int32_t y) {
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    const auto& info = mFbInfo;
-    if (outName) {
-        *outSize = info.name.copy(outName, *outSize);
-    } else {
-        *outSize = info.name.size();
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto layer = display->getLayer(layerId);
+    if (!layer || layer->compositionType != HWC2_COMPOSITION_CURSOR) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    hwc_rect_t& frame = layer->displayFrame;
+    frame = {x, y, x + frame.right - frame.left, y + frame.bottom - frame.top};
+    if (layer->presentedPlaneId && layer->presentedPlaneId == display->info.cursorPlaneId) {
+        int ret = mHwcContext->set_cursor_position(displayId, layer->presentedPlaneId, x, y);
+        if (ret) {
+            ALOGV("setLayerCursorPosition() failed (%s)", strerror(-ret));
+        }
     }
     return HWC2_ERROR_NONE;
 }
 
-int32_t Hwc2Device::setVsyncEnabled(hwc2_display_t displayId, int32_t intEnabled) {
-    if (0 != displayId && 1 != displayId ) {
+int32_t Hwc2Device::setLayerColorTransform(hwc2_display_t displayId, hwc2_layer_t layerId,
+        const float* matrix) {
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    mVsyncThread.enableCallback(intEnabled == HWC2_VSYNC_ENABLE);
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    bool colorTransform = !isIdentity(matrix);
+    if (layer->colorTransform != colorTransform) {
+        layer->colorTransform = colorTransform;
+        display->setState(State::MODIFIED);
+    }
     return HWC2_ERROR_NONE;
 }
 
+int32_t Hwc2Device::setLayerBrightness(hwc2_display_t displayId, hwc2_layer_t layerId,
+        float brightness) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    if (!(brightness >= 0.0f && brightness <= 1.0f)) {
+        return HWC2_ERROR_BAD_PARAMETER;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (layer->brightness != brightness) {
+        layer->brightness = brightness;
+        display->setState(State::MODIFIED);
+    }
+    return HWC2_ERROR_NONE;
+}
 
-int32_t Hwc2Device::setClientTarget(hwc2_display_t displayId, buffer_handle_t target,
-        int32_t acquireFence, int32_t dataspace) {
-    ALOGV("setClientTarget(%p, %d)", target, acquireFence);
-    if (acquireFence >= 0) {
-        sync_wait(acquireFence, -1);
-        close(acquireFence);
+int32_t Hwc2Device::setLayerBlendMode(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t intMode) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (layer->blendMode != intMode) {
+        layer->blendMode = intMode;
+        display->setState(State::MODIFIED);
     }
-    if (0 != displayId && 1 != displayId ) {
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::setLayerDisplayFrame(hwc2_display_t displayId, hwc2_layer_t layerId,
+        hwc_rect_t frame) {
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (dataspace != HAL_DATASPACE_UNKNOWN) {
-        return HWC2_ERROR_BAD_PARAMETER;
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (!sameRect(layer->displayFrame, frame)) {
+        layer->displayFrame = frame;
+        display->setState(State::MODIFIED);
     }
-    mBuffer = target;
     return HWC2_ERROR_NONE;
 }
 
-int32_t Hwc2Device::validateDisplay(hwc2_display_t displayId, uint32_t* outNumTypes,
-        uint32_t* outNumRequests) {
-    if (0 != displayId && 1 != displayId ) {
+int32_t Hwc2Device::setLayerPlaneAlpha(hwc2_display_t displayId, hwc2_layer_t layerId,
+        float alpha) {
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    const auto& dirtyLayers = getDirtyLayers();
-    *outNumTypes = dirtyLayers.size();
-    *outNumRequests = 0;
-    ALOGV("validateDisplay() %u types", *outNumTypes);
-    if (*outNumTypes > 0) {
-        setState(State::VALIDATED_WITH_CHANGES);
-        return HWC2_ERROR_HAS_CHANGES;
-    } else {
-        setState(State::VALIDATED);
-        return HWC2_ERROR_NONE;
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (layer->planeAlpha != alpha) {
+        layer->planeAlpha = alpha;
+        display->setState(State::MODIFIED);
     }
+    return HWC2_ERROR_NONE;
 }
 
-int32_t Hwc2Device::presentDisplay(hwc2_display_t displayId, int32_t* outRetireFence) {
-    if (0 != displayId && 1 != displayId ) {
+int32_t Hwc2Device::setLayerSourceCrop(hwc2_display_t displayId, hwc2_layer_t layerId,
+        hwc_frect_t crop) {
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (getState() != State::VALIDATED) {
-        return HWC2_ERROR_NOT_VALIDATED;
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
+    }
+    if (!sameRect(layer->sourceCrop, crop)) {
+        layer->sourceCrop = crop;
+        display->setState(State::MODIFIED);
     }
-    ALOGV("presentDisplay(%p)", mBuffer);
-    *outRetireFence = -1;
-    mHwcContext->hwc_post(displayId, mBuffer, outRetireFence);
     return HWC2_ERROR_NONE;
 }
 
-int32_t Hwc2Device::acceptDisplayChanges(hwc2_display_t displayId) {
-    if (0 != displayId && 1 != displayId ) {
+int32_t Hwc2Device::setLayerSurfaceDamage(hwc2_display_t displayId, hwc2_layer_t layerId,
+        hwc_region_t damage) {
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (getState() == State::MODIFIED) {
-        return HWC2_ERROR_NOT_VALIDATED;
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
     }
-    clearDirtyLayers();
-    setState(State::VALIDATED);
+    // damage doesn't change what can be composed how
+    layer->surfaceDamage = toRects(damage);
+    layer->surfaceDamageSet = true;
     return HWC2_ERROR_NONE;
 }
 
-int32_t Hwc2Device::getChangedCompositionTypes(hwc2_display_t displayId, uint32_t* outNumElements,
-        hwc2_layer_t* outLayers, int32_t* outTypes){
-    if (0 != displayId && 1 != displayId ) {
+int32_t Hwc2Device::setLayerTransform(hwc2_display_t displayId, hwc2_layer_t layerId,
+        int32_t intTransform) {
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (getState() == State::MODIFIED) {
-        return HWC2_ERROR_NOT_VALIDATED;
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
+        return HWC2_ERROR_BAD_LAYER;
     }
-    const auto& dirtyLayers = getDirtyLayers();
-    if (outLayers && outTypes) {
-        *outNumElements = std::min(*outNumElements, uint32_t(dirtyLayers.size()));
-        auto iter = dirtyLayers.cbegin();
-        for (uint32_t i = 0; i < *outNumElements; i++) {
-            outLayers[i] = *iter++;
-            outTypes[i] = HWC2_COMPOSITION_CLIENT;
-        }
-    } else {
-        *outNumElements = dirtyLayers.size();
+    if (layer->transform != intTransform) {
+        layer->transform = intTransform;
+        display->setState(State::MODIFIED);
     }
     return HWC2_ERROR_NONE;
 }
 
-int32_t Hwc2Device::setLayerCompositionType(hwc2_display_t displayId, hwc2_layer_t layerId,
-        int32_t intType) {
-    if (0 != displayId && 1 != displayId ) {
+int32_t Hwc2Device::setLayerZOrder(hwc2_display_t displayId, hwc2_layer_t layerId, uint32_t z) {
+    auto display = getDisplay(displayId);
+    if (!display) {
         return HWC2_ERROR_BAD_DISPLAY;
     }
-    if (!markLayerDirty(layerId, intType != HWC2_COMPOSITION_CLIENT)) {
+    std::lock_guard<std::mutex> lock(display->mutex);
+    auto layer = display->getLayer(layerId);
+    if (!layer) {
         return HWC2_ERROR_BAD_LAYER;
     }
-    setState(State::MODIFIED);
+    if (layer->z != z) {
+        layer->z = z;
+        display->setState(State::MODIFIED);
+    }
+    return HWC2_ERROR_NONE;
+}
+
+int32_t Hwc2Device::getReleaseFences(hwc2_display_t displayId, uint32_t* outNumElements,
+        hwc2_layer_t* outLayers, int32_t* outFences) {
+    auto display = getDisplay(displayId);
+    if (!display) {
+        return HWC2_ERROR_BAD_DISPLAY;
+    }
+    std::lock_guard<std::mutex> lock(display->mutex);
+    if (outLayers && outFences) {
+        *outNumElements = std::min(*outNumElements, uint32_t(display->releaseLayers.size()));
+        for (uint32_t i = 0; i < *outNumElements; i++) {
+            outLayers[i] = display->releaseLayers[i];
+            outFences[i] = display->releaseFence.ok() ? dup(display->releaseFence.get()) : -1;
+        }
+    } else {
+        *outNumElements = display->releaseLayers.size();
+    }
     return HWC2_ERROR_NONE;
 }
 
+void Hwc2Device::releaseBuffer(buffer_handle_t buffer) {
+    // a frame waiting to be sampled can't be once a buffer of it is gone
+    for (auto& display : mDisplays) {
+        std::lock_guard<std::mutex> lock(display->mutex);
+        auto& pending = display->sampling.pending;
+        if (std::any_of(pending.begin(), pending.end(),
+                        [buffer](const cpu_layer& layer) { return layer.buffer == buffer; })) {
+            pending.clear();
+            display->sampling.pendingFences.clear();
+        }
+    }
+    mHwcContext->release_buffer(buffer);
+    mCpuCompositor.release_buffer(buffer);
+}
+
 void Hwc2Device::dump(uint32_t* outSize, char* outBuffer)
 {
     if (outBuffer != nullptr) {
@@ -238,6 +1597,42 @@ void Hwc2Device::dump(uint32_t* outSize, char* outBuffer)
 
     std::stringstream output;
     output << "-- hwc-v3d --\n";
+    for (size_t id = 0; id < mDisplays.size(); id++) {
+        auto display = mDisplays[id].get();
+        std::lock_guard<std::mutex> lock(display->mutex);
+        if (!display->connected) {
+            output << "display " << id << " " << display->info.name << " (disconnected)\n";
+            continue;
+        }
+        const auto& config = display->activeConfig();
+        output << "display " << id << " " << display->info.name << " config "
+               << display->info.activeConfig << " " << config.width << "x" << config.height
+               << "@" << (config.vsync_period_ns ? 1e9 / config.vsync_period_ns : 0.0) << "Hz"
+               << (display->configPending ? " (switch pending)" : "")
+               << (display->isVirtual ? (display->cpuComposition ? " (virtual, CPU)"
+                                                                 : " (virtual, writeback)")
+                                      : "")
+               << ": "
+               << display->layers.size() << " layers, "
+               << display->presentCount << " presents, " << display->validateCount
+               << " validations, layer state generation " << display->generation
+               << (display->cpuLayers.empty() ? "" : ", CPU composition")
+               << (display->colorTransform.empty() ? ""
+                   : display->colorTransformByClient ? ", color transform by client"
+                   : display->ctmEnabled ? ", color transform on CRTC" : "")
+               << (display->brightness == 1.0f ? ""
+                   : display->brightness < 0.0f ? ", brightness off"
+                   : ", brightness " + std::to_string(display->brightness))
+               << (display->sampling.enabled ? ", content sampling" : "")
+               << (display->idle ? ", idle at config " + std::to_string(display->idleConfig)
+                   : display->idleTimeoutNs ? ", idle timer" : "")
+               << (display->powerMode == HWC2_POWER_MODE_ON ? ""
+                   : std::string(", power ") + powerModeName(display->powerMode))
+               << (display->gpuBusy ? ", GPU busy" : "") << "\n";
+    }
+    output << mHwcContext->dump();
+    output << mCpuCompositor.dump();
+    output << fence_monitor::get().dump();
     mDumpString = output.str();
     *outSize = static_cast<uint32_t>(mDumpString.size());
 }
@@ -245,21 +1640,36 @@ void Hwc2Device::dump(uint32_t* outSize, char* outBuffer)
 int32_t Hwc2Device::registerCallback(int32_t intDesc, hwc2_callback_data_t callbackData,
         hwc2_function_pointer_t pointer) {
     switch (intDesc) {
-        case HWC2_CALLBACK_HOTPLUG:
+        case HWC2_CALLBACK_HOTPLUG: {
+            std::lock_guard<std::mutex> lock(mCallbackMutex);
+            mHotplugCallback = reinterpret_cast<HWC2_PFN_HOTPLUG>(pointer);
+            mHotplugCallbackData = callbackData;
             if (pointer) {
-                reinterpret_cast<HWC2_PFN_HOTPLUG>(pointer)(callbackData, 0,
-                                                            HWC2_CONNECTION_CONNECTED);
-
-                if (mHwcContext->is_display2_active())
-                    reinterpret_cast<HWC2_PFN_HOTPLUG>(pointer)(callbackData, 1,
-                                                            HWC2_CONNECTION_CONNECTED);
+                for (hwc2_display_t id = 0; id < mDisplays.size(); id++) {
+                    if (mDisplays[id]->connected && !mDisplays[id]->isVirtual) {
+                        mHotplugCallback(callbackData, id, HWC2_CONNECTION_CONNECTED);
+                    }
+                }
             }
             break;
+        }
         case HWC2_CALLBACK_REFRESH:
             break;
-        case HWC2_CALLBACK_VSYNC:
-            mVsyncThread.setCallback(reinterpret_cast<HWC2_PFN_VSYNC>(pointer), callbackData);
+        case HWC2_CALLBACK_VSYNC_2_4:
+            mVsyncThread.setCallback(reinterpret_cast<HWC2_PFN_VSYNC_2_4>(pointer), callbackData);
+            break;
+        case HWC2_CALLBACK_VSYNC_PERIOD_TIMING_CHANGED: {
+            std::lock_guard<std::mutex> lock(mCallbackMutex);
+            mTimingCallback = reinterpret_cast<HWC2_PFN_VSYNC_PERIOD_TIMING_CHANGED>(pointer);
+            mTimingCallbackData = callbackData;
+            break;
+        }
+        case CALLBACK_VSYNC_IDLE: {
+            std::lock_guard<std::mutex> lock(mCallbackMutex);
+            mVsyncIdleCallback = reinterpret_cast<PFN_VSYNC_IDLE>(pointer);
+            mVsyncIdleCallbackData = callbackData;
             break;
+        }
         default:
             return HWC2_ERROR_BAD_PARAMETER;
     }
@@ -267,76 +1677,382 @@ int32_t Hwc2Device::registerCallback(int32_t intDesc, hwc2_callback_data_t callb
     return HWC2_ERROR_NONE;
 }
 
+// Hand a pending config to hwc_context once its time has come and the frame
+// was composed for its size, so the next post sets its mode.
+bool Hwc2Device::applyPendingConfig(hwc2_display_t displayId, Display& display) {
+    if (!display.configPending || nowNs() < display.pendingConfigTime) {
+        return false;
+    }
+    const auto& next = display.info.configs[display.pendingConfig];
+    const auto& active = display.activeConfig();
+    if (next.width != active.width || next.height != active.height) {
+        if (private_handle_t::validate(display.clientTarget) < 0) {
+            return false;
+        }
+        auto hnd = reinterpret_cast<const private_handle_t*>(display.clientTarget);
+        if (uint32_t(hnd->width) != next.width || uint32_t(hnd->height) != next.height) {
+            return false;
+        }
+    }
+    return mHwcContext->set_config(displayId, display.pendingConfig) == 0;
+}
+
+// Called after each present and when the timeout changes, a display that is
+// off has nothing to idle. The idle thread is woken up only for a deadline
+// earlier than the one it waits for, it finds later ones when it wakes up.
+void Hwc2Device::armIdleTimer(Display& display) {
+    int64_t deadline = display.idleTimeoutNs && display.powerMode != HWC2_POWER_MODE_OFF
+            ? nowNs() + display.idleTimeoutNs : 0;
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(mIdleMutex);
+        wake = deadline && (!display.idleDeadline || deadline < display.idleDeadline);
+        display.idleDeadline = deadline;
+    }
+    if (wake) {
+        mIdleCondition.notify_all();
+    }
+}
 
-hwc2_layer_t Hwc2Device::addLayer() {
-    hwc2_layer_t id = ++mNextLayerId;
+// The switch is a commit of the mode alone, the planes keep showing the
+// last frame. Only configs the driver switches to without a modeset are
+// taken, a modeset would blank the screen. Without such a config the
+// display keeps its mode and still stops its vsync.
+void Hwc2Device::enterIdle(hwc2_display_t displayId) {
+    auto display = mDisplays[displayId].get();
+    {
+        std::lock_guard<std::mutex> lock(display->mutex);
+        {
+            std::lock_guard<std::mutex> idleLock(mIdleMutex);
+            // a present came in since the deadline was read
+            if (!display->idleDeadline || nowNs() < display->idleDeadline) {
+                return;
+            }
+            display->idleDeadline = 0;
+        }
+        if (!display->connected || display->idle) {
+            return;
+        }
 
-    mLayers.insert(id);
-    mDirtyLayers.insert(id);
+        const auto& active = display->activeConfig();
+        hwc2_config_t config = display->info.activeConfig;
+        for (hwc2_config_t i = 0; i < display->info.configs.size(); i++) {
+            const auto& candidate = display->info.configs[i];
+            if (candidate.group == active.group && candidate.width == active.width &&
+                    candidate.height == active.height &&
+                    candidate.vsync_period_ns > display->info.configs[config].vsync_period_ns &&
+                    mHwcContext->config_is_seamless(displayId, i)) {
+                config = i;
+            }
+        }
+        display->idle = true;
+        display->idleConfig = display->info.activeConfig;
+        // a pending switch waits for the next present, which ends the idle anyway
+        if (config != display->info.activeConfig && !display->configPending &&
+                mHwcContext->switch_config(displayId, config) == 0) {
+            display->idleConfig = config;
+        }
+        updateVsync(displayId, *display);
+        ALOGV("display %" PRIu64 " idle at config %u", displayId, display->idleConfig);
+    }
 
-    return id;
+    PFN_VSYNC_IDLE callback;
+    hwc2_callback_data_t callbackData;
+    {
+        std::lock_guard<std::mutex> lock(mCallbackMutex);
+        callback = mVsyncIdleCallback;
+        callbackData = mVsyncIdleCallbackData;
+    }
+    if (callback) {
+        callback(callbackData, displayId);
+    }
 }
 
-bool Hwc2Device::removeLayer(hwc2_layer_t layer) {
-    mDirtyLayers.erase(layer);
-    return mLayers.erase(layer);
+// The active config is switched back to seamlessly as well, the frame of the
+// present that ends the idle waits for that switch to flip. If the switch
+// can't be made now the frame sets the mode, which the driver then still
+// switches to without a modeset.
+void Hwc2Device::leaveIdle(hwc2_display_t displayId, Display& display) {
+    if (display.idleConfig != display.info.activeConfig &&
+            mHwcContext->switch_config(displayId, display.info.activeConfig) != 0) {
+        mHwcContext->set_config(displayId, display.info.activeConfig);
+    }
+    display.idle = false;
+    updateVsync(displayId, display);
 }
 
-bool Hwc2Device::hasLayer(hwc2_layer_t layer) const {
-    return mLayers.count(layer) > 0;
+// vsync runs while the client wants it and the display updates
+void Hwc2Device::updateVsync(hwc2_display_t displayId, Display& display) {
+    bool updating = display.powerMode == HWC2_POWER_MODE_ON ||
+                    display.powerMode == HWC2_POWER_MODE_DOZE;
+    mHwcContext->set_vsync_enabled(displayId, display.vsyncEnabled && updating && !display.idle);
 }
 
-bool Hwc2Device::markLayerDirty(hwc2_layer_t layer, bool dirty) {
-    if (mLayers.count(layer) == 0) {
-        return false;
+void Hwc2Device::idleLoop() {
+    prctl(PR_SET_NAME, "IdleThread", 0, 0, 0);
+
+    std::unique_lock<std::mutex> lock(mIdleMutex);
+    while (true) {
+        int64_t now = nowNs();
+        int64_t next = 0;
+        hwc2_display_t expired = mDisplays.size();
+        for (hwc2_display_t id = 0; id < mDisplays.size(); id++) {
+            int64_t deadline = mDisplays[id]->idleDeadline;
+            if (!deadline) {
+                continue;
+            }
+            if (deadline <= now) {
+                expired = id;
+                break;
+            }
+            if (!next || deadline < next) {
+                next = deadline;
+            }
+        }
+        if (expired < mDisplays.size()) {
+            // never call into a display with mIdleMutex held, the deadlines
+            // are read again after
+            lock.unlock();
+            enterIdle(expired);
+            lock.lock();
+        } else if (next) {
+            mIdleCondition.wait_for(lock, std::chrono::nanoseconds(next - now));
+        } else {
+            mIdleCondition.wait(lock);
+        }
     }
+}
 
-    if (dirty) {
-        mDirtyLayers.insert(layer);
-    } else {
-        mDirtyLayers.erase(layer);
+void Hwc2Device::hotplugLoop() {
+    prctl(PR_SET_NAME, "HotplugThread", 0, 0, 0);
+
+    std::unique_lock<std::mutex> lock(mHotplugMutex);
+    while (true) {
+        mHotplugCondition.wait(lock, [this] { return !mHotplugQueue.empty(); });
+        hwc2_display_t displayId = mHotplugQueue.front();
+        mHotplugQueue.pop_front();
+        // events coming in meanwhile queue the display again
+        lock.unlock();
+        onHotplug(displayId);
+        lock.lock();
+    }
+}
+
+Hwc2Device::Display* Hwc2Device::getDisplay(hwc2_display_t displayId) {
+    if (displayId >= mDisplays.size() || !mDisplays[displayId]->connected) {
+        return nullptr;
     }
+    return mDisplays[displayId].get();
+}
 
-    return true;
+Hwc2Device::Layer* Hwc2Device::Display::getLayer(hwc2_layer_t layer) {
+    auto it = layers.find(layer);
+    return it != layers.end() ? &it->second : nullptr;
 }
 
-const std::unordered_set<hwc2_layer_t>& Hwc2Device::getDirtyLayers() const {
-    return mDirtyLayers;
+bool Hwc2Device::Display::hasLayer(hwc2_layer_t layer) const {
+    return layers.count(layer) > 0;
 }
 
-void Hwc2Device::clearDirtyLayers() {
-    mDirtyLayers.clear();
+bool Hwc2Device::canScanout(const Layer& layer) {
+    return (layer.compositionType == HWC2_COMPOSITION_DEVICE ||
+            layer.compositionType == HWC2_COMPOSITION_CURSOR) &&
+           layer.buffer != nullptr &&
+           !layer.colorTransform &&
+           layer.brightness == 1.0f &&
+           layer.transform == 0 &&
+           layer.planeAlpha == 1.0f &&
+           (layer.blendMode == HWC2_BLEND_MODE_NONE ||
+            layer.blendMode == HWC2_BLEND_MODE_PREMULTIPLIED);
 }
 
+// Only the top-most run of layers that can be scanned out bypasses the client
+// target; hwc_context decides how many of them actually get a plane.
+void Hwc2Device::assignPlanes(hwc2_display_t displayId, Display& display) {
+    std::vector<Layer*> sorted;
+    for (auto& [id, layer] : display.layers) {
+        layer.planeId = 0;
+        layer.cpuComposed = false;
+        sorted.push_back(&layer);
+    }
+    // nothing is shown while the display is off, its frames are dropped
+    if (display.cpuComposition || display.colorTransformByClient ||
+            display.powerMode == HWC2_POWER_MODE_OFF) {
+        return;
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const Layer* a, const Layer* b) { return a->z < b->z; });
 
-int64_t Hwc2Device::VsyncThread::now() {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
+    size_t first = sorted.size();
+    while (first > 0 && canScanout(*sorted[first - 1])) {
+        first--;
+    }
 
-    return int64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+    std::vector<kms_layer> layers;
+    for (size_t i = first; i < sorted.size(); i++) {
+        layers.push_back({sorted[i]->buffer, sorted[i]->sourceCrop, sorted[i]->displayFrame, 0,
+                          0, -1, {}, sorted[i]->compositionType == HWC2_COMPOSITION_CURSOR});
+    }
+    if (!layers.empty()) {
+        size_t assigned = mHwcContext->assign_planes(displayId, layers, first > 0);
+        ALOGV("assignPlanes() %zu of %zu layers on planes", assigned, sorted.size());
+        for (size_t i = 0; i < layers.size(); i++) {
+            sorted[first + i]->planeId = layers[i].plane_id;
+        }
+    }
+    assignCpu(display, sorted);
 }
 
-bool Hwc2Device::VsyncThread::sleepUntil(int64_t t) {
-    struct timespec ts;
-    ts.tv_sec = t / 1'000'000'000;
-    ts.tv_nsec = t % 1'000'000'000;
+// CPU composition takes the layers without a plane from the client when
+// there are at most this many, and more while the GPU lags behind
+#define CPU_COMPOSITION_MAX_LAYERS 2
+#define CPU_COMPOSITION_MAX_LAYERS_GPU_BUSY 4
+// and they cover the display at most this many times
+#define CPU_COMPOSITION_MAX_COVERAGE 2
 
-    while (true) {
-        int error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
-        if (error) {
-            if (error == EINTR) {
-                continue;
+bool Hwc2Device::canComposeOnCpu(const Layer& layer) {
+    return layer.compositionType == HWC2_COMPOSITION_DEVICE &&
+           !layer.colorTransform &&
+           layer.brightness == 1.0f &&
+           layer.transform == 0 &&
+           (layer.blendMode == HWC2_BLEND_MODE_NONE ||
+            layer.blendMode == HWC2_BLEND_MODE_PREMULTIPLIED) &&
+           layer.displayFrame.left < layer.displayFrame.right &&
+           layer.displayFrame.top < layer.displayFrame.bottom &&
+           layer.sourceCrop.left < layer.sourceCrop.right &&
+           layer.sourceCrop.top < layer.sourceCrop.bottom &&
+           cpu_compositor::can_compose(layer.buffer);
+}
+
+// Only layers whose buffers are ready are taken, and only while the target
+// to compose into is free, the present would wait for them otherwise.
+void Hwc2Device::assignCpu(Display& display, const std::vector<Layer*>& sorted) {
+    if (!mCpuComposition || display.cpuFailed || display.configPending ||
+            display.info.format != HAL_PIXEL_FORMAT_RGBA_8888) {
+        return;
+    }
+    if (!mCpuCompositor.target_ready(&display.cpuTargets)) {
+        return;
+    }
+    const Config& config = display.activeConfig();
+    size_t maxLayers = display.gpuBusy ? CPU_COMPOSITION_MAX_LAYERS_GPU_BUSY
+                                       : CPU_COMPOSITION_MAX_LAYERS;
+    std::vector<Layer*> composed;
+    int64_t area = 0;
+    for (Layer* layer : sorted) {
+        if (layer->planeId) {
+            continue;
+        }
+        if (composed.size() == maxLayers || !canComposeOnCpu(*layer) ||
+                (layer->acquireFence.ok() && sync_wait(layer->acquireFence.get(), 0) < 0)) {
+            return;
+        }
+        const hwc_rect_t& frame = layer->displayFrame;
+        area += int64_t(std::min<int>(frame.right, config.width) - std::max(frame.left, 0)) *
+                (std::min<int>(frame.bottom, config.height) - std::max(frame.top, 0));
+        composed.push_back(layer);
+    }
+    if (composed.empty() ||
+            area > int64_t(CPU_COMPOSITION_MAX_COVERAGE) * config.width * config.height) {
+        return;
+    }
+    for (Layer* layer : composed) {
+        layer->cpuComposed = true;
+    }
+}
+
+// Blends the layers validated for the CPU into the next target, redrawing
+// only what changed since the last composition.
+bool Hwc2Device::composeOnCpu(Display& display, buffer_handle_t* outBuffer,
+                              hwc_rect_t* outDamage) {
+    std::vector<std::pair<hwc2_layer_t, Layer*>> composed;
+    for (auto& [id, layer] : display.layers) {
+        if (layer.validatedType == HWC2_COMPOSITION_DEVICE && layer.cpuComposed) {
+            composed.emplace_back(id, &layer);
+        }
+    }
+    if (composed.empty()) {
+        return false;
+    }
+    std::sort(composed.begin(), composed.end(),
+              [](const auto& a, const auto& b) { return a.second->z < b.second->z; });
+
+    // a layer that stays where it was only damages its surface damage, others
+    // all they cover and covered
+    const Config& config = display.activeConfig();
+    std::vector<cpu_layer> layers;
+    std::vector<hwc2_layer_t> layerIds;
+    hwc_rect_t damage{};
+    for (size_t i = 0; i < composed.size(); i++) {
+        const Layer& layer = *composed[i].second;
+        layers.push_back({layer.buffer, layer.acquireFence.get(), layer.sourceCrop,
+                          layer.displayFrame, uint8_t(lrintf(layer.planeAlpha * 255.0f)),
+                          layer.blendMode == HWC2_BLEND_MODE_NONE});
+        layerIds.push_back(composed[i].first);
+        bool known = i < display.cpuLayers.size();
+        const cpu_layer& last = known ? display.cpuLayers[i] : cpu_layer{};
+        if (!known || display.cpuLayerIds[i] != composed[i].first ||
+                !sameRect(last.source_crop, layer.sourceCrop) ||
+                !sameRect(last.display_frame, layer.displayFrame) ||
+                last.alpha != layers.back().alpha || last.opaque != layers.back().opaque) {
+            damage = unionRect(damage, layer.displayFrame);
+            if (known) {
+                damage = unionRect(damage, last.display_frame);
             }
-            return false;
+        } else if (layer.cpuDamage.full) {
+            damage = unionRect(damage, layer.displayFrame);
         } else {
-            return true;
+            for (const auto& rect : layer.cpuDamage.rects) {
+                damage = unionRect(damage, bufferToDisplay(rect, layer.sourceCrop,
+                                                           layer.displayFrame));
+            }
+        }
+    }
+    for (size_t i = layers.size(); i < display.cpuLayers.size(); i++) {
+        damage = unionRect(damage, display.cpuLayers[i].display_frame);
+    }
+
+    if (display.cpuTargets.slots[0].buffer && (display.cpuTargets.width != config.width ||
+                                               display.cpuTargets.height != config.height)) {
+        freeCpuTargets(display);
+    }
+    int err = mCpuCompositor.compose(&display.cpuTargets, config.width, config.height,
+                                     display.info.format, layers, damage, outBuffer);
+    if (err) {
+        // the client composes from the next validation on
+        ALOGE("CPU composition of %zu layers failed (%s)", layers.size(), strerror(-err));
+        display.cpuFailed = true;
+        display.cpuLayers.clear();
+        display.cpuLayerIds.clear();
+        display.setState(State::MODIFIED);
+        return false;
+    }
+    for (auto& [id, layer] : composed) {
+        layer->acquireFence.reset();
+        layer->cpuDamage.clear();
+    }
+    for (auto& layer : layers) {
+        layer.acquire_fence = -1;
+    }
+    display.cpuLayers = std::move(layers);
+    display.cpuLayerIds = std::move(layerIds);
+    *outDamage = damage;
+    return true;
+}
+
+void Hwc2Device::freeCpuTargets(Display& display) {
+    for (const auto& slot : display.cpuTargets.slots) {
+        if (slot.buffer) {
+            mHwcContext->release_buffer(slot.buffer);
         }
     }
+    mCpuCompositor.free_targets(&display.cpuTargets);
+    display.cpuLayers.clear();
+    display.cpuLayerIds.clear();
+    display.cpuTargetShown = false;
 }
 
-void Hwc2Device::VsyncThread::start(int64_t firstVsync, int64_t period) {
-    mNextVsync = firstVsync;
-    mPeriod = period;
+void Hwc2Device::VsyncThread::start() {
     mStarted = true;
     mThread = std::thread(&VsyncThread::vsyncLoop, this);
 }
@@ -350,16 +2066,23 @@ void Hwc2Device::VsyncThread::stop() {
     mThread.join();
 }
 
-void Hwc2Device::VsyncThread::setCallback(HWC2_PFN_VSYNC callback, hwc2_callback_data_t data) {
+void Hwc2Device::VsyncThread::setCallback(HWC2_PFN_VSYNC_2_4 callback,
+                                          hwc2_callback_data_t data) {
     std::lock_guard<std::mutex> lock(mMutex);
     mCallback = callback;
     mCallbackData = data;
 }
 
-void Hwc2Device::VsyncThread::enableCallback(bool enable) {
+// vsyncs queued while the callback is slow, older ones are dropped
+#define VSYNC_QUEUE_DEPTH 4
+
+void Hwc2Device::VsyncThread::post(hwc2_display_t display, int64_t timestamp, int32_t period) {
     {
         std::lock_guard<std::mutex> lock(mMutex);
-        mCallbackEnabled = enable;
+        if (mQueue.size() >= VSYNC_QUEUE_DEPTH) {
+            mQueue.pop_front();
+        }
+        mQueue.push_back({display, timestamp, period});
     }
     mCondition.notify_all();
 }
@@ -368,37 +2091,23 @@ void Hwc2Device::VsyncThread::vsyncLoop() {
     prctl(PR_SET_NAME, "VsyncThread", 0, 0, 0);
 
     std::unique_lock<std::mutex> lock(mMutex);
-    if (!mStarted) {
-        return;
-    }
-
     while (true) {
-        if (!mCallbackEnabled) {
-            mCondition.wait(lock, [this] { return mCallbackEnabled || !mStarted; });
-            if (!mStarted) {
-                break;
-            }
+        mCondition.wait(lock, [this] { return !mQueue.empty() || !mStarted; });
+        if (!mStarted) {
+            break;
         }
 
-        lock.unlock();
+        Vsync vsync = mQueue.front();
+        mQueue.pop_front();
+        HWC2_PFN_VSYNC_2_4 callback = mCallback;
+        hwc2_callback_data_t data = mCallbackData;
 
-        // adjust mNextVsync if necessary
-        int64_t t = now();
-        if (mNextVsync < t) {
-            int64_t n = (t - mNextVsync + mPeriod - 1) / mPeriod;
-            mNextVsync += mPeriod * n;
+        // never call out with mMutex held
+        lock.unlock();
+        if (callback) {
+            callback(data, vsync.display, vsync.timestamp, vsync.period);
         }
-        bool fire = sleepUntil(mNextVsync);
-
         lock.lock();
-
-        if (fire) {
-	    //ALOGV("VsyncThread(%" PRId64 ")", mNextVsync);
-            if (mCallback) {
-                mCallback(mCallbackData, 0, mNextVsync);
-            }
-            mNextVsync += mPeriod;
-        }
     }
 }
 
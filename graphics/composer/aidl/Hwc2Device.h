@@ -24,14 +24,21 @@
 #undef HWC2_USE_CPP11
 #undef HWC2_INCLUDE_STRINGIFICATION
 
+#include <android-base/unique_fd.h>
 #include <ui/Fence.h>
 
+#include <atomic>
 #include <condition_variable>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
+#include "cpu_compositor.h"
 #include "hwc_context.h"
 
 namespace aidl::android::hardware::graphics::composer3::impl {
@@ -40,6 +47,10 @@ class Hwc2Device {
 public:
     Hwc2Device();
 
+    // composer3 only, HWC2 has no callback for a display going idle
+    static constexpr int32_t CALLBACK_VSYNC_IDLE = 0x100;
+    typedef void (*PFN_VSYNC_IDLE)(hwc2_callback_data_t callbackData, hwc2_display_t display);
+
     int32_t createLayer(hwc2_display_t displayId, hwc2_layer_t* outLayerId);
     int32_t destroyLayer(hwc2_display_t displayId, hwc2_layer_t layerId);
     int32_t getClientTargetSupport(hwc2_display_t displayId, uint32_t width, uint32_t height,
@@ -47,20 +58,83 @@ public:
     int32_t getDisplayAttribute(hwc2_display_t displayId, hwc2_config_t config,
             int32_t intAttribute, int32_t* outValue);
     int32_t getDisplayName(hwc2_display_t displayId, uint32_t* outSize, char* outName);
+    int32_t getDisplayConfigs(hwc2_display_t displayId, uint32_t* outNumConfigs,
+            hwc2_config_t* outConfigs);
+    int32_t getActiveConfig(hwc2_display_t displayId, hwc2_config_t* outConfig);
+    int32_t getDisplayVsyncPeriod(hwc2_display_t displayId,
+            hwc2_vsync_period_t* outVsyncPeriod);
+    int32_t setActiveConfigWithConstraints(hwc2_display_t displayId, hwc2_config_t config,
+            const hwc_vsync_period_change_constraints_t* constraints,
+            hwc_vsync_period_change_timeline_t* outTimeline);
+    int32_t getSupportedContentTypes(hwc2_display_t displayId, uint32_t* outNumSupportedContentTypes,
+            uint32_t* outSupportedContentTypes);
+    int32_t setContentType(hwc2_display_t displayId, int32_t contentType);
+    int32_t setColorTransform(hwc2_display_t displayId, const float* matrix);
+    int32_t getDisplayCapabilities(hwc2_display_t displayId, uint32_t* outNumCapabilities,
+            uint32_t* outCapabilities);
+    int32_t setDisplayBrightness(hwc2_display_t displayId, float brightness);
+    int32_t flushDisplayBrightnessChange(hwc2_display_t displayId);
+    int32_t getDisplayedContentSamplingAttributes(hwc2_display_t displayId, int32_t* outFormat,
+            int32_t* outDataspace, uint8_t* outComponentMask);
+    int32_t setDisplayedContentSamplingEnabled(hwc2_display_t displayId, int32_t enabled,
+            uint8_t componentMask, uint64_t maxFrames);
+    int32_t getDisplayedContentSample(hwc2_display_t displayId, uint64_t maxFrames,
+            uint64_t timestamp, uint64_t* outFrameCount, int32_t outSamplesSize[4],
+            uint64_t* outSamples[4]);
+    int32_t getReadbackBufferAttributes(hwc2_display_t displayId, int32_t* outFormat,
+            int32_t* outDataspace);
+    int32_t setReadbackBuffer(hwc2_display_t displayId, buffer_handle_t buffer,
+            int32_t releaseFence);
+    int32_t getReadbackBufferFence(hwc2_display_t displayId, int32_t* outFence);
+
+    int32_t getMaxVirtualDisplayCount(uint32_t* outCount);
+    int32_t createVirtualDisplay(uint32_t width, uint32_t height, int32_t* format,
+            hwc2_display_t* outDisplay);
+    int32_t destroyVirtualDisplay(hwc2_display_t displayId);
+    int32_t setOutputBuffer(hwc2_display_t displayId, buffer_handle_t buffer,
+            int32_t releaseFence);
 
     int32_t setVsyncEnabled(hwc2_display_t displayId, int32_t intEnabled);
+    int32_t setIdleTimerEnabled(hwc2_display_t displayId, int32_t timeoutMs);
+    int32_t setPowerMode(hwc2_display_t displayId, int32_t intMode);
 
     int32_t setClientTarget(hwc2_display_t displayId, buffer_handle_t target,
-            int32_t acquireFence, int32_t dataspace);
+            int32_t acquireFence, int32_t dataspace, hwc_region_t damage);
     int32_t validateDisplay(hwc2_display_t displayId, uint32_t* outNumTypes,
             uint32_t* outNumRequests);
     int32_t presentDisplay(hwc2_display_t displayId, int32_t* outRetireFence);
+    int32_t setExpectedPresentTime(hwc2_display_t displayId, int64_t timestamp);
     int32_t acceptDisplayChanges(hwc2_display_t displayId);
 
     int32_t getChangedCompositionTypes(hwc2_display_t displayId, uint32_t* outNumElements,
             hwc2_layer_t* outLayers, int32_t* outTypes);
     int32_t setLayerCompositionType(hwc2_display_t displayId, hwc2_layer_t layerId,
             int32_t intType);
+    int32_t setLayerBuffer(hwc2_display_t displayId, hwc2_layer_t layerId,
+            buffer_handle_t buffer, int32_t acquireFence);
+    int32_t setLayerCursorPosition(hwc2_display_t displayId, hwc2_layer_t layerId,
+            int32_t x, int32_t y);
+    int32_t setLayerColorTransform(hwc2_display_t displayId, hwc2_layer_t layerId,
+            const float* matrix);
+    int32_t setLayerBrightness(hwc2_display_t displayId, hwc2_layer_t layerId,
+            float brightness);
+    int32_t setLayerBlendMode(hwc2_display_t displayId, hwc2_layer_t layerId, int32_t intMode);
+    int32_t setLayerDisplayFrame(hwc2_display_t displayId, hwc2_layer_t layerId,
+            hwc_rect_t frame);
+    int32_t setLayerPlaneAlpha(hwc2_display_t displayId, hwc2_layer_t layerId, float alpha);
+    int32_t setLayerSourceCrop(hwc2_display_t displayId, hwc2_layer_t layerId,
+            hwc_frect_t crop);
+    int32_t setLayerSurfaceDamage(hwc2_display_t displayId, hwc2_layer_t layerId,
+            hwc_region_t damage);
+    int32_t setLayerTransform(hwc2_display_t displayId, hwc2_layer_t layerId,
+            int32_t intTransform);
+    int32_t setLayerZOrder(hwc2_display_t displayId, hwc2_layer_t layerId, uint32_t z);
+
+    int32_t getReleaseFences(hwc2_display_t displayId, uint32_t* outNumElements,
+            hwc2_layer_t* outLayers, int32_t* outFences);
+
+    // the client is done with a buffer, drop what was cached for it
+    void releaseBuffer(buffer_handle_t buffer);
 
     void dump(uint32_t* outSize, char* outBuffer);
 
@@ -68,66 +142,272 @@ public:
             hwc2_function_pointer_t pointer);
 
 private:
-    struct Info {
-        std::string name;
+    struct Config {
         uint32_t width;
         uint32_t height;
-        int format;
         int vsync_period_ns;
         int xdpi_scaled;
         int ydpi_scaled;
+        int group;
+    };
+
+    struct Info {
+        std::string name;
+        int format;
+        std::vector<Config> configs;
+        hwc2_config_t activeConfig;
+        bool contentTypes;
+        // layers on it are composed as HWC2_COMPOSITION_CURSOR, 0 if there is none
+        uint32_t cursorPlaneId;
+        // the CRTC dims through its gamma LUT
+        bool brightness;
     };
-    Info mFbInfo{};
-    const Info& getInfo() const { return mFbInfo; }
 
     enum class State {
         MODIFIED,
         VALIDATED_WITH_CHANGES,
         VALIDATED,
     };
-    State mState{State::MODIFIED};
-    void setState(State state) { mState = state; }
-    State getState() const { return mState; }
 
-    uint64_t mNextLayerId{0};
-    std::unordered_set<hwc2_layer_t> mLayers;
-    std::unordered_set<hwc2_layer_t> mDirtyLayers;
-    hwc2_layer_t addLayer();
-    bool removeLayer(hwc2_layer_t layer);
-    bool hasLayer(hwc2_layer_t layer) const;
-    bool markLayerDirty(hwc2_layer_t layer, bool dirty);
-    const std::unordered_set<hwc2_layer_t>& getDirtyLayers() const;
-    void clearDirtyLayers();
+    // Surface damage accumulated over frames, in buffer coordinates. Too many
+    // rects collapse into their bounding box.
+    struct Damage {
+        bool full{true};
+        std::vector<hwc_rect_t> rects;
+        void add(const std::vector<hwc_rect_t>& damage);
+        void clear() { full = false; rects.clear(); }
+        void setFull() { full = true; rects.clear(); }
+        // as hwc_context takes it: empty if full, a single empty rect if none
+        std::vector<hwc_rect_t> region() const;
+    };
+
+    struct Layer {
+        buffer_handle_t buffer{nullptr};
+        ::android::base::unique_fd acquireFence;
+        hwc_frect_t sourceCrop{};
+        hwc_rect_t displayFrame{};
+        uint32_t z{0};
+        int32_t blendMode{HWC2_BLEND_MODE_NONE};
+        int32_t transform{0};
+        float planeAlpha{1.0f};
+        // planes have no color transform of their own, the client applies it
+        bool colorTransform{false};
+        // nor a dimming of their own, dimmed layers go to the client too
+        float brightness{1.0f};
+        // requested by the client, and as accepted by validateDisplay()
+        int32_t compositionType{HWC2_COMPOSITION_CLIENT};
+        int32_t validatedType{HWC2_COMPOSITION_CLIENT};
+        uint32_t planeId{0};
+        // blended on the CPU into the client target instead of by the client
+        bool cpuComposed{false};
+
+        // the surface damage as last set, the next present takes it into the
+        // damage of the plane and of the CPU composition if the client set a
+        // buffer or damage since the last one
+        std::vector<hwc_rect_t> surfaceDamage;
+        bool surfaceDamageSet{true};
+        Damage planeDamage;
+        Damage cpuDamage;
+        // the plane the last present showed the layer on, 0 if none
+        uint32_t presentedPlaneId{0};
+    };
+
+    // Histograms of the frames a display showed while content sampling is
+    // enabled. The last frames of the window are kept apart, older ones only
+    // add to the total if the window is unbounded.
+    struct ContentSampling {
+        bool enabled{false};
+        uint8_t componentMask{0};
+        uint64_t maxFrames{0};
+        struct Frame {
+            int64_t time;
+            cpu_histogram histogram;
+        };
+        std::deque<Frame> frames;
+        std::vector<uint64_t> total;
+        uint64_t totalFrames{0};
+        int64_t totalFirstTime{0};
+        // the frame on screen, sampled at the next present or query once
+        // the fences of its buffers signaled
+        std::vector<cpu_layer> pending;
+        std::vector<::android::base::unique_fd> pendingFences;
+        int64_t pendingTime{0};
+        uint32_t pendingWidth{0};
+        uint32_t pendingHeight{0};
+    };
 
-    buffer_handle_t mBuffer{nullptr};
+    // Everything the composition of one display works on. Calls for a
+    // display hold its mutex, so displays compose independently.
+    struct Display {
+        std::mutex mutex;
+        Info info{};
+        // changed by hotplug with the mutex held, read without it
+        std::atomic<bool> connected{false};
 
+        // virtual displays are connected while the client has created them
+        bool isVirtual{false};
+        bool cpuComposition{false};
+        buffer_handle_t outputBuffer{nullptr};
+        ::android::base::unique_fd outputBufferFence;
+
+        State state{State::MODIFIED};
+        // Changes that can alter the composition bump the generation, setting
+        // a value it already has doesn't. A validation holds for as long as the
+        // generation it was made for, so unchanged frames present right away.
+        uint64_t generation{0};
+        uint64_t validatedGeneration{0};
+        void setState(State newState) {
+            if (newState == State::MODIFIED) {
+                generation++;
+            } else {
+                validatedGeneration = generation;
+            }
+            state = newState;
+        }
+        State getState() const {
+            return generation == validatedGeneration ? state : State::MODIFIED;
+        }
+        uint64_t presentCount{0};
+        uint64_t validateCount{0};
+
+        std::unordered_map<hwc2_layer_t, Layer> layers;
+        // layers whose composition type validateDisplay() changed to CLIENT
+        std::unordered_set<hwc2_layer_t> dirtyLayers;
+        Layer* getLayer(hwc2_layer_t layer);
+        bool hasLayer(hwc2_layer_t layer) const;
+
+        buffer_handle_t clientTarget{nullptr};
+        ::android::base::unique_fd clientTargetFence;
+        std::vector<hwc_rect_t> clientTargetDamage;
+        // what the primary plane showed since the last present, damage is against it
+        bool clientTargetShown{false};
+        bool cpuTargetShown{false};
+
+        // the vblank the next present is for, 0 for as soon as possible
+        int64_t expectedPresentTime{0};
+
+        // vsync as the client set it, it is off while the display is idle
+        // or doesn't update
+        bool vsyncEnabled{false};
+        int32_t powerMode{HWC2_POWER_MODE_ON};
+        // With the idle timer enabled, a display that presented nothing for
+        // idleTimeoutNs drops to the slowest config of its size and group
+        // until the next present. idleDeadline is guarded by mIdleMutex, 0
+        // if the timer isn't armed.
+        int64_t idleTimeoutNs{0};
+        int64_t idleDeadline{0};
+        bool idle{false};
+        // the config an idle display switched to, the active one if none
+        hwc2_config_t idleConfig{0};
+
+        // a config switch that waits for the first frame at or after its time
+        bool configPending{false};
+        hwc2_config_t pendingConfig{0};
+        int64_t pendingConfigTime{0};
+        const Config& activeConfig() const { return info.configs[info.activeConfig]; }
+
+        // layers on planes in the last frame, their buffers get released by the next present
+        std::unordered_set<hwc2_layer_t> scanoutLayers;
+        std::vector<hwc2_layer_t> releaseLayers;
+        ::android::base::unique_fd releaseFence;
+
+        // the color transform, empty if identity. The CTM of the CRTC applies
+        // it while some layer isn't composed by the client, which applies it
+        // itself otherwise, and for all layers if the CRTC can't.
+        std::vector<float> colorTransform;
+        bool colorTransformByClient{false};
+        bool ctmEnabled{false};
+        // as last set, -1 for off
+        float brightness{1.0f};
+
+        // CPU composition replacing the client target, and the layers it last
+        // composed; gpuBusy if the last client target wasn't ready at present
+        cpu_targets cpuTargets;
+        std::vector<cpu_layer> cpuLayers;
+        std::vector<hwc2_layer_t> cpuLayerIds;
+        bool cpuFailed{false};
+        bool gpuBusy{false};
+
+        ContentSampling sampling;
+    };
+    std::vector<std::unique_ptr<Display>> mDisplays;
+    // nullptr for unknown and disconnected displays
+    Display* getDisplay(hwc2_display_t displayId);
+    bool updateInfo(hwc2_display_t displayId, Display& display);
+    void onHotplug(hwc2_display_t displayId);
+
+    // layer ids are unique across displays
+    std::atomic<uint64_t> mNextLayerId{0};
+    static bool canScanout(const Layer& layer);
+    static bool canComposeOnCpu(const Layer& layer);
+    void assignPlanes(hwc2_display_t displayId, Display& display);
+    void assignCpu(Display& display, const std::vector<Layer*>& sorted);
+    bool composeOnCpu(Display& display, buffer_handle_t* outBuffer, hwc_rect_t* outDamage);
+    void freeCpuTargets(Display& display);
+    bool applyPendingConfig(hwc2_display_t displayId, Display& display);
+    int32_t presentCpu(Display& display, int32_t* outRetireFence);
+    void queueSample(Display& display, std::vector<cpu_layer> layers,
+                     std::vector<::android::base::unique_fd> fences);
+    void queueOutputSample(Display& display, int32_t fence);
+    void takeSample(Display& display);
+    void armIdleTimer(Display& display);
+    void enterIdle(hwc2_display_t displayId);
+    void leaveIdle(hwc2_display_t displayId, Display& display);
+    void updateVsync(hwc2_display_t displayId, Display& display);
+    void idleLoop();
+    void hotplugLoop();
+    cpu_compositor mCpuCompositor;
+    bool mCpuComposition{true};
+
+    std::mutex mCallbackMutex;
+    HWC2_PFN_HOTPLUG mHotplugCallback{nullptr};
+    hwc2_callback_data_t mHotplugCallbackData{nullptr};
+    HWC2_PFN_VSYNC_PERIOD_TIMING_CHANGED mTimingCallback{nullptr};
+    hwc2_callback_data_t mTimingCallbackData{nullptr};
+    PFN_VSYNC_IDLE mVsyncIdleCallback{nullptr};
+    hwc2_callback_data_t mVsyncIdleCallbackData{nullptr};
+
+    // drops displays whose idle timer ran out to their idle config
+    std::thread mIdleThread;
+    std::mutex mIdleMutex;
+    std::condition_variable mIdleCondition;
+
+    // reprobes the displays the DRM event thread got hotplug events for, the
+    // event thread never waits for a display mutex, a present may hold it
+    // while waiting for the event thread
+    std::thread mHotplugThread;
+    std::mutex mHotplugMutex;
+    std::condition_variable mHotplugCondition;
+    std::deque<hwc2_display_t> mHotplugQueue;
 
     std::string mDumpString;
 
+    // Hands the vsyncs of the DRM event thread to the registered callback,
+    // so a slow callback never holds up DRM event processing.
     class VsyncThread {
     public:
-        static int64_t now();
-        static bool sleepUntil(int64_t t);
-
-        void start(int64_t first, int64_t period);
+        void start();
         void stop();
-        void setCallback(HWC2_PFN_VSYNC callback, hwc2_callback_data_t data);
-        void enableCallback(bool enable);
+        void setCallback(HWC2_PFN_VSYNC_2_4 callback, hwc2_callback_data_t data);
+        void post(hwc2_display_t display, int64_t timestamp, int32_t period);
 
     private:
         void vsyncLoop();
-        bool waitUntilNextVsync();
+
+        struct Vsync {
+            hwc2_display_t display;
+            int64_t timestamp;
+            int32_t period;
+        };
 
         std::thread mThread;
-        int64_t mNextVsync{0};
-        int64_t mPeriod{0};
 
         std::mutex mMutex;
         std::condition_variable mCondition;
         bool mStarted{false};
-        HWC2_PFN_VSYNC mCallback{nullptr};
+        std::deque<Vsync> mQueue;
+        HWC2_PFN_VSYNC_2_4 mCallback{nullptr};
         hwc2_callback_data_t mCallbackData{nullptr};
-        bool mCallbackEnabled{false};
     };
     VsyncThread mVsyncThread;
 
@@ -0,0 +1,610 @@
+/*
+ * Copyright 2026 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "composer-cpu_compositor"
+//#define LOG_NDEBUG 0
+#include <utils/Log.h>
+#include <utils/Trace.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+#include <hardware/gralloc1.h>
+#include <sync/sync.h>
+#include <system/graphics.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+
+#include <drm_handle.h>
+#include <gbm_gralloc.h>
+
+#include "cpu_compositor.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+/* bound of the waits for the fences of the buffers */
+#define FENCE_TIMEOUT_MS 1000
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * The blending works on rows of RGBA_8888, bytes R, G, B, A in memory, with
+ * premultiplied alpha. Sources without alpha count as alpha 255.
+ */
+
+/* x / 255 rounded, for x up to 255 * 255 */
+static inline uint32_t div255(uint32_t x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+#if defined(__ARM_NEON)
+static inline uint8x8_t div255_u8(uint16x8_t x)
+{
+	return vraddhn_u16(x, vrshrq_n_u16(x, 8));
+}
+#endif
+
+/* dst = src, with the alpha of the source set to 255 */
+static void copy_row(uint32_t *dst, const uint32_t *src, size_t n)
+{
+	size_t i = 0;
+#if defined(__ARM_NEON)
+	const uint32x4_t alpha = vdupq_n_u32(0xff000000);
+	for (; i + 4 <= n; i += 4)
+		vst1q_u32(dst + i, vorrq_u32(vld1q_u32(src + i), alpha));
+#endif
+	for (; i < n; i++)
+		dst[i] = src[i] | 0xff000000;
+}
+
+/* dst = src * alpha + dst * (1 - src.a * alpha) */
+static void blend_row(uint32_t *dst, const uint32_t *src, size_t n, uint32_t alpha,
+		bool opaque)
+{
+	size_t i = 0;
+#if defined(__ARM_NEON)
+	const uint8x8_t plane_alpha = vdup_n_u8(uint8_t(alpha));
+	for (; i + 8 <= n; i += 8) {
+		uint8x8x4_t s = vld4_u8(reinterpret_cast<const uint8_t *>(src + i));
+		uint8x8x4_t d = vld4_u8(reinterpret_cast<const uint8_t *>(dst + i));
+		if (opaque)
+			s.val[3] = vdup_n_u8(255);
+		if (alpha != 255) {
+			for (int c = 0; c < 4; c++)
+				s.val[c] = div255_u8(vmull_u8(s.val[c], plane_alpha));
+		}
+		uint8x8_t inv = vmvn_u8(s.val[3]);
+		for (int c = 0; c < 4; c++)
+			d.val[c] = vqadd_u8(s.val[c], div255_u8(vmull_u8(d.val[c], inv)));
+		vst4_u8(reinterpret_cast<uint8_t *>(dst + i), d);
+	}
+#endif
+	for (; i < n; i++) {
+		uint32_t s = opaque ? src[i] | 0xff000000 : src[i];
+		uint32_t sa = s >> 24;
+		if (alpha != 255)
+			sa = div255(sa * alpha);
+		uint32_t inv = 255 - sa;
+		uint32_t out = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			uint32_t sc = (s >> shift) & 0xff;
+			if (alpha != 255)
+				sc = div255(sc * alpha);
+			uint32_t dc = (dst[i] >> shift) & 0xff;
+			out |= std::min<uint32_t>(sc + div255(dc * inv), 255) << shift;
+		}
+		dst[i] = out;
+	}
+}
+
+/* nearest samples of a source row, x and step in 16.16 fixed point */
+static void sample_row(uint32_t *dst, const uint32_t *src, size_t n, int64_t x, int64_t step,
+		int32_t max_x)
+{
+	for (size_t i = 0; i < n; i++, x += step)
+		dst[i] = src[std::clamp<int32_t>(int32_t(x >> 16), 0, max_x)];
+}
+
+/*
+ * Count the R, G and B values of a row. NEON has no scatter, the counts are
+ * kept in two sets so that neighbouring pixels of the same color don't wait
+ * on each other's increment.
+ */
+static void histogram_row(uint32_t (*even)[HISTOGRAM_BUCKETS],
+		uint32_t (*odd)[HISTOGRAM_BUCKETS], const uint32_t *src, size_t n)
+{
+	size_t i = 0;
+#if defined(__ARM_NEON)
+	uint8_t values[3][8];
+	for (; i + 8 <= n; i += 8) {
+		uint8x8x4_t s = vld4_u8(reinterpret_cast<const uint8_t *>(src + i));
+		for (int c = 0; c < 3; c++)
+			vst1_u8(values[c], s.val[c]);
+		for (int c = 0; c < 3; c++) {
+			for (int j = 0; j < 8; j += 2) {
+				even[c][values[c][j]]++;
+				odd[c][values[c][j + 1]]++;
+			}
+		}
+	}
+#endif
+	for (; i + 2 <= n; i += 2) {
+		for (int c = 0; c < 3; c++) {
+			even[c][(src[i] >> (8 * c)) & 0xff]++;
+			odd[c][(src[i + 1] >> (8 * c)) & 0xff]++;
+		}
+	}
+	for (; i < n; i++) {
+		for (int c = 0; c < 3; c++)
+			even[c][(src[i] >> (8 * c)) & 0xff]++;
+	}
+}
+
+/* the first of the sampled columns i * step + step / 2 at or after x */
+static int first_sample(int x, uint32_t step)
+{
+	int offset = x - int(step / 2);
+	return offset <= 0 ? 0 : (offset + int(step) - 1) / int(step);
+}
+
+static hwc_rect_t intersect(const hwc_rect_t &a, const hwc_rect_t &b)
+{
+	return {std::max(a.left, b.left), std::max(a.top, b.top),
+		std::min(a.right, b.right), std::min(a.bottom, b.bottom)};
+}
+
+static bool is_empty(const hwc_rect_t &r)
+{
+	return r.left >= r.right || r.top >= r.bottom;
+}
+
+/* bounding box of both */
+static hwc_rect_t unite(const hwc_rect_t &a, const hwc_rect_t &b)
+{
+	if (is_empty(a))
+		return b;
+	if (is_empty(b))
+		return a;
+	return {std::min(a.left, b.left), std::min(a.top, b.top),
+		std::max(a.right, b.right), std::max(a.bottom, b.bottom)};
+}
+
+cpu_compositor::cpu_compositor()
+{
+	gbm = gbm_init();
+	if (!gbm)
+		ALOGE("no gbm device, CPU composition fails");
+}
+
+cpu_compositor::~cpu_compositor()
+{
+	for (buffer_handle_t buffer : imported)
+		gbm_unregister(buffer);
+	if (gbm)
+		gbm_destroy(gbm);
+}
+
+/* called with the mutex held */
+int cpu_compositor::lock(buffer_handle_t buffer, uint64_t usage, void **addr)
+{
+	if (!gbm || private_handle_t::validate(buffer) < 0)
+		return -EINVAL;
+	if (!imported.count(buffer)) {
+		int err = gbm_register(gbm, buffer);
+		if (err)
+			return err;
+		imported.insert(buffer);
+	}
+	return gbm_lock(buffer, usage, 0, 0, 0, 0, addr);
+}
+
+int cpu_compositor::blit(buffer_handle_t src, int32_t src_fence, buffer_handle_t dst,
+		int32_t dst_fence)
+{
+	ATRACE_CALL();
+	if (private_handle_t::validate(src) < 0 || private_handle_t::validate(dst) < 0)
+		return -EINVAL;
+	const private_handle_t *src_hnd = reinterpret_cast<const private_handle_t *>(src);
+	const private_handle_t *dst_hnd = reinterpret_cast<const private_handle_t *>(dst);
+	int bpp = gralloc_gbm_get_bpp(src_hnd->format);
+	if (!bpp || bpp != gralloc_gbm_get_bpp(dst_hnd->format) ||
+			src_hnd->format == HAL_PIXEL_FORMAT_YV12 ||
+			src_hnd->format == HAL_PIXEL_FORMAT_YCBCR_420_888) {
+		ALOGE("can't blit format %u to %u", src_hnd->format, dst_hnd->format);
+		return -EINVAL;
+	}
+
+	if (src_fence >= 0 && sync_wait(src_fence, FENCE_TIMEOUT_MS) < 0)
+		ALOGW("source fence %d not signaled (%s)", src_fence, strerror(errno));
+	if (dst_fence >= 0 && sync_wait(dst_fence, FENCE_TIMEOUT_MS) < 0)
+		ALOGW("destination fence %d not signaled (%s)", dst_fence, strerror(errno));
+
+	std::lock_guard<std::mutex> guard(mutex);
+	void *src_addr, *dst_addr;
+	int err = lock(src, GRALLOC1_CONSUMER_USAGE_CPU_READ_OFTEN, &src_addr);
+	if (err) {
+		ALOGE("can't map source %p (%s)", src, strerror(-err));
+		return err;
+	}
+	err = lock(dst, GRALLOC1_PRODUCER_USAGE_CPU_WRITE_OFTEN, &dst_addr);
+	if (err) {
+		ALOGE("can't map destination %p (%s)", dst, strerror(-err));
+		gbm_unlock(src);
+		return err;
+	}
+
+	uint32_t width = std::min(src_hnd->width, dst_hnd->width);
+	uint32_t height = std::min(src_hnd->height, dst_hnd->height);
+	for (uint32_t y = 0; y < height; y++)
+		memcpy(static_cast<uint8_t *>(dst_addr) + size_t(y) * dst_hnd->stride,
+				static_cast<const uint8_t *>(src_addr) + size_t(y) * src_hnd->stride,
+				size_t(width) * bpp);
+
+	gbm_unlock(dst);
+	gbm_unlock(src);
+	return 0;
+}
+
+void cpu_compositor::release_buffer(buffer_handle_t buffer)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	if (imported.erase(buffer))
+		gbm_unregister(buffer);
+}
+
+bool cpu_compositor::can_compose(buffer_handle_t buffer)
+{
+	if (!buffer || private_handle_t::validate(buffer) < 0)
+		return false;
+	const private_handle_t *hnd = reinterpret_cast<const private_handle_t *>(buffer);
+	return (hnd->format == HAL_PIXEL_FORMAT_RGBA_8888 ||
+			hnd->format == HAL_PIXEL_FORMAT_RGBX_8888) &&
+		hnd->modifier == DRM_FORMAT_MOD_LINEAR;
+}
+
+/* where the pixels of a layer come from, a buffer is mapped once */
+struct cpu_compositor::source {
+	const uint8_t *addr;
+	const private_handle_t *hnd;
+	int64_t x, y, step_x, step_y;
+	bool direct;
+	bool opaque;
+};
+
+/* called with the mutex held, the buffers in locked have to be unlocked */
+int cpu_compositor::map_layers(const std::vector<cpu_layer> &layers,
+		std::vector<source> *sources, std::vector<buffer_handle_t> *locked)
+{
+	sources->resize(layers.size());
+	for (size_t i = 0; i < layers.size(); i++) {
+		const cpu_layer &layer = layers[i];
+		source &src = (*sources)[i];
+		src.hnd = reinterpret_cast<const private_handle_t *>(layer.buffer);
+		src.addr = nullptr;
+		for (size_t j = 0; j < i; j++) {
+			if (layers[j].buffer == layer.buffer)
+				src.addr = (*sources)[j].addr;
+		}
+		if (!src.addr) {
+			void *addr;
+			int err = lock(layer.buffer, GRALLOC1_CONSUMER_USAGE_CPU_READ_OFTEN, &addr);
+			if (err) {
+				ALOGE("can't map layer %p (%s)", layer.buffer, strerror(-err));
+				return err;
+			}
+			locked->push_back(layer.buffer);
+			src.addr = static_cast<const uint8_t *>(addr);
+		}
+
+		const hwc_frect_t &crop = layer.source_crop;
+		const hwc_rect_t &frame_rect = layer.display_frame;
+		int frame_w = std::max(frame_rect.right - frame_rect.left, 1);
+		int frame_h = std::max(frame_rect.bottom - frame_rect.top, 1);
+		src.step_x = llroundf((crop.right - crop.left) * 65536.0f / frame_w);
+		src.step_y = llroundf((crop.bottom - crop.top) * 65536.0f / frame_h);
+		/* sample at the pixel centers */
+		src.x = llroundf(crop.left * 65536.0f) + src.step_x / 2;
+		src.y = llroundf(crop.top * 65536.0f) + src.step_y / 2;
+		src.direct = src.step_x == 65536 && crop.left == floorf(crop.left) &&
+			crop.left >= 0 && crop.right <= float(src.hnd->width);
+		src.opaque = layer.opaque || src.hnd->format == HAL_PIXEL_FORMAT_RGBX_8888;
+	}
+	return 0;
+}
+
+/* called with the mutex held */
+int cpu_compositor::alloc_targets(struct cpu_targets *targets, uint32_t width, uint32_t height,
+		int format)
+{
+	for (auto &slot : targets->slots) {
+		int stride;
+		int err = gbm_alloc(gbm, int(width), int(height), format,
+				GRALLOC1_CONSUMER_USAGE_HWCOMPOSER |
+				GRALLOC1_PRODUCER_USAGE_CPU_WRITE_OFTEN,
+				&slot.buffer, &stride);
+		if (err) {
+			ALOGE("can't allocate a %ux%u target (%s)", width, height, strerror(-err));
+			for (auto &allocated : targets->slots) {
+				if (allocated.buffer)
+					gbm_free(allocated.buffer);
+				allocated.buffer = nullptr;
+			}
+			return err;
+		}
+	}
+	targets->width = width;
+	targets->height = height;
+	targets->format = format;
+	return 0;
+}
+
+int cpu_compositor::compose(struct cpu_targets *targets, uint32_t width, uint32_t height,
+		int format, const std::vector<cpu_layer> &layers, const hwc_rect_t &damage,
+		buffer_handle_t *out_buffer)
+{
+	ATRACE_CALL();
+	if (!gbm || (format != HAL_PIXEL_FORMAT_RGBA_8888 && format != HAL_PIXEL_FORMAT_RGBX_8888))
+		return -EINVAL;
+	for (const auto &layer : layers) {
+		if (!can_compose(layer.buffer))
+			return -EINVAL;
+	}
+
+	std::lock_guard<std::mutex> guard(mutex);
+	if (!targets->slots[0].buffer) {
+		int err = alloc_targets(targets, width, height, format);
+		if (err)
+			return err;
+	} else if (targets->width != width || targets->height != height ||
+			targets->format != format) {
+		return -EINVAL;
+	}
+
+	int index = (targets->current + 1) % CPU_TARGET_COUNT;
+	struct cpu_targets::slot &slot = targets->slots[index];
+	if (slot.release_fence >= 0) {
+		if (sync_wait(slot.release_fence, FENCE_TIMEOUT_MS) < 0)
+			ALOGW("target fence %d not signaled (%s)", slot.release_fence,
+					strerror(errno));
+		close(slot.release_fence);
+		slot.release_fence = -1;
+	}
+
+	/* redraw what changed since the slot was written */
+	const hwc_rect_t bounds = {0, 0, int(width), int(height)};
+	uint64_t frame = ++targets->frame;
+	targets->damage[frame % CPU_TARGET_COUNT] = intersect(damage, bounds);
+	hwc_rect_t region = {};
+	if (!slot.frame || frame - slot.frame > CPU_TARGET_COUNT) {
+		region = bounds;
+	} else {
+		for (uint64_t f = slot.frame + 1; f <= frame; f++)
+			region = unite(region, targets->damage[f % CPU_TARGET_COUNT]);
+	}
+
+	for (const auto &layer : layers) {
+		if (layer.acquire_fence >= 0 && sync_wait(layer.acquire_fence, FENCE_TIMEOUT_MS) < 0)
+			ALOGW("layer fence %d not signaled (%s)", layer.acquire_fence,
+					strerror(errno));
+	}
+	int64_t start = now_ns();
+
+	std::vector<source> sources;
+	std::vector<buffer_handle_t> locked;
+	int err = map_layers(layers, &sources, &locked);
+
+	void *target_addr = nullptr;
+	const private_handle_t *target =
+		reinterpret_cast<const private_handle_t *>(slot.buffer);
+	if (!err) {
+		err = gbm_lock(slot.buffer, GRALLOC1_PRODUCER_USAGE_CPU_WRITE_OFTEN, 0, 0, 0, 0,
+				&target_addr);
+		if (err)
+			ALOGE("can't map target %p (%s)", slot.buffer, strerror(-err));
+	}
+
+	if (!err && !is_empty(region)) {
+		row.resize(width);
+		scaled.resize(width);
+		size_t n = size_t(region.right - region.left);
+		for (int y = region.top; y < region.bottom; y++) {
+			memset(row.data() + region.left, 0, n * sizeof(uint32_t));
+			for (size_t i = 0; i < layers.size(); i++) {
+				const cpu_layer &layer = layers[i];
+				const source &src = sources[i];
+				const hwc_rect_t &f = layer.display_frame;
+				if (y < f.top || y >= f.bottom)
+					continue;
+				int x0 = std::max(f.left, region.left);
+				int x1 = std::min(f.right, region.right);
+				if (x0 >= x1)
+					continue;
+
+				int32_t sy = std::clamp<int32_t>(
+					int32_t((src.y + (y - f.top) * src.step_y) >> 16),
+					0, int32_t(src.hnd->height) - 1);
+				const uint32_t *src_row = reinterpret_cast<const uint32_t *>(
+					src.addr + size_t(sy) * src.hnd->stride);
+				int64_t sx = src.x + (x0 - f.left) * src.step_x;
+				const uint32_t *pixels;
+				if (src.direct) {
+					pixels = src_row + (sx >> 16);
+				} else {
+					sample_row(scaled.data(), src_row, size_t(x1 - x0), sx,
+							src.step_x, int32_t(src.hnd->width) - 1);
+					pixels = scaled.data();
+				}
+
+				if (src.opaque && layer.alpha == 255)
+					copy_row(row.data() + x0, pixels, size_t(x1 - x0));
+				else
+					blend_row(row.data() + x0, pixels, size_t(x1 - x0),
+							layer.alpha, src.opaque);
+			}
+			/* the target is likely write-combined, it is only ever written */
+			memcpy(static_cast<uint8_t *>(target_addr) + size_t(y) * target->stride +
+					size_t(region.left) * sizeof(uint32_t),
+					row.data() + region.left, n * sizeof(uint32_t));
+		}
+	}
+
+	if (target_addr)
+		gbm_unlock(slot.buffer);
+	for (buffer_handle_t buffer : locked)
+		gbm_unlock(buffer);
+	if (err)
+		return err;
+
+	slot.frame = frame;
+	targets->current = index;
+	targets->presenting = true;
+	compositions++;
+	pixels += uint64_t(std::max(region.right - region.left, 0)) *
+		std::max(region.bottom - region.top, 0);
+	compose_ns += now_ns() - start;
+	ALOGV("composed %zu layers into %p, (%d, %d)-(%d, %d)", layers.size(), slot.buffer,
+			region.left, region.top, region.right, region.bottom);
+	*out_buffer = slot.buffer;
+	return 0;
+}
+
+int cpu_compositor::sample(uint32_t width, uint32_t height, uint32_t step,
+		const std::vector<cpu_layer> &layers, cpu_histogram &histogram)
+{
+	ATRACE_CALL();
+	if (!gbm || !step)
+		return -EINVAL;
+	for (const auto &layer : layers) {
+		if (!can_compose(layer.buffer))
+			return -EINVAL;
+	}
+
+	std::lock_guard<std::mutex> guard(mutex);
+	int64_t start = now_ns();
+	std::vector<source> sources;
+	std::vector<buffer_handle_t> locked;
+	int err = map_layers(layers, &sources, &locked);
+
+	/* the sampled pixels of a row are composed like compose() does */
+	size_t n = (width + step - 1) / step;
+	row.resize(n);
+	scaled.resize(n);
+	cpu_histogram odd = {};
+	for (uint32_t y = step / 2; y < height && !err; y += step) {
+		memset(row.data(), 0, n * sizeof(uint32_t));
+		for (size_t i = 0; i < layers.size(); i++) {
+			const cpu_layer &layer = layers[i];
+			const source &src = sources[i];
+			const hwc_rect_t &f = layer.display_frame;
+			if (int(y) < f.top || int(y) >= f.bottom)
+				continue;
+			int i0 = first_sample(f.left, step);
+			int i1 = std::min(first_sample(f.right, step), int(n));
+			if (i0 >= i1)
+				continue;
+
+			int32_t sy = std::clamp<int32_t>(
+				int32_t((src.y + (int(y) - f.top) * src.step_y) >> 16),
+				0, int32_t(src.hnd->height) - 1);
+			const uint32_t *src_row = reinterpret_cast<const uint32_t *>(
+				src.addr + size_t(sy) * src.hnd->stride);
+			int64_t sx = src.x + (i0 * int(step) + int(step / 2) - f.left) * src.step_x;
+			sample_row(scaled.data(), src_row, size_t(i1 - i0), sx, src.step_x * step,
+					int32_t(src.hnd->width) - 1);
+			if (src.opaque && layer.alpha == 255)
+				copy_row(row.data() + i0, scaled.data(), size_t(i1 - i0));
+			else
+				blend_row(row.data() + i0, scaled.data(), size_t(i1 - i0),
+						layer.alpha, src.opaque);
+		}
+		histogram_row(histogram, odd, row.data(), n);
+	}
+
+	for (buffer_handle_t buffer : locked)
+		gbm_unlock(buffer);
+	if (err)
+		return err;
+	for (int c = 0; c < 3; c++) {
+		for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+			histogram[c][b] += odd[c][b];
+	}
+	samplings++;
+	sample_ns += now_ns() - start;
+	return 0;
+}
+
+bool cpu_compositor::target_ready(struct cpu_targets *targets)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	const struct cpu_targets::slot &slot =
+		targets->slots[(targets->current + 1) % CPU_TARGET_COUNT];
+	return slot.release_fence < 0 || sync_wait(slot.release_fence, 0) == 0;
+}
+
+void cpu_compositor::presented(struct cpu_targets *targets, int32_t fence)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	if (targets->pending >= 0) {
+		targets->slots[targets->pending].release_fence = fence >= 0 ? dup(fence) : -1;
+		targets->pending = -1;
+	}
+	if (targets->presenting) {
+		targets->pending = targets->current;
+		targets->presenting = false;
+	}
+}
+
+void cpu_compositor::free_targets(struct cpu_targets *targets)
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	for (auto &slot : targets->slots) {
+		if (slot.buffer)
+			gbm_free(slot.buffer);
+		if (slot.release_fence >= 0)
+			close(slot.release_fence);
+	}
+	*targets = cpu_targets();
+}
+
+std::string cpu_compositor::dump()
+{
+	std::lock_guard<std::mutex> guard(mutex);
+	char line[160];
+	snprintf(line, sizeof(line),
+			"cpu compositions: %" PRIu64 ", %.1f Mpixels, avg %.2f ms; "
+			"content samplings: %" PRIu64 ", avg %.2f ms\n",
+			compositions, pixels / 1e6,
+			compositions ? compose_ns / 1e6 / compositions : 0.0,
+			samplings, samplings ? sample_ns / 1e6 / samplings : 0.0);
+	return line;
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
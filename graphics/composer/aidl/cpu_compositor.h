@@ -0,0 +1,145 @@
+/*
+ * Copyright 2026 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cutils/native_handle.h>
+#include <hardware/hwcomposer_defs.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+struct gbm_device;
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+/* a layer composed on the CPU, layers go bottom-to-top */
+struct cpu_layer
+{
+    buffer_handle_t buffer;
+    int32_t acquire_fence; /* -1 if none, stays owned by the caller */
+    hwc_frect_t source_crop;
+    hwc_rect_t display_frame;
+    uint8_t alpha; /* plane alpha */
+    bool opaque;   /* HWC2_BLEND_MODE_NONE, the alpha channel is ignored */
+};
+
+#define CPU_TARGET_COUNT 3
+
+/* buckets of a histogram, one per 8 bit value */
+#define HISTOGRAM_BUCKETS 256
+/* histograms of the R, G and B components */
+typedef uint32_t cpu_histogram[3][HISTOGRAM_BUCKETS];
+
+/*
+ * The scanout buffers a display composes into on the CPU. A buffer is
+ * reused once the present after the one that showed it signaled, and only
+ * the damage of the compositions since it was last written is redrawn.
+ */
+struct cpu_targets
+{
+    struct slot {
+        buffer_handle_t buffer = nullptr;
+        int release_fence = -1;
+        uint64_t frame = 0; /* composition that last wrote it, 0 if none */
+    } slots[CPU_TARGET_COUNT];
+    hwc_rect_t damage[CPU_TARGET_COUNT] = {};
+    uint64_t frame = 0;
+    int current = -1; /* slot of the last composition */
+    int pending = -1; /* slot that gets the fence of the next present */
+    bool presenting = false; /* current isn't presented yet */
+    uint32_t width = 0;
+    uint32_t height = 0;
+    int format = 0;
+};
+
+/*
+ * Composition on the CPU: copies for virtual displays that have no
+ * writeback connector to compose with, and blending of the few simple
+ * layers that didn't get a plane, instead of waking the GPU for them.
+ * Buffers are mapped through gbm_gralloc and stay imported until the
+ * client releases them.
+ */
+class cpu_compositor {
+  public:
+    cpu_compositor();
+    ~cpu_compositor();
+    cpu_compositor(const cpu_compositor&) = delete;
+    cpu_compositor& operator=(const cpu_compositor&) = delete;
+
+    /*
+     * Copy src into dst once both fences signaled, the part the two have
+     * in common if their sizes differ. The formats have to have the same
+     * pixel size. The fences stay owned by the caller.
+     */
+    int blit(buffer_handle_t src, int32_t src_fence, buffer_handle_t dst, int32_t dst_fence);
+    void release_buffer(buffer_handle_t buffer);
+
+    /*
+     * Whether a layer buffer can be blended: 32 bit RGBA or RGBX in a
+     * linear layout, mapping anything tiled would take the GPU.
+     */
+    static bool can_compose(buffer_handle_t buffer);
+    /*
+     * Blend layers into the next buffer of targets, allocated as width x
+     * height of format (RGBA_8888 or RGBX_8888). damage is what changed
+     * since the last composition into targets, in display coordinates. The
+     * buffer is complete on return.
+     */
+    int compose(struct cpu_targets *targets, uint32_t width, uint32_t height, int format,
+                const std::vector<cpu_layer> &layers, const hwc_rect_t &damage,
+                buffer_handle_t *out_buffer);
+    /* whether compose() can write the next buffer of targets without waiting */
+    bool target_ready(struct cpu_targets *targets);
+    /* the display presented, fence signals when the previous frame is off screen */
+    void presented(struct cpu_targets *targets, int32_t fence);
+    /* the fb cache has to be done with the buffers first */
+    void free_targets(struct cpu_targets *targets);
+    /*
+     * Add to histogram what layers show on a width x height display, at
+     * every step-th pixel of every step-th row. The layers have to be
+     * ones can_compose() takes and done with their fences.
+     */
+    int sample(uint32_t width, uint32_t height, uint32_t step,
+               const std::vector<cpu_layer> &layers, cpu_histogram &histogram);
+
+    std::string dump();
+
+  private:
+    int lock(buffer_handle_t buffer, uint64_t usage, void **addr);
+    int alloc_targets(struct cpu_targets *targets, uint32_t width, uint32_t height,
+                      int format);
+    struct source;
+    int map_layers(const std::vector<cpu_layer> &layers, std::vector<source> *sources,
+                   std::vector<buffer_handle_t> *locked);
+
+    std::mutex mutex;
+    struct gbm_device *gbm = nullptr;
+    std::unordered_set<buffer_handle_t> imported;
+    /* a row of the target, blended in cached memory before it is written out */
+    std::vector<uint32_t> row;
+    std::vector<uint32_t> scaled;
+
+    uint64_t compositions = 0;
+    uint64_t pixels = 0;
+    int64_t compose_ns = 0;
+    uint64_t samplings = 0;
+    int64_t sample_ns = 0;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
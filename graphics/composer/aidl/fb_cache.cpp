@@ -0,0 +1,205 @@
+/*
+ * Copyright 2026 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "composer-fb_cache"
+//#define LOG_NDEBUG 0
+#include <utils/Log.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <iterator>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "fb_cache.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+/*
+ * A nonblocking commit fails with EBUSY while the previous one is pending,
+ * so once a commit went through, only the framebuffers of that commit and
+ * the one before it can still be on screen.
+ */
+#define FB_PIN_FRAMES 2
+
+fb_cache::~fb_cache()
+{
+	while (!entries.empty())
+		destroy(entries.begin());
+}
+
+void fb_cache::init(int fd, create_fb_fn fn)
+{
+	kms_fd = fd;
+	create_fb = std::move(fn);
+}
+
+/*
+ * Look up the framebuffer of a buffer, creating it on first use. A hit costs
+ * a single fstat().
+ */
+int fb_cache::get(const private_handle_t *hnd, uint32_t *fb_id)
+{
+	struct stat st;
+	if (fstat(hnd->fd, &st))
+		return -errno;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto it = entries.find(st.st_ino);
+	if (it != entries.end()) {
+		lru.splice(lru.begin(), lru, it->second.lru);
+		it->second.released = false;
+		*fb_id = it->second.fb_id;
+		return 0;
+	}
+
+	uint32_t gem_handle;
+	int ret = drmPrimeFDToHandle(kms_fd, hnd->fd, &gem_handle);
+	if (ret) {
+		ALOGE("drmPrimeFDToHandle() failed (%s)", strerror(errno));
+		return ret;
+	}
+	gem_refs[gem_handle]++;
+
+	uint32_t id = 0;
+	ret = create_fb(hnd, gem_handle, &id);
+	if (ret) {
+		unref_gem(gem_handle);
+		return ret;
+	}
+
+	lru.push_front(st.st_ino);
+	entries.emplace(st.st_ino, entry{id, gem_handle, 0, false, lru.begin()});
+	fb_inodes[id] = st.st_ino;
+	ALOGV("created fb %u for inode %lu, %zu cached", id, (unsigned long)st.st_ino,
+			entries.size());
+
+	evict();
+	*fb_id = id;
+	return 0;
+}
+
+/*
+ * The composer client dropped a buffer. Its framebuffer goes away as soon
+ * as it is off screen, unless the buffer gets imported again before.
+ */
+void fb_cache::release(const private_handle_t *hnd)
+{
+	struct stat st;
+	if (fstat(hnd->fd, &st))
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto it = entries.find(st.st_ino);
+	if (it == entries.end())
+		return;
+	if (it->second.pins)
+		it->second.released = true;
+	else
+		destroy(it);
+}
+
+/*
+ * Record the framebuffers latched by a successful commit on an output.
+ */
+void fb_cache::pin(uint32_t output, const std::vector<uint32_t> &fb_ids)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto &frames = pinned[output];
+	frames.push_back(fb_ids);
+	for (uint32_t fb_id : fb_ids) {
+		auto ino = fb_inodes.find(fb_id);
+		if (ino != fb_inodes.end())
+			entries.at(ino->second).pins++;
+	}
+
+	while (frames.size() > FB_PIN_FRAMES) {
+		unpin_frame(frames.front());
+		frames.pop_front();
+	}
+
+	evict();
+}
+
+/*
+ * Nothing of an output is on screen any more, e.g. its CRTC is off. The
+ * framebuffers of released buffers go away right away.
+ */
+void fb_cache::unpin(uint32_t output)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto frames = pinned.find(output);
+	if (frames == pinned.end())
+		return;
+	for (const auto &fb_ids : frames->second)
+		unpin_frame(fb_ids);
+	pinned.erase(frames);
+
+	evict();
+}
+
+void fb_cache::unpin_frame(const std::vector<uint32_t> &fb_ids)
+{
+	for (uint32_t fb_id : fb_ids) {
+		auto ino = fb_inodes.find(fb_id);
+		if (ino == fb_inodes.end())
+			continue;
+		auto it = entries.find(ino->second);
+		if (--it->second.pins == 0 && it->second.released)
+			destroy(it);
+	}
+}
+
+void fb_cache::destroy(entry_map::iterator it)
+{
+	const entry &e = it->second;
+
+	ALOGV("removing fb %u", e.fb_id);
+	drmModeRmFB(kms_fd, e.fb_id);
+	unref_gem(e.gem_handle);
+	fb_inodes.erase(e.fb_id);
+	lru.erase(e.lru);
+	entries.erase(it);
+}
+
+void fb_cache::evict()
+{
+	auto ino = lru.end();
+	while (entries.size() > capacity && ino != lru.begin()) {
+		auto it = entries.find(*--ino);
+		if (it->second.pins)
+			continue;
+		/* destroy() erases the list node, keep hold of its successor */
+		ino = std::next(ino);
+		destroy(it);
+	}
+}
+
+void fb_cache::unref_gem(uint32_t gem_handle)
+{
+	auto it = gem_refs.find(gem_handle);
+	if (it == gem_refs.end() || --it->second)
+		return;
+	gem_refs.erase(it);
+	drmCloseBufferHandle(kms_fd, gem_handle);
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2026 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <drm_handle.h>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+/*
+ * KMS framebuffers of imported buffers, keyed by the inode of the dma-buf so
+ * a buffer maps to one framebuffer however often it gets imported. Entries
+ * hold a reference on the GEM handle of the buffer and are destroyed when
+ * the composer client releases the buffer, or least recently used first once
+ * the cache is full. Framebuffers latched by the last commits of an output
+ * are pinned and survive both until they have left the screen.
+ */
+class fb_cache {
+  public:
+    using create_fb_fn = std::function<int(const private_handle_t *hnd,
+                                           uint32_t gem_handle, uint32_t *fb_id)>;
+
+    explicit fb_cache(size_t capacity) : capacity(capacity) {}
+    ~fb_cache();
+
+    void init(int fd, create_fb_fn create_fb);
+    int get(const private_handle_t *hnd, uint32_t *fb_id);
+    void release(const private_handle_t *hnd);
+    void pin(uint32_t output, const std::vector<uint32_t> &fb_ids);
+    void unpin(uint32_t output);
+
+  private:
+    struct entry {
+        uint32_t fb_id;
+        uint32_t gem_handle;
+        uint32_t pins;
+        bool released;
+        std::list<ino_t>::iterator lru;
+    };
+    using entry_map = std::unordered_map<ino_t, entry>;
+
+    void destroy(entry_map::iterator it);
+    void unpin_frame(const std::vector<uint32_t> &fb_ids);
+    void evict();
+    void unref_gem(uint32_t gem_handle);
+
+    size_t capacity;
+    int kms_fd = -1;
+    create_fb_fn create_fb;
+
+    std::mutex mutex;
+    entry_map entries;
+    /* most recently used first */
+    std::list<ino_t> lru;
+    std::unordered_map<uint32_t, ino_t> fb_inodes;
+    std::unordered_map<uint32_t, uint32_t> gem_refs;
+    /* framebuffers of the last commits, per output */
+    std::unordered_map<uint32_t, std::deque<std::vector<uint32_t>>> pinned;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,210 @@
+/*
+ * Copyright 2026 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "composer-fence_monitor"
+//#define LOG_NDEBUG 0
+#include <utils/Log.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+
+#include <sync/sync.h>
+
+#include <vector>
+
+#include "fence_monitor.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+#define MAX_EVENTS 16
+#define FENCE_TIMEOUT_MS 1000
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+fence_monitor &fence_monitor::get()
+{
+	static fence_monitor monitor;
+	return monitor;
+}
+
+fence_monitor::fence_monitor()
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (epoll_fd < 0 || event_fd < 0) {
+		ALOGE("failed to create fence monitor fds (%s)", strerror(errno));
+		return;
+	}
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = event_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev)) {
+		ALOGE("failed to watch fence monitor eventfd (%s)", strerror(errno));
+		return;
+	}
+
+	running = true;
+	thread = std::thread(&fence_monitor::loop, this);
+}
+
+fence_monitor::~fence_monitor()
+{
+	if (running) {
+		uint64_t one = 1;
+		running = false;
+		(void)write(event_fd, &one, sizeof(one));
+		thread.join();
+	}
+	for (const auto &[fd, e] : entries)
+		close(fd);
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	if (event_fd >= 0)
+		close(event_fd);
+}
+
+/*
+ * Fences that can't be polled, or all of them if the monitor thread didn't
+ * start, are only waited for, right away and for a bounded time, when a
+ * continuation depends on them. Those merely watched are let go.
+ */
+void fence_monitor::watch(int fence, const char *name, callback cb)
+{
+	if (fence < 0) {
+		if (cb)
+			cb(0);
+		return;
+	}
+
+	int64_t start = now_ns();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.fd = fence;
+		if (running && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fence, &ev) == 0) {
+			entries[fence] = { name, start, std::move(cb) };
+			return;
+		}
+	}
+
+	if (!cb) {
+		ALOGV("fence %d (%s) can't be monitored", fence, name);
+		close(fence);
+		return;
+	}
+	ALOGW("fence %d (%s) can't be monitored, waiting", fence, name);
+	if (sync_wait(fence, FENCE_TIMEOUT_MS) < 0)
+		ALOGE("fence %d (%s) wait failed (%s)", fence, name, strerror(errno));
+	close(fence);
+	int64_t wait_ns = now_ns() - start;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		account(name, wait_ns);
+	}
+	if (cb)
+		cb(wait_ns);
+}
+
+/* called with the mutex held */
+void fence_monitor::account(const char *name, int64_t wait_ns)
+{
+	struct stats &s = waits[name];
+	s.count++;
+	s.total_ns += wait_ns;
+	if (wait_ns > s.max_ns)
+		s.max_ns = wait_ns;
+}
+
+std::string fence_monitor::dump()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::string out;
+	char line[160];
+
+	snprintf(line, sizeof(line), "fences pending: %zu\n", entries.size());
+	out += line;
+	for (const auto &[name, s] : waits) {
+		snprintf(line, sizeof(line),
+				"  %s: %" PRIu64 " fences, wait avg %.2f ms max %.2f ms\n",
+				name.c_str(), s.count,
+				s.count ? s.total_ns / 1e6 / s.count : 0.0, s.max_ns / 1e6);
+		out += line;
+	}
+	return out;
+}
+
+void fence_monitor::loop()
+{
+	prctl(PR_SET_NAME, "fence_monitor", 0, 0, 0);
+
+	while (running) {
+		struct epoll_event events[MAX_EVENTS];
+		int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("fence monitor epoll_wait() failed (%s)", strerror(errno));
+			break;
+		}
+
+		int64_t now = now_ns();
+		std::vector<std::pair<callback, int64_t>> signaled;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int i = 0; i < n; i++) {
+				int fd = events[i].data.fd;
+				if (fd == event_fd) {
+					uint64_t count;
+					(void)read(event_fd, &count, sizeof(count));
+					continue;
+				}
+
+				auto it = entries.find(fd);
+				if (it == entries.end())
+					continue;
+				/* EPOLLERR also ends the wait, like an error of sync_wait() */
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+				close(fd);
+
+				struct entry e = std::move(it->second);
+				entries.erase(it);
+				int64_t wait_ns = now - e.start_ns;
+				account(e.name, wait_ns);
+				if (e.cb)
+					signaled.emplace_back(std::move(e.cb), wait_ns);
+			}
+		}
+
+		/* continuations may watch further fences */
+		for (auto &[cb, wait_ns] : signaled)
+			cb(wait_ns);
+	}
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2026 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+/*
+ * Waits for sync_file fences on a single epoll thread, so no binder thread
+ * has to block on one. Each fence comes with a continuation that runs on
+ * the monitor thread once the fence signaled, and the time every fence took
+ * to signal is accounted under the name it was watched with.
+ */
+class fence_monitor {
+  public:
+    /* wait_ns is the time from watch() until the fence signaled */
+    using callback = std::function<void(int64_t wait_ns)>;
+
+    static fence_monitor &get();
+
+    fence_monitor();
+    ~fence_monitor();
+    fence_monitor(const fence_monitor&) = delete;
+    fence_monitor& operator=(const fence_monitor&) = delete;
+
+    /* takes ownership of fence; name has to be a string literal */
+    void watch(int fence, const char *name, callback cb);
+    std::string dump();
+
+  private:
+    struct entry {
+        const char *name;
+        int64_t start_ns;
+        callback cb;
+    };
+    struct stats {
+        uint64_t count;
+        int64_t total_ns;
+        int64_t max_ns;
+    };
+
+    void loop();
+    void account(const char *name, int64_t wait_ns);
+
+    int epoll_fd = -1;
+    int event_fd = -1;
+    std::atomic<bool> running{false};
+    std::thread thread;
+
+    std::mutex mutex;
+    std::unordered_map<int, entry> entries;
+    std::map<std::string, stats> waits;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
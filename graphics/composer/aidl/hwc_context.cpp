@@ -27,6 +27,7 @@
 #include <cutils/properties.h>
 #include <utils/Log.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -34,122 +35,783 @@
 #include <string.h>
 #include <poll.h>
 #include <math.h>
+#include <algorithm>
+#include <functional>
 #include <system/graphics.h>
-#include <hardware_legacy/uevent.h>
 
 #include <drm_fourcc.h>
+#include <sync/sync.h>
 
 #include "hwc_context.h"
 
 namespace aidl::android::hardware::graphics::composer3::impl {
 
-int hwc_context::add_fb(const private_handle_t *hnd)
+#define ALIGN(value, base) (((value) + ((base) - 1)) & ~((base) - 1))
+
+/* bound of the user-space waits for acquire fences */
+#define FENCE_TIMEOUT_MS 1000
+
+/*
+ * DRM format and plane layout of a gralloc buffer, as allocated and locked
+ * by gbm_gralloc.
+ */
+struct fb_layout {
+	uint32_t format;
+	uint32_t num_planes;
+	uint32_t pitches[4];
+	uint32_t offsets[4];
+};
+
+static bool get_fb_layout(const private_handle_t *hnd, struct fb_layout *layout)
 {
-	if (hnd->fb_id)
-		return 0;
+	memset(layout, 0, sizeof(*layout));
+	layout->num_planes = 1;
+	layout->pitches[0] = hnd->stride;
+
+	switch (hnd->format) {
+	case HAL_PIXEL_FORMAT_RGBA_8888:
+		layout->format = DRM_FORMAT_ABGR8888;
+		break;
+	case HAL_PIXEL_FORMAT_RGBX_8888:
+		layout->format = DRM_FORMAT_XBGR8888;
+		break;
+	case HAL_PIXEL_FORMAT_BGRA_8888:
+		layout->format = DRM_FORMAT_ARGB8888;
+		break;
+	case HAL_PIXEL_FORMAT_RGB_565:
+		layout->format = DRM_FORMAT_RGB565;
+		break;
+	case HAL_PIXEL_FORMAT_YV12: {
+		/* Y, Cr and Cb in one GR88 buffer, see gbm_lock_ycbcr() */
+		uint32_t ystride = hnd->width;
+		uint32_t cstride = ALIGN(ystride / 2, 16);
+		layout->format = DRM_FORMAT_YVU420;
+		layout->num_planes = 3;
+		layout->pitches[0] = ystride;
+		layout->pitches[1] = cstride;
+		layout->pitches[2] = cstride;
+		layout->offsets[1] = ystride * hnd->height;
+		layout->offsets[2] = layout->offsets[1] + cstride * hnd->height / 2;
+		break;
+	}
+	case HAL_PIXEL_FORMAT_YCBCR_420_888: {
+		/* Y and interleaved CbCr, see gbm_lock_ycbcr() */
+		uint32_t stride = ALIGN(hnd->width, 16);
+		layout->format = DRM_FORMAT_NV12;
+		layout->num_planes = 2;
+		layout->pitches[0] = stride;
+		layout->pitches[1] = stride;
+		layout->offsets[1] = stride * hnd->height;
+		break;
+	}
+	default:
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Whether a plane can scan out a format with the given layout modifier.
+ * Buffers allocated without modifiers have an implicit layout that the
+ * driver picked for scanout, treat it as linear.
+ */
+static bool plane_supports(const struct kms_plane *plane, uint32_t format, uint64_t modifier)
+{
+	if (modifier == DRM_FORMAT_MOD_INVALID)
+		modifier = DRM_FORMAT_MOD_LINEAR;
+
+	if (plane->modifiers.empty()) {
+		/* no IN_FORMATS, only linear is known to work */
+		return modifier == DRM_FORMAT_MOD_LINEAR &&
+			std::find(plane->formats.begin(), plane->formats.end(), format) !=
+				plane->formats.end();
+	}
+	return std::find(plane->modifiers.begin(), plane->modifiers.end(),
+			std::make_pair(format, modifier)) != plane->modifiers.end();
+}
 
-	uint32_t pitches[4] = { 0, 0, 0, 0 };
-	uint32_t offsets[4] = { 0, 0, 0, 0 };
+/*
+ * Create the framebuffer of a buffer imported as gem_handle, called by the
+ * framebuffer cache on a miss.
+ */
+int hwc_context::create_fb(const private_handle_t *hnd, uint32_t gem_handle, uint32_t *fb_id)
+{
 	uint32_t handles[4] = { 0, 0, 0, 0 };
 	uint64_t modifiers[4] = { 0, 0, 0, 0 };
+	struct fb_layout layout;
+
+	if (!get_fb_layout(hnd, &layout)) {
+		ALOGE("create_fb() unsupported format %d", hnd->format);
+		return -EINVAL;
+	}
 
-        uint32_t width = (uint32_t)primary_output.mode.hdisplay;
-        uint32_t height = (uint32_t)primary_output.mode.vdisplay;
-        uint32_t drm_format = primary_output.drm_format;
+	for (uint32_t i = 0; i < layout.num_planes; i++) {
+		handles[i] = gem_handle;
+		modifiers[i] = hnd->modifier;
+	}
+	uint32_t flags = hnd->modifier != DRM_FORMAT_MOD_INVALID ? DRM_MODE_FB_MODIFIERS : 0;
+
+	ALOGV("create_fb() width:%d height:%d format:%x modifier:%llx handle:%d pitch:%d",
+			hnd->width, hnd->height, layout.format, (unsigned long long)hnd->modifier,
+			gem_handle, layout.pitches[0]);
+	int ret = drmModeAddFB2WithModifiers(kms_fd,
+		hnd->width, hnd->height,
+		layout.format, handles, layout.pitches, layout.offsets, modifiers,
+		fb_id, flags);
+	if (ret)
+		ALOGE("create_fb() failed for %p (%s)", hnd, strerror(errno));
+	return ret;
+}
 
-	uint32_t handle;
-	int ret = drmPrimeFDToHandle(kms_fd, hnd->fd, &handle);
-	if (ret != 0) {
-		ALOGE("add_fb() error drmPrimeFDToHandle()");
-		return ret;
+int hwc_context::add_fb(const private_handle_t *hnd, uint32_t *fb_id)
+{
+	return fbs.get(hnd, fb_id);
+}
+
+void hwc_context::release_buffer(buffer_handle_t buffer)
+{
+	if (!buffer || private_handle_t::validate(buffer) < 0)
+		return;
+	fbs.release(reinterpret_cast<const private_handle_t *>(buffer));
+}
+
+/*
+ * Keep the framebuffers of a commit alive while they can be on screen. The
+ * last client target stays pinned too, assign_planes() tests against it.
+ */
+void hwc_context::pin_fbs(hwc2_display_t display_id, const struct kms_output *output,
+		const std::vector<kms_layer> &layers, uint32_t readback_fb_id)
+{
+	std::vector<uint32_t> fb_ids;
+	if (output->client_fb_id)
+		fb_ids.push_back(output->client_fb_id);
+	for (const auto &layer : layers)
+		fb_ids.push_back(layer.fb_id);
+	if (readback_fb_id)
+		fb_ids.push_back(readback_fb_id);
+	fbs.pin(uint32_t(display_id), fb_ids);
+}
+
+static const struct kms_plane *find_plane(const struct kms_output *output, uint32_t plane_id)
+{
+	if (output->primary_plane.plane_id == plane_id)
+		return &output->primary_plane;
+	for (const auto &plane : output->overlay_planes) {
+		if (plane.plane_id == plane_id)
+			return &plane;
 	}
+	if (output->cursor_plane.plane_id && output->cursor_plane.plane_id == plane_id)
+		return &output->cursor_plane;
+	return NULL;
+}
 
-	pitches[0] = width * 4;
-	handles[0] = handle;
-	modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+/*
+ * Whether the kernel can wait for the acquire fence of a buffer on a plane.
+ */
+bool hwc_context::kernel_waits(const struct kms_output *output, uint32_t plane_id)
+{
+	const struct kms_plane *plane = find_plane(output, plane_id);
+	return plane && plane->props.has(PLANE_PROP_IN_FENCE_FD);
+}
 
-	ALOGV("add_fb() width:%d height:%d format:%x handle:%d pitch:%d",
-			width, height, drm_format, handle, pitches[0]);
-	return drmModeAddFB2WithModifiers(kms_fd,
-		width, height,
-		drm_format, handles, pitches, offsets, modifiers,
-                (uint32_t *)&hnd->fb_id, DRM_MODE_FB_MODIFIERS);
+/*
+ * Without IN_FENCE_FD the kernel can't wait for the buffer, so it has to be
+ * waited for before the commit. Queued frames only get here once the fence
+ * monitor saw their fences signal.
+ */
+static void plane_set(kms_atomic_req &req, const struct kms_plane *plane,
+		uint32_t crtc_id, uint32_t fb_id, int32_t in_fence, uint64_t zpos,
+		const hwc_frect_t &src, const hwc_rect_t &dst, uint32_t damage_blob)
+{
+	uint32_t id = plane->plane_id;
+	const kms_plane_props &props = plane->props;
+
+	if (in_fence >= 0) {
+		if (props.has(PLANE_PROP_IN_FENCE_FD))
+			req.add(id, props, PLANE_PROP_IN_FENCE_FD, uint64_t(int64_t(in_fence)));
+		else if (sync_wait(in_fence, FENCE_TIMEOUT_MS) < 0)
+			ALOGW("plane %u: acquire fence %d not signaled (%s)",
+					id, in_fence, strerror(errno));
+	}
+	req.add(id, props, PLANE_PROP_FB_ID, fb_id);
+	req.add(id, props, PLANE_PROP_CRTC_ID, crtc_id);
+	/* source coordinates are 16.16 fixed point */
+	req.add(id, props, PLANE_PROP_SRC_X, uint64_t(src.left * 65536.0f));
+	req.add(id, props, PLANE_PROP_SRC_Y, uint64_t(src.top * 65536.0f));
+	req.add(id, props, PLANE_PROP_SRC_W, uint64_t((src.right - src.left) * 65536.0f));
+	req.add(id, props, PLANE_PROP_SRC_H, uint64_t((src.bottom - src.top) * 65536.0f));
+	req.add(id, props, PLANE_PROP_CRTC_X, uint64_t(int64_t(dst.left)));
+	req.add(id, props, PLANE_PROP_CRTC_Y, uint64_t(int64_t(dst.top)));
+	req.add(id, props, PLANE_PROP_CRTC_W, uint64_t(dst.right - dst.left));
+	req.add(id, props, PLANE_PROP_CRTC_H, uint64_t(dst.bottom - dst.top));
+	/* an immutable zpos can't be reordered */
+	const struct kms_prop &zpos_prop = props.prop[PLANE_PROP_ZPOS];
+	if (!(zpos_prop.flags & DRM_MODE_PROP_IMMUTABLE))
+		req.add(id, zpos_prop.id, std::max(zpos, zpos_prop.min));
+	/* the kernel drops the clips with every new plane state, none is a full update */
+	if (damage_blob)
+		req.add(id, props, PLANE_PROP_FB_DAMAGE_CLIPS, damage_blob);
 }
 
+/* more clips than drivers care to walk become their bounding box */
+#define MAX_DAMAGE_CLIPS 16
 
-static int64_t get_property_value(int fd, drmModeObjectPropertiesPtr props,
-				  const char *name) {
-	drmModePropertyPtr prop;
-	uint64_t value;
+/*
+ * FB_DAMAGE_CLIPS blob of the damage of a plane, 0 for a full update. The
+ * blob goes into blobs, to be destroyed once the commit holds it.
+ */
+uint32_t hwc_context::damage_blob(const struct kms_plane *plane,
+		const std::vector<hwc_rect_t> &damage, std::vector<uint32_t> *blobs)
+{
+	if (!blobs || damage.empty() || !plane->props.has(PLANE_PROP_FB_DAMAGE_CLIPS))
+		return 0;
 
-	bool found = false;
-	for (int j = 0; j < props->count_props && !found; j++) {
-		prop = drmModeGetProperty(fd, props->props[j]);
-		if (!strcmp(prop->name, name)) {
-			value = props->prop_values[j];
-			found = true;
+	std::vector<struct drm_mode_rect> clips;
+	for (const auto &rect : damage)
+		clips.push_back({ rect.left, rect.top, rect.right, rect.bottom });
+	if (clips.size() > MAX_DAMAGE_CLIPS) {
+		struct drm_mode_rect box = { INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN };
+		for (const auto &clip : clips) {
+			if (clip.x1 >= clip.x2 || clip.y1 >= clip.y2)
+				continue;
+			box.x1 = std::min(box.x1, clip.x1);
+			box.y1 = std::min(box.y1, clip.y1);
+			box.x2 = std::max(box.x2, clip.x2);
+			box.y2 = std::max(box.y2, clip.y2);
 		}
-		drmModeFreeProperty(prop);
+		if (box.x1 >= box.x2)
+			box = {};
+		clips.assign(1, box);
 	}
 
-	if (!found)
-		return -1;
-	return value;
+	uint32_t blob_id = 0;
+	if (drmModeCreatePropertyBlob(kms_fd, clips.data(), clips.size() * sizeof(clips[0]),
+			&blob_id)) {
+		ALOGW("can't create damage blob (%s)", strerror(errno));
+		return 0;
+	}
+	blobs->push_back(blob_id);
+	return blob_id;
 }
 
-static uint32_t get_property_id(int fd, drmModeObjectPropertiesPtr props,
-				   const char *name) {
-	drmModePropertyPtr prop;
-	uint32_t prop_id = 0;
+void hwc_context::destroy_blobs(std::vector<uint32_t> &blobs)
+{
+	for (uint32_t blob_id : blobs)
+		drmModeDestroyPropertyBlob(kms_fd, blob_id);
+	blobs.clear();
+}
 
-	bool found = false;
-	for (int j = 0; j < props->count_props && !found; j++) {
-		prop = drmModeGetProperty(fd, props->props[j]);
-		if (!strcmp(prop->name, name)) {
-		    prop_id = prop->prop_id;
-			found = true;
-		}
-		drmModeFreeProperty(prop);
+static void plane_disable(kms_atomic_req &req, const struct kms_plane *plane)
+{
+	req.add(plane->plane_id, plane->props, PLANE_PROP_FB_ID, 0);
+	req.add(plane->plane_id, plane->props, PLANE_PROP_CRTC_ID, 0);
+}
+
+/*
+ * Add the whole plane state of an output to an atomic request. The primary
+ * plane carries the client target unless a layer has been mapped onto it,
+ * overlays not used by any layer are switched off. Without damage_blobs the
+ * planes get no damage clips.
+ */
+void hwc_context::set_planes(kms_atomic_req &req, struct kms_output *output,
+		uint32_t client_fb_id, int32_t client_fence,
+		const std::vector<hwc_rect_t> &client_damage, const std::vector<kms_layer> &layers,
+		std::vector<uint32_t> *damage_blobs)
+{
+	uint64_t zpos = 0;
+
+	bool primary_used = false;
+	for (const auto &layer : layers) {
+		if (layer.plane_id == output->primary_plane.plane_id)
+			primary_used = true;
 	}
-	return prop_id;
+
+	if (!primary_used && client_fb_id) {
+		hwc_frect_t src = { 0.0f, 0.0f,
+			float(output->mode.hdisplay), float(output->mode.vdisplay) };
+		hwc_rect_t dst = { 0, 0, output->mode.hdisplay, output->mode.vdisplay };
+		plane_set(req, &output->primary_plane, output->crtc_id, client_fb_id,
+				client_fence, zpos++, src, dst,
+				damage_blob(&output->primary_plane, client_damage, damage_blobs));
+	}
+
+	std::vector<bool> overlay_used(output->overlay_planes.size(), false);
+	bool cursor_used = false;
+	for (const auto &layer : layers) {
+		const struct kms_plane *plane = find_plane(output, layer.plane_id);
+		if (!plane)
+			continue;
+		plane_set(req, plane, output->crtc_id, layer.fb_id, layer.acquire_fence,
+				zpos++, layer.source_crop, layer.display_frame,
+				damage_blob(plane, layer.damage, damage_blobs));
+		if (plane == &output->cursor_plane)
+			cursor_used = true;
+		else if (plane != &output->primary_plane)
+			overlay_used[plane - output->overlay_planes.data()] = true;
+	}
+
+	for (size_t i = 0; i < output->overlay_planes.size(); i++) {
+		if (!overlay_used[i])
+			plane_disable(req, &output->overlay_planes[i]);
+	}
+	if (output->cursor_plane.plane_id && !cursor_used)
+		plane_disable(req, &output->cursor_plane);
 }
 
+/*
+ * The writeback connector that can read back the CRTC of an output: the one
+ * already attached to it, or else a free one that can be attached. Called
+ * with commit_mutex held, which guards the attachments.
+ */
+struct kms_writeback *hwc_context::find_writeback(const struct kms_output *output)
+{
+	if (!output->crtc_id)
+		return NULL;
+	struct kms_writeback *found = NULL;
+	for (auto &writeback : writebacks) {
+		if (writeback.crtc_id == output->crtc_id)
+			return &writeback;
+		if (!found && !writeback.crtc_id &&
+				(writeback.possible_crtcs & (1u << output->pipe)))
+			found = &writeback;
+	}
+	return found;
+}
 
-int hwc_context::atomic_commit(hwc2_display_t display_id, struct kms_output *output,
-			       const private_handle_t *hnd, int32_t *out_fence) {
-    if (!hnd)
-        return 0;
+/* have the composition of a frame written into fb_id */
+void hwc_context::set_writeback(kms_atomic_req &req, struct kms_output *output,
+		uint32_t fb_id, int32_t *fence)
+{
+	struct kms_writeback *writeback = output->writeback;
+	if (!writeback || !fb_id)
+		return;
+	req.add(writeback->connector_id, writeback->props, CONNECTOR_PROP_CRTC_ID,
+			output->crtc_id);
+	req.add(writeback->connector_id, writeback->props, CONNECTOR_PROP_WRITEBACK_FB_ID, fb_id);
+	req.add(writeback->connector_id, writeback->props,
+			CONNECTOR_PROP_WRITEBACK_OUT_FENCE_PTR, uint64_t(fence));
+}
 
-    int ret = 0;
-    drmModeAtomicReq *req = drmModeAtomicAlloc();
-    drmModeAtomicAddProperty(req, output->crtc_id, output->prop_out_fence, uint64_t(out_fence));
-    drmModeAtomicAddProperty(req, output->plane_id, output->prop_fb_id, hnd->fb_id);
-    drmModeAtomicAddProperty(req, output->plane_id, output->prop_crtc_id, output->crtc_id);
+/*
+ * Commit the frames of one or more outputs in a single atomic request, each
+ * CRTC with an out-fence of its own. A request with several outputs that
+ * fails leaves the outputs as they are, the caller commits the frames one
+ * by one then.
+ */
+int hwc_context::atomic_commit(struct kms_frame *frames, size_t count) {
+    bool flip = false;
+    std::vector<uint32_t> blobs;
+
+    commit_req.reset();
+    for (size_t i = 0; i < count; i++) {
+        struct kms_frame &frame = frames[i];
+        frame.out_fence = -1;
+        frame.readback_fence = -1;
+        frame.ret = 0;
+        bool planes = frame.client_fb_id || !frame.layers.empty();
+        if (!planes && !frame.set_ctm && !frame.set_gamma)
+            continue;
+        if (frame.set_content_type)
+            commit_req.add(frame.output->connector_id, frame.output->connector_props,
+                           CONNECTOR_PROP_CONTENT_TYPE, frame.content_type);
+        if (frame.set_ctm)
+            set_ctm(commit_req, frame.output, frame.ctm_enabled, frame.ctm, &blobs);
+        if (frame.set_gamma)
+            commit_req.add(frame.output->crtc_id, frame.output->crtc_props,
+                           CRTC_PROP_GAMMA_LUT, frame.gamma_blob);
+        flip = true;
+        /* color changes of their own, see flush_color() */
+        if (!planes)
+            continue;
+        commit_req.add(frame.output->crtc_id, frame.output->crtc_props,
+                       CRTC_PROP_OUT_FENCE_PTR, uint64_t(&frame.out_fence));
+        /* damage is against what the planes show, a failed commit left that unknown */
+        if (frame.output->commit.full_damage) {
+            frame.client_damage.clear();
+            for (auto &layer : frame.layers)
+                layer.damage.clear();
+        }
+        set_planes(commit_req, frame.output, frame.client_fb_id, frame.client_fence,
+                   frame.client_damage, frame.layers, &blobs);
+        set_writeback(commit_req, frame.output, frame.readback_fb_id, &frame.readback_fence);
+    }
+    if (!flip)
+        return 0;
 
     uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_ATOMIC_NONBLOCK;
-    ret = drmModeAtomicCommit(kms_fd, req, flags, (void *)this);
+    /* the event thread waits for the flip before committing the next frame */
+    if (events_running)
+        flags |= DRM_MODE_PAGE_FLIP_EVENT;
+    /* the flip events tell the CRTCs apart by id */
+    int ret = commit_req.commit(kms_fd, flags, &frames[0].output->event_data);
+    /* the plane and CRTC states hold their own references of the blobs */
+    destroy_blobs(blobs);
+    for (size_t i = 0; i < count; i++) {
+        if (frames[i].client_fb_id || !frames[i].layers.empty())
+            frames[i].output->commit.full_damage = ret < 0;
+    }
     if (ret < 0)  {
-        ALOGE("failed to perform page flip for primary (%s) (crtc %d fb %d))",
-            strerror(errno), output->crtc_id, hnd->fb_id);
-        /* try to set mode for next frame */
-        if (errno != EBUSY) {
-           if (display_id == 0) first_post = 1;
-           else if (display_id == 1) first_post2 = 1;
+        int err = errno;
+        for (size_t i = 0; i < count; i++) {
+            struct kms_frame &frame = frames[i];
+            ALOGE("atomic commit failed (crtc %u, client fb %u, %zu layers, readback fb %u, "
+                "%zu crtcs) (%s)", frame.output->crtc_id, frame.client_fb_id,
+                frame.layers.size(), frame.readback_fb_id, count, strerror(err));
+            frame.ret = ret;
+            /* try to set mode for next frame */
+            if (count == 1 && err != EBUSY && (frame.client_fb_id || !frame.layers.empty())) {
+               frame.output->modeset = true;
+               frame.output->plane_test_cache.clear();
+            }
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            struct kms_frame &frame = frames[i];
+            if (!frame.client_fb_id && frame.layers.empty())
+                continue;
+            if (frame.client_fb_id)
+                frame.output->client_fb_id = frame.client_fb_id;
+            pin_fbs(frame.display_id, frame.output, frame.layers, frame.readback_fb_id);
         }
     }
-    drmModeAtomicFree(req);
     return ret < 0 ? ret : 0; 
 }
 
-int hwc_context::hwc_post(hwc2_display_t display_id, buffer_handle_t buffer, int32_t *out_fence)
+/*
+ * Remember where the cursor moved, for the event thread to commit. A frame
+ * waiting in the mailbox takes the position along instead, it would move
+ * the cursor back otherwise. Without the event thread the position is
+ * committed right away.
+ */
+int hwc_context::set_cursor_position(hwc2_display_t display_id, uint32_t plane_id,
+		int32_t x, int32_t y)
 {
-    if (private_handle_t::validate(buffer) < 0)
-       return -EINVAL;
+	struct kms_output *output = get_output(display_id);
+	if (!output || !output->crtc_id || !find_plane(output, plane_id))
+		return -EINVAL;
+
+	if (!events_running)
+		return commit_cursor(output, plane_id, x, y);
+
+	{
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		struct kms_commit &commit = output->commit;
+		for (auto &layer : commit.layers) {
+			if (layer.plane_id != plane_id)
+				continue;
+			layer.display_frame.right += x - layer.display_frame.left;
+			layer.display_frame.bottom += y - layer.display_frame.top;
+			layer.display_frame.left = x;
+			layer.display_frame.top = y;
+		}
+		commit.cursor_moved = !commit.has_frame;
+		commit.cursor_plane_id = plane_id;
+		commit.cursor_x = x;
+		commit.cursor_y = y;
+	}
+	wake_events();
+	return 0;
+}
 
-    private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(buffer);
+/*
+ * Commit the position of the plane showing the cursor and nothing else. On
+ * the event thread it flips like a frame, so that the next one waits for it.
+ */
+int hwc_context::commit_cursor(struct kms_output *output, uint32_t plane_id,
+		int32_t x, int32_t y)
+{
+	const struct kms_plane *plane = find_plane(output, plane_id);
+	if (!plane)
+		return -EINVAL;
+
+	commit_req.reset();
+	/* CRTC_ID pulls the CRTC into the commit, which the flip event needs */
+	commit_req.add(plane_id, plane->props, PLANE_PROP_CRTC_ID, output->crtc_id);
+	commit_req.add(plane_id, plane->props, PLANE_PROP_CRTC_X, uint64_t(int64_t(x)));
+	commit_req.add(plane_id, plane->props, PLANE_PROP_CRTC_Y, uint64_t(int64_t(y)));
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK;
+	if (events_running)
+		flags |= DRM_MODE_PAGE_FLIP_EVENT;
+	int ret = commit_req.commit(kms_fd, flags, &output->event_data);
+	if (ret < 0) {
+		ALOGV("cursor move on plane %u failed (%s)", plane_id, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+struct kms_output *hwc_context::get_output(hwc2_display_t display_id)
+{
+	if (display_id < outputs.size())
+		return outputs[display_id].get();
+	return NULL;
+}
+
+/*
+ * Whether a layer buffer can be turned into a framebuffer by add_fb() and
+ * scanned out by a plane.
+ */
+bool hwc_context::layer_supported(const struct kms_output *output, const kms_layer &layer)
+{
+	if (private_handle_t::validate(layer.handle) < 0)
+		return false;
+
+	const private_handle_t *hnd = reinterpret_cast<const private_handle_t *>(layer.handle);
+
+	/* create_fb() has to know the layout, and some plane has to take it */
+	struct fb_layout layout;
+	if (!get_fb_layout(hnd, &layout))
+		return false;
+	bool scanout = plane_supports(&output->primary_plane, layout.format, hnd->modifier);
+	for (const auto &plane : output->overlay_planes)
+		scanout = scanout || plane_supports(&plane, layout.format, hnd->modifier);
+	if (!scanout && !cursor_fits(output, layer))
+		return false;
+
+	const hwc_frect_t &src = layer.source_crop;
+	if (src.left < 0.0f || src.top < 0.0f ||
+			src.right > float(hnd->width) || src.bottom > float(hnd->height) ||
+			src.right <= src.left || src.bottom <= src.top)
+		return false;
+
+	const hwc_rect_t &dst = layer.display_frame;
+	if (dst.right <= dst.left || dst.bottom <= dst.top)
+		return false;
+
+	return true;
+}
+
+/*
+ * Whether the cursor plane of an output can show a cursor layer: unscaled,
+ * in a format it takes and no larger than DRM_CAP_CURSOR_WIDTH/HEIGHT.
+ */
+bool hwc_context::cursor_fits(const struct kms_output *output, const kms_layer &layer)
+{
+	if (!layer.cursor || !output->cursor_plane.plane_id ||
+			private_handle_t::validate(layer.handle) < 0)
+		return false;
+
+	const private_handle_t *hnd = reinterpret_cast<const private_handle_t *>(layer.handle);
+	struct fb_layout layout;
+	if (!get_fb_layout(hnd, &layout) ||
+			!plane_supports(&output->cursor_plane, layout.format, hnd->modifier))
+		return false;
+
+	const hwc_frect_t &src = layer.source_crop;
+	const hwc_rect_t &dst = layer.display_frame;
+	return src.right - src.left == float(dst.right - dst.left) &&
+		src.bottom - src.top == float(dst.bottom - dst.top) &&
+		uint64_t(dst.right - dst.left) <= cursor_width &&
+		uint64_t(dst.bottom - dst.top) <= cursor_height;
+}
+
+static inline void hash_combine(size_t &seed, size_t value)
+{
+	seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+static size_t hash_layers(const struct kms_output *output,
+		const std::vector<kms_layer> &layers, bool client_target)
+{
+	std::hash<float> hash_float;
+	size_t seed = 0;
+
+	hash_combine(seed, client_target);
+	hash_combine(seed, output->client_fb_id != 0);
+	for (const auto &layer : layers) {
+		const private_handle_t *hnd = reinterpret_cast<const private_handle_t *>(layer.handle);
+		hash_combine(seed, hnd->format);
+		hash_combine(seed, hnd->width);
+		hash_combine(seed, hnd->height);
+		hash_combine(seed, hnd->stride);
+		hash_combine(seed, hnd->modifier);
+		hash_combine(seed, hash_float(layer.source_crop.left));
+		hash_combine(seed, hash_float(layer.source_crop.top));
+		hash_combine(seed, hash_float(layer.source_crop.right));
+		hash_combine(seed, hash_float(layer.source_crop.bottom));
+		hash_combine(seed, layer.cursor);
+		/* a moving cursor keeps its planes, only its size counts */
+		if (layer.cursor) {
+			hash_combine(seed, layer.display_frame.right - layer.display_frame.left);
+			hash_combine(seed, layer.display_frame.bottom - layer.display_frame.top);
+			continue;
+		}
+		hash_combine(seed, layer.display_frame.left);
+		hash_combine(seed, layer.display_frame.top);
+		hash_combine(seed, layer.display_frame.right);
+		hash_combine(seed, layer.display_frame.bottom);
+	}
+	return seed;
+}
 
-	if (!hnd->fb_id) {
-		int err = add_fb(hnd);
+/*
+ * Map layers[first..] onto planes: the lowest one goes to the primary plane
+ * when there is no client target, a cursor on top to the cursor plane, the
+ * others to the first free overlay that takes their format. Fails if a
+ * layer is left without a plane.
+ */
+bool hwc_context::map_planes(struct kms_output *output, std::vector<kms_layer> &layers,
+		size_t first, bool client_target)
+{
+	std::vector<bool> overlay_used(output->overlay_planes.size(), false);
+
+	for (auto &layer : layers)
+		layer.plane_id = 0;
+
+	for (size_t i = first; i < layers.size(); i++) {
+		const private_handle_t *hnd =
+			reinterpret_cast<const private_handle_t *>(layers[i].handle);
+		struct fb_layout layout;
+		get_fb_layout(hnd, &layout);
+
+		if (i == first && !client_target) {
+			if (!plane_supports(&output->primary_plane, layout.format, hnd->modifier))
+				return false;
+			layers[i].plane_id = output->primary_plane.plane_id;
+			continue;
+		}
+		if (i == layers.size() - 1 && cursor_fits(output, layers[i])) {
+			layers[i].plane_id = output->cursor_plane.plane_id;
+			continue;
+		}
+
+		for (size_t o = 0; o < overlay_used.size() && !layers[i].plane_id; o++) {
+			const struct kms_plane *plane = &output->overlay_planes[o];
+			if (overlay_used[o] || !plane_supports(plane, layout.format, hnd->modifier))
+				continue;
+			overlay_used[o] = true;
+			layers[i].plane_id = plane->plane_id;
+		}
+		if (!layers[i].plane_id)
+			return false;
+	}
+	return true;
+}
+
+#define PLANE_TEST_CACHE_SIZE 256
+
+/*
+ * Assign planes to the layers of a display, bottom-to-top. Only the top-most
+ * run of supported layers can be scanned out directly, everything below is
+ * left to the client target. Candidate assignments are checked with a
+ * TEST_ONLY commit, dropping the lowest layer to the client target until the
+ * kernel accepts one. Results are cached per layer configuration.
+ *
+ * Returns the number of layers, counted from the top, that got a plane.
+ */
+size_t hwc_context::assign_planes(hwc2_display_t display_id, std::vector<kms_layer> &layers,
+		bool client_target)
+{
+	struct kms_output *output = get_output(display_id);
+
+	for (auto &layer : layers)
+		layer.plane_id = 0;
+
+	if (!output || !output->active || output->modeset || layers.empty())
+		return 0;
+
+	size_t first = layers.size();
+	while (first > 0 && layer_supported(output, layers[first - 1]))
+		first--;
+	if (first == layers.size())
+		return 0;
+	if (first > 0)
+		client_target = true;
+
+	/* a cursor on top doesn't take an overlay */
+	size_t num_overlays = output->overlay_planes.size() + cursor_fits(output, layers.back());
+	if (!client_target && layers.size() - first > num_overlays + 1)
+		client_target = true;
+	if (client_target && layers.size() - first > num_overlays)
+		first = layers.size() - num_overlays;
+
+	size_t key = hash_layers(output, layers, client_target);
+	auto cached = output->plane_test_cache.find(key);
+	if (cached != output->plane_test_cache.end()) {
+		first = cached->second;
+		if (first == layers.size() ||
+				!map_planes(output, layers, first, client_target || first > 0)) {
+			for (auto &layer : layers)
+				layer.plane_id = 0;
+			return 0;
+		}
+		return layers.size() - first;
+	}
+
+	for (; first < layers.size(); first++) {
+		bool has_client = client_target || first > 0;
+
+		if (!map_planes(output, layers, first, has_client))
+			continue;
+
+		bool missing_fb = false;
+		for (size_t i = first; i < layers.size() && !missing_fb; i++) {
+			const private_handle_t *hnd =
+				reinterpret_cast<const private_handle_t *>(layers[i].handle);
+			missing_fb = (add_fb(hnd, &layers[i].fb_id) != 0);
+		}
+		if (missing_fb)
+			continue;
+
+		output->test_req.reset();
+		set_planes(output->test_req, output, has_client ? output->client_fb_id : 0, -1,
+				{}, layers);
+		int ret = output->test_req.commit(kms_fd, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+		if (ret == 0)
+			break;
+		ALOGV("assign_planes() test with %zu layers failed (%s)",
+				layers.size() - first, strerror(errno));
+	}
+
+	if (first == layers.size()) {
+		for (auto &layer : layers)
+			layer.plane_id = 0;
+	}
+
+	if (output->plane_test_cache.size() >= PLANE_TEST_CACHE_SIZE)
+		output->plane_test_cache.clear();
+	output->plane_test_cache.emplace(key, first);
+
+	return layers.size() - first;
+}
+
+/* the exact frame period, vrefresh is rounded */
+static int64_t mode_period_ns(const drmModeModeInfo *mode)
+{
+	if (mode->clock && mode->htotal && mode->vtotal)
+		return int64_t(mode->htotal) * mode->vtotal * 1000000 / mode->clock;
+	return 1000000000 / (mode->vrefresh ? mode->vrefresh : 60);
+}
+
+int hwc_context::hwc_post(hwc2_display_t display_id, buffer_handle_t buffer,
+		int32_t acquire_fence, const std::vector<hwc_rect_t> &client_damage,
+		std::vector<kms_layer> &layers, int32_t *out_fence)
+{
+    struct kms_output *output = get_output(display_id);
+    if (!output)
+        return -EINVAL;
+    /* switched off, the frame is dropped */
+    if (!output->active) {
+        *out_fence = -1;
+        return 0;
+    }
+
+    bool client_target = true;
+    for (const auto &layer : layers) {
+        if (layer.plane_id == output->primary_plane.plane_id)
+            client_target = false;
+    }
+
+    private_handle_t const* hnd = NULL;
+    if (client_target) {
+        if (private_handle_t::validate(buffer) < 0)
+            return -EINVAL;
+        hnd = reinterpret_cast<private_handle_t const*>(buffer);
+    }
+
+	uint32_t client_fb_id = 0;
+	if (hnd) {
+		int err = add_fb(hnd, &client_fb_id);
 		if (err) {
 			ALOGE("%s: could not create drm fb, (%s)",
 				__func__, strerror(-err));
@@ -158,39 +820,662 @@ int hwc_context::hwc_post(hwc2_display_t display_id, buffer_handle_t buffer, int
 		}
 	}
 
+	for (auto &layer : layers) {
+		const private_handle_t *layer_hnd =
+			reinterpret_cast<const private_handle_t *>(layer.handle);
+		int err = add_fb(layer_hnd, &layer.fb_id);
+		if (err) {
+			ALOGE("%s: could not create drm fb for layer %p, (%s)",
+				__func__, layer_hnd, strerror(-err));
+			return err;
+		}
+	}
+
     int ret;
-    struct kms_output *output;
-    if (display_id == 0) {
-	output = &primary_output;
-	if (first_post) {
-		ret = drmModeSetCrtc(kms_fd, output->crtc_id, hnd->fb_id,
+	if (output->modeset) {
+		discard_frame(output);
+		output->mode = output->modes[output->config];
+		if (output->crtc_props.has(CRTC_PROP_MODE_ID))
+			return atomic_modeset(display_id, output, client_fb_id, acquire_fence,
+					layers, out_fence);
+
+		if (!hnd)
+			return -EINVAL;
+		if (acquire_fence >= 0 && sync_wait(acquire_fence, FENCE_TIMEOUT_MS) < 0)
+			ALOGW("client target fence %d not signaled (%s)",
+					acquire_fence, strerror(errno));
+		/* no writeback without atomic modesetting */
+		output->readback_fb_id = 0;
+		wait_readback_release(output);
+		ret = drmModeSetCrtc(kms_fd, output->crtc_id, client_fb_id,
 			0, 0, &output->connector_id, 1, &output->mode);
-		if (!ret) first_post = 0;
-                *out_fence = -1;
+		if (!ret) {
+			output->modeset = false;
+			output->client_fb_id = client_fb_id;
+			pin_fbs(display_id, output, {});
+			std::lock_guard<std::mutex> lock(vsync_mutex);
+			output->vsync.period_ns = mode_period_ns(&output->mode);
+		}
+		*out_fence = -1;
 		return ret;
+	}
+
+    if (events_running)
+        ret = queue_frame(display_id, output, client_fb_id, acquire_fence, client_damage,
+                          layers, out_fence);
+    else {
+        struct kms_frame frame = { display_id, output, client_fb_id, acquire_fence,
+                                   layers, 0, -1, 0 };
+        frame.client_damage = client_damage;
+        wait_readback_release(output);
+        frame.readback_fb_id = output->readback_fb_id;
+        output->readback_fb_id = 0;
+        {
+            std::lock_guard<std::mutex> lock(commit_mutex);
+            take_color_changes(&frame);
         }
-    } else if (display_id == 1){
-	output = &secondary_output;
-	if (first_post2) {
-		ret = drmModeSetCrtc(kms_fd, output->crtc_id, hnd->fb_id,
-			0, 0, &output->connector_id, 1, &output->mode);
-		if (!ret) first_post2 = 0;
-                *out_fence = -1;
-		return ret;
+        ret = atomic_commit(&frame, 1);
+        *out_fence = frame.out_fence;
+        {
+            std::lock_guard<std::mutex> lock(commit_mutex);
+            if (ret)
+                keep_color_changes(&frame);
+            if (frame.readback_fb_id) {
+                if (output->commit.readback_fence >= 0)
+                    close(output->commit.readback_fence);
+                output->commit.readback_fence = frame.readback_fence;
+            }
         }
-    } else {
-        return -EINVAL;
     }
-
-    ret = atomic_commit(display_id, output, hnd, out_fence);
-    ALOGV("hwc_post() fd %d, fb_id %d, out_fence %d",
-        hnd->fd, hnd->fb_id, *out_fence);
+    ALOGV("hwc_post() fb_id %d, layers %zu, out_fence %d",
+        client_fb_id, layers.size(), *out_fence);
 
     return ret;
 }
 
-bool hwc_context::is_display2_active() {
-    return (secondary_output.active == 1);
+/*
+ * Set the mode of output->mode, along with the planes of the frame, in a
+ * blocking atomic commit. The driver skips the full modeset if it can.
+ */
+int hwc_context::atomic_modeset(hwc2_display_t display_id, struct kms_output *output,
+		uint32_t client_fb_id, int32_t client_fence,
+		const std::vector<kms_layer> &layers, int32_t *out_fence)
+{
+	uint32_t blob_id = 0;
+	if (drmModeCreatePropertyBlob(kms_fd, &output->mode, sizeof(output->mode), &blob_id))
+		return -errno;
+
+	kms_atomic_req req;
+	std::vector<uint32_t> blobs;
+	req.add(output->crtc_id, output->crtc_props, CRTC_PROP_MODE_ID, blob_id);
+	req.add(output->crtc_id, output->crtc_props, CRTC_PROP_ACTIVE, 1);
+	req.add(output->crtc_id, output->crtc_props, CRTC_PROP_OUT_FENCE_PTR,
+			uint64_t(out_fence));
+	req.add(output->connector_id, output->connector_props, CONNECTOR_PROP_CRTC_ID,
+			output->crtc_id);
+	{
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		req.add(output->connector_id, output->connector_props,
+				CONNECTOR_PROP_CONTENT_TYPE, output->commit.content_type);
+		output->commit.content_type_changed = false;
+		if (output->commit.ctm_changed || output->commit.ctm_enabled)
+			set_ctm(req, output, output->commit.ctm_enabled, output->commit.ctm, &blobs);
+		output->commit.ctm_changed = false;
+		if (output->commit.gamma_changed || output->commit.gamma_blob)
+			req.add(output->crtc_id, output->crtc_props, CRTC_PROP_GAMMA_LUT,
+					output->commit.gamma_blob);
+		output->commit.gamma_changed = false;
+	}
+	/* a modeset updates the planes in full */
+	set_planes(req, output, client_fb_id, client_fence, {}, layers);
+	wait_readback_release(output);
+	uint32_t readback_fb_id = output->readback_fb_id;
+	int32_t readback_fence = -1;
+	output->readback_fb_id = 0;
+	set_writeback(req, output, readback_fb_id, &readback_fence);
+
+	*out_fence = -1;
+	int ret = req.commit(kms_fd, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	/* the CRTC state holds its own reference of the blobs */
+	drmModeDestroyPropertyBlob(kms_fd, blob_id);
+	destroy_blobs(blobs);
+	if (readback_fb_id) {
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		if (output->commit.readback_fence >= 0)
+			close(output->commit.readback_fence);
+		output->commit.readback_fence = readback_fence;
+	}
+	if (ret) {
+		ALOGE("modeset of %s to %s failed (%s)", output->name.c_str(),
+				output->mode.name, strerror(errno));
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		output->commit.ctm_changed = true;
+		output->commit.gamma_changed = true;
+		return ret;
+	}
+
+	ALOGI("%s set to %s@%u", output->name.c_str(), output->mode.name,
+			output->mode.vrefresh);
+	output->modeset = false;
+	output->commit.full_damage = false;
+	output->plane_test_cache.clear();
+	if (client_fb_id)
+		output->client_fb_id = client_fb_id;
+	pin_fbs(display_id, output, layers, readback_fb_id);
+	std::lock_guard<std::mutex> lock(vsync_mutex);
+	output->vsync.period_ns = mode_period_ns(&output->mode);
+	return 0;
+}
+
+int hwc_context::get_display_info(hwc2_display_t display_id, struct kms_display_info *info)
+{
+	const struct kms_output *output = get_output(display_id);
+	if (!output)
+		return -EINVAL;
+
+	info->name = output->name;
+	info->configs.clear();
+	for (size_t i = 0; i < output->modes.size(); i++) {
+		const drmModeModeInfo &mode = output->modes[i];
+		struct kms_config_info config;
+		config.width = mode.hdisplay;
+		config.height = mode.vdisplay;
+		config.vsync_period_ns = mode_period_ns(&mode);
+		if (output->mm_width && output->mm_height) {
+			config.xdpi = mode.hdisplay * 25.4f / output->mm_width;
+			config.ydpi = mode.vdisplay * 25.4f / output->mm_height;
+		} else {
+			config.xdpi = config.ydpi = 75.0f;
+		}
+		/* a group is named after its first config */
+		config.group = uint32_t(i);
+		for (size_t j = 0; j < i; j++) {
+			if (info->configs[j].width == config.width &&
+					info->configs[j].height == config.height) {
+				config.group = info->configs[j].group;
+				break;
+			}
+		}
+		info->configs.push_back(config);
+	}
+	info->active_config = output->config;
+	info->content_types = output->connector_props.has(CONNECTOR_PROP_CONTENT_TYPE);
+	info->connected = output->crtc_id != 0;
+	info->is_virtual = output->is_virtual;
+	info->cursor_plane_id = output->cursor_plane.plane_id;
+	info->brightness = output->crtc_props.has(CRTC_PROP_GAMMA_LUT);
+	return 0;
+}
+
+int hwc_context::set_content_type(hwc2_display_t display_id, uint32_t content_type)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output)
+		return -EINVAL;
+	if (!output->connector_props.has(CONNECTOR_PROP_CONTENT_TYPE))
+		return -EOPNOTSUPP;
+
+	std::lock_guard<std::mutex> lock(commit_mutex);
+	struct kms_commit &commit = output->commit;
+	if (commit.content_type != content_type) {
+		commit.content_type = content_type;
+		commit.content_type_changed = true;
+	}
+	return 0;
+}
+
+/*
+ * The CTM of a color transform: S31.32 sign-magnitude, applied to column
+ * vectors, where the matrix of the client applies to row vectors. The CRTC
+ * has no offsets, nor anything for alpha.
+ */
+static bool to_ctm(const float *matrix, struct drm_color_ctm *ctm)
+{
+	if (matrix[3] != 0.0f || matrix[7] != 0.0f || matrix[11] != 0.0f ||
+			matrix[12] != 0.0f || matrix[13] != 0.0f || matrix[14] != 0.0f ||
+			matrix[15] != 1.0f)
+		return false;
+
+	for (int row = 0; row < 3; row++) {
+		for (int col = 0; col < 3; col++) {
+			double value = matrix[col * 4 + row];
+			if (!(fabs(value) < 2147483648.0))
+				return false;
+			uint64_t magnitude = uint64_t(fabs(value) * 4294967296.0);
+			ctm->matrix[row * 3 + col] = magnitude | (value < 0.0 ? 1ull << 63 : 0);
+		}
+	}
+	return true;
+}
+
+/* the CTM of a frame, the blob goes into blobs */
+void hwc_context::set_ctm(kms_atomic_req &req, struct kms_output *output, bool enabled,
+		const struct drm_color_ctm &ctm, std::vector<uint32_t> *blobs)
+{
+	uint32_t blob_id = 0;
+	if (enabled) {
+		if (drmModeCreatePropertyBlob(kms_fd, &ctm, sizeof(ctm), &blob_id)) {
+			ALOGW("can't create CTM blob (%s)", strerror(errno));
+			return;
+		}
+		blobs->push_back(blob_id);
+	}
+	req.add(output->crtc_id, output->crtc_props, CRTC_PROP_CTM, blob_id);
+}
+
+/*
+ * A CTM the CRTC hasn't had yet is tried in a TEST_ONLY commit first, some
+ * CRTCs share their color management hardware.
+ */
+int hwc_context::set_color_transform(hwc2_display_t display_id, const float *matrix)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output || !output->crtc_id)
+		return -EINVAL;
+	if (!output->crtc_props.has(CRTC_PROP_CTM))
+		return matrix ? -EOPNOTSUPP : 0;
+
+	struct drm_color_ctm ctm = {};
+	if (matrix && !to_ctm(matrix, &ctm))
+		return -EOPNOTSUPP;
+
+	std::lock_guard<std::mutex> lock(commit_mutex);
+	struct kms_commit &commit = output->commit;
+	bool enabled = matrix != NULL;
+	if (commit.ctm_enabled == enabled &&
+			(!enabled || !memcmp(&commit.ctm, &ctm, sizeof(ctm))))
+		return 0;
+
+	if (enabled) {
+		kms_atomic_req req;
+		std::vector<uint32_t> blobs;
+		set_ctm(req, output, true, ctm, &blobs);
+		int ret = blobs.empty() ? -ENOMEM :
+			req.commit(kms_fd, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+		if (ret < 0)
+			ret = -errno;
+		destroy_blobs(blobs);
+		if (ret) {
+			ALOGI("%s can't apply the color transform (%s)", output->name.c_str(),
+					strerror(-ret));
+			return ret;
+		}
+	}
+	commit.ctm = ctm;
+	commit.ctm_enabled = enabled;
+	commit.ctm_changed = true;
+	return 0;
+}
+
+/* brightness steps, full brightness leaves the GAMMA_LUT off */
+#define BRIGHTNESS_STEPS 255
+/* linear light at the lowest step, dimmer gets hard to read */
+#define MIN_BRIGHTNESS 0.02
+#define GAMMA_BLOB_CACHE_SIZE 16
+
+/*
+ * The GAMMA_LUT blob of a brightness step below full, BRIGHTNESS_STEPS + 1
+ * being off. Sinks decode with about a 2.2 power, so scaling the encoded
+ * values dims linear light by the power of the scale. Blobs stay cached per
+ * step, a brightness slider goes over the same steps again and again; the
+ * least recently used go first, which are neither the pending nor the
+ * committed one. Called with commit_mutex held.
+ */
+uint32_t hwc_context::gamma_blob(struct kms_output *output, int dim)
+{
+	auto &cache = output->gamma_blobs;
+	for (auto it = cache.begin(); it != cache.end(); ++it) {
+		if (it->first == dim) {
+			auto entry = *it;
+			cache.erase(it);
+			cache.push_back(entry);
+			return entry.second;
+		}
+	}
+
+	size_t size = output->crtc_props.value(CRTC_PROP_GAMMA_LUT_SIZE);
+	if (size < 2)
+		return 0;
+	double linear = dim > BRIGHTNESS_STEPS ? 0.0 :
+		1.0 - (1.0 - MIN_BRIGHTNESS) * dim / BRIGHTNESS_STEPS;
+	double scale = pow(linear, 1.0 / 2.2);
+	std::vector<struct drm_color_lut> lut(size);
+	for (size_t i = 0; i < size; i++) {
+		uint16_t value = uint16_t(lround(65535.0 * i / (size - 1) * scale));
+		lut[i] = { value, value, value, 0 };
+	}
+
+	uint32_t blob_id = 0;
+	if (drmModeCreatePropertyBlob(kms_fd, lut.data(), size * sizeof(lut[0]), &blob_id)) {
+		ALOGW("can't create GAMMA_LUT blob (%s)", strerror(errno));
+		return 0;
+	}
+	if (cache.size() >= GAMMA_BLOB_CACHE_SIZE) {
+		drmModeDestroyPropertyBlob(kms_fd, cache.front().second);
+		cache.erase(cache.begin());
+	}
+	cache.emplace_back(dim, blob_id);
+	return blob_id;
+}
+
+int hwc_context::set_brightness(hwc2_display_t display_id, float brightness)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output || !output->crtc_id)
+		return -EINVAL;
+	if (!output->crtc_props.has(CRTC_PROP_GAMMA_LUT))
+		return -EOPNOTSUPP;
+
+	int dim = brightness < 0.0f ? BRIGHTNESS_STEPS + 1 :
+		BRIGHTNESS_STEPS - int(lroundf(std::min(brightness, 1.0f) * BRIGHTNESS_STEPS));
+	std::lock_guard<std::mutex> lock(commit_mutex);
+	struct kms_commit &commit = output->commit;
+	if (commit.dim == dim)
+		return 0;
+	uint32_t blob_id = dim ? gamma_blob(output, dim) : 0;
+	if (dim && !blob_id)
+		return -ENOMEM;
+	commit.dim = dim;
+	commit.gamma_blob = blob_id;
+	commit.gamma_changed = true;
+	return 0;
+}
+
+/*
+ * Commit the pending color changes of a display without waiting for its
+ * next frame, the event thread does once the previous flip is done.
+ */
+void hwc_context::flush_color(hwc2_display_t display_id)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output || !output->crtc_id)
+		return;
+
+	if (events_running) {
+		{
+			std::lock_guard<std::mutex> lock(commit_mutex);
+			output->commit.color_flush = true;
+		}
+		wake_events();
+		return;
+	}
+
+	struct kms_frame frame = { display_id, output };
+	{
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		take_color_changes(&frame);
+	}
+	if (!frame.set_ctm && !frame.set_gamma)
+		return;
+	atomic_commit(&frame, 1);
+	std::lock_guard<std::mutex> lock(commit_mutex);
+	if (frame.ret)
+		keep_color_changes(&frame);
+}
+
+/* HAL formats of gralloc buffers a writeback connector can write, by preference */
+static const struct {
+	int32_t hal_format;
+	uint32_t drm_format;
+} readback_formats[] = {
+	{ HAL_PIXEL_FORMAT_RGBA_8888, DRM_FORMAT_ABGR8888 },
+	{ HAL_PIXEL_FORMAT_RGBX_8888, DRM_FORMAT_XBGR8888 },
+	{ HAL_PIXEL_FORMAT_BGRA_8888, DRM_FORMAT_ARGB8888 },
+	{ HAL_PIXEL_FORMAT_RGB_565, DRM_FORMAT_RGB565 },
+};
+
+int hwc_context::get_readback_format(hwc2_display_t display_id, int32_t *format)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output)
+		return -EINVAL;
+	std::lock_guard<std::mutex> lock(commit_mutex);
+	const struct kms_writeback *writeback = find_writeback(output);
+	if (!writeback)
+		return -EOPNOTSUPP;
+
+	for (const auto &f : readback_formats) {
+		if (std::find(writeback->formats.begin(), writeback->formats.end(),
+				f.drm_format) != writeback->formats.end()) {
+			*format = f.hal_format;
+			return 0;
+		}
+	}
+	return -EOPNOTSUPP;
+}
+
+/*
+ * The buffer has to match the mode of the next frame in size. The first
+ * readback attaches the writeback connector to the CRTC of the output. The
+ * kernel doesn't wait for the release fence of a writeback buffer, so it is
+ * waited for here, it has usually signaled long before.
+ */
+int hwc_context::set_readback_buffer(hwc2_display_t display_id, buffer_handle_t buffer,
+		int32_t release_fence)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output || output->modes.empty())
+		return -EINVAL;
+	if (private_handle_t::validate(buffer) < 0)
+		return -EINVAL;
+
+	const private_handle_t *hnd = reinterpret_cast<const private_handle_t *>(buffer);
+	const drmModeModeInfo &mode = output->modes[output->config];
+	struct fb_layout layout;
+	{
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		struct kms_writeback *writeback = find_writeback(output);
+		if (!writeback)
+			return -EOPNOTSUPP;
+		if (!get_fb_layout(hnd, &layout) ||
+				std::find(writeback->formats.begin(), writeback->formats.end(),
+					layout.format) == writeback->formats.end() ||
+				hnd->width != mode.hdisplay || hnd->height != mode.vdisplay) {
+			ALOGE("unsupported readback buffer %dx%d format %d", hnd->width,
+					hnd->height, hnd->format);
+			return -EINVAL;
+		}
+		writeback->crtc_id = output->crtc_id;
+		output->writeback = writeback;
+	}
+
+	uint32_t fb_id;
+	int err = add_fb(hnd, &fb_id);
+	if (err)
+		return err;
+	/* the frame that writes the buffer waits for the fence, not the caller */
+	if (output->readback_release_fence >= 0)
+		close(output->readback_release_fence);
+	output->readback_release_fence = release_fence >= 0 ? dup(release_fence) : -1;
+	output->readback_fb_id = fb_id;
+	return 0;
+}
+
+/*
+ * The commits that don't go through the mailbox block anyway, they wait
+ * for the readback buffer to be released right before.
+ */
+void hwc_context::wait_readback_release(struct kms_output *output)
+{
+	int32_t fence = output->readback_release_fence;
+	output->readback_release_fence = -1;
+	if (fence < 0)
+		return;
+	if (output->readback_fb_id && sync_wait(fence, FENCE_TIMEOUT_MS) < 0)
+		ALOGW("readback release fence %d not signaled (%s)", fence, strerror(errno));
+	close(fence);
+}
+
+int hwc_context::get_readback_fence(hwc2_display_t display_id, int32_t *fence)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output)
+		return -EINVAL;
+
+	std::lock_guard<std::mutex> lock(commit_mutex);
+	if (output->commit.readback_fence < 0)
+		return -ENODATA;
+	*fence = output->commit.readback_fence;
+	output->commit.readback_fence = -1;
+	return 0;
+}
+
+int hwc_context::set_config(hwc2_display_t display_id, uint32_t config)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output || config >= output->modes.size())
+		return -EINVAL;
+
+	output->config = config;
+	output->modeset = true;
+	return 0;
+}
+
+bool hwc_context::config_is_seamless(hwc2_display_t display_id, uint32_t config)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output || config >= output->modes.size())
+		return false;
+	if (!memcmp(&output->mode, &output->modes[config], sizeof(output->mode)))
+		return true;
+
+	/* without ALLOW_MODESET the test fails if the mode needs a modeset */
+	uint32_t blob_id = 0;
+	if (drmModeCreatePropertyBlob(kms_fd, &output->modes[config],
+			sizeof(drmModeModeInfo), &blob_id))
+		return false;
+	kms_atomic_req req;
+	req.add(output->crtc_id, output->crtc_props, CRTC_PROP_MODE_ID, blob_id);
+	int ret = req.commit(kms_fd, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeDestroyPropertyBlob(kms_fd, blob_id);
+	return ret == 0;
+}
+
+int hwc_context::switch_config(hwc2_display_t display_id, uint32_t config)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output || config >= output->modes.size())
+		return -EINVAL;
+	const drmModeModeInfo &mode = output->modes[config];
+	/* a pending modeset comes with a frame anyway */
+	if (!output->active || output->modeset || output->is_virtual ||
+			!output->crtc_props.has(CRTC_PROP_MODE_ID) ||
+			mode.hdisplay != output->mode.hdisplay ||
+			mode.vdisplay != output->mode.vdisplay)
+		return -EOPNOTSUPP;
+	if (!memcmp(&output->mode, &mode, sizeof(mode))) {
+		output->config = config;
+		return 0;
+	}
+
+	uint32_t blob_id = 0;
+	if (drmModeCreatePropertyBlob(kms_fd, &mode, sizeof(mode), &blob_id))
+		return -errno;
+	kms_atomic_req req;
+	req.add(output->crtc_id, output->crtc_props, CRTC_PROP_MODE_ID, blob_id);
+	/* it flips like a cursor move, the event thread holds the next frame back meanwhile */
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK;
+	if (events_running) {
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		if (output->commit.flip_pending || output->commit.has_frame) {
+			drmModeDestroyPropertyBlob(kms_fd, blob_id);
+			return -EBUSY;
+		}
+		output->commit.flip_pending = true;
+		output->commit.flip_commit_ns = 0;
+		flags |= DRM_MODE_PAGE_FLIP_EVENT;
+	}
+	int ret = req.commit(kms_fd, flags, &output->event_data);
+	drmModeDestroyPropertyBlob(kms_fd, blob_id);
+	if (ret) {
+		ret = -errno;
+		if (events_running) {
+			std::lock_guard<std::mutex> lock(commit_mutex);
+			output->commit.flip_pending = false;
+		}
+		ALOGW("switching %s to %s@%u failed (%s)", output->name.c_str(), mode.name,
+				mode.vrefresh, strerror(-ret));
+		return ret;
+	}
+
+	ALOGI("%s switched to %s@%u", output->name.c_str(), mode.name, mode.vrefresh);
+	output->config = config;
+	output->mode = mode;
+	output->plane_test_cache.clear();
+	std::lock_guard<std::mutex> lock(vsync_mutex);
+	output->vsync.period_ns = mode_period_ns(&output->mode);
+	return 0;
+}
+
+/*
+ * Off is a blocking commit of ACTIVE 0 with the planes disabled, the CRTC
+ * keeps its mode and the connector. Drivers without atomic modesetting get
+ * connector DPMS instead and keep scanning out the last framebuffer.
+ */
+int hwc_context::set_power(hwc2_display_t display_id, bool on)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output || !output->crtc_id || output->is_virtual)
+		return -EINVAL;
+	if (!!output->active == on)
+		return 0;
+
+	bool atomic = output->crtc_props.has(CRTC_PROP_MODE_ID);
+	int ret = 0;
+	if (on) {
+		if (!atomic)
+			ret = drmModeConnectorSetProperty(kms_fd, output->connector_id,
+					output->connector_props.id(CONNECTOR_PROP_DPMS), DRM_MODE_DPMS_ON);
+	} else {
+		discard_frame(output);
+		if (atomic) {
+			kms_atomic_req req;
+			req.add(output->crtc_id, output->crtc_props, CRTC_PROP_ACTIVE, 0);
+			plane_disable(req, &output->primary_plane);
+			for (const auto &plane : output->overlay_planes)
+				plane_disable(req, &plane);
+			if (output->cursor_plane.plane_id)
+				plane_disable(req, &output->cursor_plane);
+			/* blocking, it waits for a flip the event thread has pending */
+			ret = req.commit(kms_fd, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+		} else {
+			ret = drmModeConnectorSetProperty(kms_fd, output->connector_id,
+					output->connector_props.id(CONNECTOR_PROP_DPMS), DRM_MODE_DPMS_OFF);
+		}
+	}
+	if (ret) {
+		ret = -errno;
+		ALOGE("switching %s %s failed (%s)", output->name.c_str(), on ? "on" : "off",
+				strerror(-ret));
+		return ret;
+	}
+	ALOGI("%s switched %s", output->name.c_str(), on ? "on" : "off");
+
+	{
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		output->active = on;
+		output->commit.cursor_moved = false;
+		output->commit.color_flush = false;
+	}
+	{
+		std::lock_guard<std::mutex> lock(vsync_mutex);
+		output->vsync.parked = !on;
+		/* a vblank event queued before the CRTC went off may never come */
+		output->vsync.queued = false;
+		output->vsync.predicted = false;
+		output->vsync.last_ns = 0;
+	}
+	wake_events();
+	if (atomic) {
+		if (on) {
+			output->modeset = true;
+		} else {
+			output->client_fb_id = 0;
+			output->plane_test_cache.clear();
+			fbs.unpin(uint32_t(display_id));
+		}
+	}
+	return 0;
 }
 
 
@@ -207,8 +1492,19 @@ bool hwc_context::is_display2_active() {
 /* C' and M' are part of the Blanking Duty Cycle computation */
 #define C_PRIME   (((C - J) * K / 256.0) + J)
 #define M_PRIME   (K / 256.0 * M)
+/* CVT reduced blanking */
+#define RB_MIN_V_BLANK 460.0 /* min time of vertical blanking (microsec) */
+#define RB_H_BLANK 160.0 /* horizontal blanking in pixels */
+#define RB_H_SYNC 32.0 /* width of hsync in pixels */
+#define RB_V_FPORCH 3.0 /* vertical front porch in lines */
+#define RB_MIN_V_BPORCH 6.0 /* min vertical back porch in lines */
 
-static drmModeModeInfoPtr generate_mode(int h_pixels, int v_lines, float freq)
+/*
+ * CVT timings of a mode, with reduced blanking if reduced is set. The pixel
+ * clock is kept to the kHz instead of CVT's 0.25 MHz steps, which would
+ * round e.g. 59.94 Hz and 60 Hz to the same clock.
+ */
+static drmModeModeInfoPtr generate_mode(int h_pixels, int v_lines, float freq, bool reduced)
 {
 	float h_pixels_rnd;
 	float v_lines_rnd;
@@ -267,7 +1563,23 @@ static drmModeModeInfoPtr generate_mode(int h_pixels, int v_lines, float freq)
 	h_front_porch = (h_blank / 2.0) - h_sync;
 	v_odd_front_porch_lines = MIN_PORCH + interlace;
 
-	m->clock = ceil(pixel_freq) * 1000;
+	if (reduced) {
+		float vbi_lines;
+
+		h_period_est = ((1000000.0 / v_field_rate_rqd) - RB_MIN_V_BLANK) /
+			(v_lines_rnd + top_margin + bottom_margin);
+		vbi_lines = floor(RB_MIN_V_BLANK / h_period_est) + 1;
+		if (vbi_lines < RB_V_FPORCH + V_SYNC_RQD + RB_MIN_V_BPORCH)
+			vbi_lines = RB_V_FPORCH + V_SYNC_RQD + RB_MIN_V_BPORCH;
+		total_v_lines = vbi_lines + v_lines_rnd + top_margin + bottom_margin + interlace;
+		total_pixels = total_active_pixels + RB_H_BLANK;
+		pixel_freq = v_field_rate_rqd * total_v_lines * total_pixels / 1000000.0;
+		h_sync = RB_H_SYNC;
+		h_front_porch = (RB_H_BLANK / 2.0) - RB_H_SYNC;
+		v_odd_front_porch_lines = RB_V_FPORCH;
+	}
+
+	m->clock = ceil(pixel_freq * 1000.0);
 	m->hdisplay = (int) (h_pixels_rnd);
 	m->hsync_start = (int) (h_pixels_rnd + h_front_porch);
 	m->hsync_end = (int) (h_pixels_rnd + h_front_porch + h_sync);
@@ -279,8 +1591,10 @@ static drmModeModeInfoPtr generate_mode(int h_pixels, int v_lines, float freq)
 	m->vtotal = (int) (total_v_lines);
 	m->vscan = 0;
 	m->vrefresh = freq;
-	m->flags = DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_PVSYNC;
+	m->flags = reduced ? DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_NVSYNC
+			   : DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_PVSYNC;
 	m->type = DRM_MODE_TYPE_DRIVER;
+	snprintf(m->name, sizeof(m->name), "%dx%d", m->hdisplay, m->vdisplay);
 
 	return (m);
 }
@@ -335,7 +1649,7 @@ static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector)
 
 	if (!found_prop_match) {
 		if (forcemode)
-			mode = generate_mode(xres, yres, rate);
+			mode = generate_mode(xres, yres, rate, false);
 		else {
 			mode = NULL;
 			for (i = 0; i < connector->count_modes; i++) {
@@ -378,68 +1692,225 @@ static drmModeModeInfoPtr find_mode(drmModeConnectorPtr connector)
 	return mode;
 }
 
+/* the monitor range limits of an EDID */
+struct edid_range_limits
+{
+	int min_vfreq, max_vfreq; /* Hz */
+	int min_hfreq, max_hfreq; /* kHz */
+	int max_clock;            /* kHz */
+	bool reduced_blanking;    /* CVT-RB supported */
+	bool continuous;          /* any timing within the limits, not just the listed ones */
+};
+
+static bool get_range_limits(int fd, uint64_t edid_blob_id, struct edid_range_limits *limits)
+{
+	drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(fd, uint32_t(edid_blob_id));
+	if (!blob)
+		return false;
+
+	const uint8_t *edid = static_cast<const uint8_t *>(blob->data);
+	/* the continuous frequency bit of EDID 1.4, default GTF support before */
+	limits->continuous = blob->length >= 128 && (edid[0x18] & 0x01);
+	bool found = false;
+	for (uint32_t d = 54; blob->length >= 128 && d <= 108 && !found; d += 18) {
+		const uint8_t *desc = edid + d;
+		if (desc[0] || desc[1] || desc[2] || desc[3] != 0xfd)
+			continue;
+		/* EDID 1.4 adds 255 to rates that don't fit a byte */
+		limits->min_vfreq = desc[5] + ((desc[4] & 0x03) == 0x03 ? 255 : 0);
+		limits->max_vfreq = desc[6] + ((desc[4] & 0x02) ? 255 : 0);
+		limits->min_hfreq = desc[7] + ((desc[4] & 0x0c) == 0x0c ? 255 : 0);
+		limits->max_hfreq = desc[8] + ((desc[4] & 0x08) ? 255 : 0);
+		limits->max_clock = desc[9] * 10000;
+		limits->reduced_blanking = false;
+		if (desc[10] == 0x04) {
+			/* CVT support information */
+			limits->max_clock -= (desc[12] >> 2) * 250;
+			limits->reduced_blanking = desc[15] & 0x10;
+		}
+		found = true;
+	}
+	drmModeFreePropertyBlob(blob);
+	return found;
+}
+
+/* frame rates of film and video content, in mHz */
+static const int content_rates[] = { 23976, 24000, 25000, 50000, 59940 };
+
 /*
- * Initialize KMS with a connector.
+ * Add configs at the content rates the connector doesn't list, for the
+ * resolution of the active config, so that film and video play without
+ * judder. Only for sinks that state their range limits and take any
+ * timing within them.
  */
-int hwc_context::init_with_connector(struct kms_output *output,
-		drmModeConnectorPtr connector) {
-	drmModeEncoderPtr encoder;
-	drmModeModeInfoPtr mode;
-	static int used_crtcs = 0;
-	int i, j;
+static void add_content_modes(int fd, struct kms_output *output)
+{
+	struct edid_range_limits limits;
+	if (!output->connector_props.has(CONNECTOR_PROP_EDID) ||
+			!get_range_limits(fd, output->connector_props.value(CONNECTOR_PROP_EDID),
+					&limits) || !limits.continuous)
+		return;
+
+	const drmModeModeInfo base = output->modes[output->config];
+	for (int rate : content_rates) {
+		if (rate < limits.min_vfreq * 1000 || rate > limits.max_vfreq * 1000)
+			continue;
 
-	encoder = drmModeGetEncoder(kms_fd, connector->encoders[0]);
-	if (!encoder)
-		return -EINVAL;
+		/* within 0.05% it's the same rate */
+		int64_t period = int64_t(1000000000000LL / rate);
+		auto listed = std::find_if(output->modes.begin(), output->modes.end(),
+				[&](const drmModeModeInfo &m) {
+			return m.hdisplay == base.hdisplay && m.vdisplay == base.vdisplay &&
+				llabs(mode_period_ns(&m) - period) * 2000 < period;
+		});
+		if (listed != output->modes.end())
+			continue;
+
+		drmModeModeInfoPtr m = generate_mode(base.hdisplay, base.vdisplay, rate / 1000.0f,
+				limits.reduced_blanking);
+		if (!m)
+			continue;
+		int hfreq = m->htotal ? int(m->clock / m->htotal) : 0;
+		if (int(m->clock) <= limits.max_clock &&
+				hfreq >= limits.min_hfreq && hfreq <= limits.max_hfreq) {
+			m->type = DRM_MODE_TYPE_USERDEF;
+			ALOGI("added %s@%.3fHz%s for content", m->name, rate / 1000.0,
+					limits.reduced_blanking ? " (reduced blanking)" : "");
+			output->modes.push_back(*m);
+		}
+		free(m);
+	}
+}
+
+/*
+ * Fetch the properties of a plane used for atomic commits.
+ */
+int hwc_context::init_plane(struct kms_plane *plane, drmModePlanePtr p)
+{
+	plane->plane_id = p->plane_id;
+	plane->possible_crtcs = p->possible_crtcs;
+	plane->formats.assign(p->formats, p->formats + p->count_formats);
+	plane->modifiers.clear();
+
+	int ret = kms_plane_props_init(kms_fd, p->plane_id, &plane->props);
+	if (ret || !plane->props.has(PLANE_PROP_IN_FORMATS))
+		return ret;
+
+	drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(kms_fd,
+			plane->props.value(PLANE_PROP_IN_FORMATS));
+	if (!blob)
+		return 0;
+
+	/* every modifier carries a 64 bit mask of the formats it applies to */
+	const char *data = static_cast<const char *>(blob->data);
+	auto header = reinterpret_cast<const struct drm_format_modifier_blob *>(data);
+	auto formats = reinterpret_cast<const uint32_t *>(data + header->formats_offset);
+	auto modifiers = reinterpret_cast<const struct drm_format_modifier *>(
+			data + header->modifiers_offset);
+	for (uint32_t m = 0; m < header->count_modifiers; m++) {
+		for (uint32_t f = 0; f < 64; f++) {
+			uint32_t index = modifiers[m].offset + f;
+			if ((modifiers[m].formats & (1ULL << f)) && index < header->count_formats)
+				plane->modifiers.emplace_back(formats[index], modifiers[m].modifier);
+		}
+	}
+	drmModeFreePropertyBlob(blob);
+	return 0;
+}
+
+/* Overlays claimed per output, the rest is left for the other output */
+#define MAX_OVERLAY_PLANES 4
+
+/*
+ * Give an output the first free CRTC of possible_crtcs, along with its
+ * primary and cursor planes and the overlay planes not used by other outputs.
+ */
+int hwc_context::claim_crtc(struct kms_output *output, uint32_t possible_crtcs)
+{
+	int i, j;
 
 	/* find first possible crtc which is not used yet */
 	for (i = 0; i < resources->count_crtcs; i++) {
-		if (encoder->possible_crtcs & (1 << i) &&
+		if (possible_crtcs & (1 << i) &&
 			(used_crtcs & (1 << i)) != (1 << i))
 			break;
 	}
 
-	used_crtcs |= (1 << i);
-
-	drmModeFreeEncoder(encoder);
 	if (i == resources->count_crtcs)
 		return -EINVAL;
+	used_crtcs |= (1 << i);
 
-	/* find primary plane id */
-	bool found_primary = false;
-	output->plane_id = 0;
-	for (j = 0; j < plane_resources->count_planes && !found_primary; j++) {
+	/* find primary, overlay and cursor planes */
+	output->primary_plane = {};
+	output->overlay_planes.clear();
+	output->cursor_plane = {};
+	output->plane_test_cache.clear();
+	for (j = 0; j < plane_resources->count_planes; j++) {
 		uint32_t plane_id = plane_resources->planes[j];
+		if (std::find(used_planes.begin(), used_planes.end(), plane_id) != used_planes.end())
+			continue;
 		drmModePlanePtr plane = drmModeGetPlane(kms_fd, plane_resources->planes[j]);
 		if (!plane) {
 			ALOGW("drmModeGetPlane(%u) failed", plane_resources->planes[j]);
 			continue;
 		}
 		if (plane->possible_crtcs & (1 << i)) {
-			drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(kms_fd,
-					plane_resources->planes[j], DRM_MODE_OBJECT_PLANE);
-			if (get_property_value(kms_fd, props, "type") == DRM_PLANE_TYPE_PRIMARY) {
-				found_primary = true;
-				output->plane_id = plane_id;
-				output->prop_fb_id = get_property_id(kms_fd, props, "FB_ID");
-				output->prop_crtc_id = get_property_id(kms_fd, props, "CRTC_ID");
+			struct kms_plane candidate = {};
+			if (init_plane(&candidate, plane)) {
+				drmModeFreePlane(plane);
+				continue;
+			}
+			uint64_t type = candidate.props.value(PLANE_PROP_TYPE);
+
+			if (type == DRM_PLANE_TYPE_PRIMARY && !output->primary_plane.plane_id) {
+				output->primary_plane = candidate;
+				used_planes.push_back(plane_id);
 				ALOGI("found primary plane %u, fb %u, crtc %u", plane_id,
-				        output->prop_fb_id, output->prop_crtc_id);
+				        candidate.props.id(PLANE_PROP_FB_ID),
+				        candidate.props.id(PLANE_PROP_CRTC_ID));
+			} else if (type == DRM_PLANE_TYPE_OVERLAY &&
+					output->overlay_planes.size() < MAX_OVERLAY_PLANES) {
+				output->overlay_planes.push_back(candidate);
+				used_planes.push_back(plane_id);
+				ALOGI("found overlay plane %u, %zu formats, %zu modifiers", plane_id,
+				        candidate.formats.size(), candidate.modifiers.size());
+			} else if (type == DRM_PLANE_TYPE_CURSOR && !output->cursor_plane.plane_id) {
+				output->cursor_plane = candidate;
+				used_planes.push_back(plane_id);
+				ALOGI("found cursor plane %u, %zu formats", plane_id,
+				        candidate.formats.size());
 			}
-			drmModeFreeObjectProperties(props);
 		}
 		drmModeFreePlane(plane);
 	}
 
 	output->crtc_id = resources->crtcs[i];
-	drmModeObjectPropertiesPtr crtc_props = drmModeObjectGetProperties(kms_fd,
-			output->crtc_id, DRM_MODE_OBJECT_CRTC);
-	output->prop_out_fence = get_property_id(kms_fd, crtc_props, "OUT_FENCE_PTR");
-	ALOGI("prop_out_fence %u", output->prop_out_fence);
-	drmModeFreeObjectProperties(crtc_props);
+	output->pipe = i;
+	kms_crtc_props_init(kms_fd, output->crtc_id, &output->crtc_props);
+	ALOGI("prop_out_fence %u", output->crtc_props.id(CRTC_PROP_OUT_FENCE_PTR));
+	return 0;
+}
 
+/*
+ * Initialize KMS with a connector.
+ */
+int hwc_context::init_with_connector(struct kms_output *output,
+		drmModeConnectorPtr connector) {
+	drmModeEncoderPtr encoder;
+	drmModeModeInfoPtr mode;
+	int i;
+
+	encoder = drmModeGetEncoder(kms_fd, connector->encoders[0]);
+	if (!encoder)
+		return -EINVAL;
+	uint32_t possible_crtcs = encoder->possible_crtcs;
+	drmModeFreeEncoder(encoder);
+
+	int ret = claim_crtc(output, possible_crtcs);
+	if (ret)
+		return ret;
+	kms_connector_props_init(kms_fd, connector->connector_id, &output->connector_props);
 	output->connector_id = connector->connector_id;
-	output->pipe = i;
 
 	/* print connector info */
 	ALOGI("there are %d modes on connector 0x%x, type %d",
@@ -451,12 +1922,46 @@ int hwc_context::init_with_connector(struct kms_output *output,
 				connector->modes[i].flags, connector->modes[i].type);
 	}
 
+	output->connector_modes.assign(connector->modes, connector->modes + connector->count_modes);
 	mode = find_mode(connector);
 	ALOGI("the best mode is %s", mode->name);
 
 	output->mode = *mode;
 	output->drm_format = DRM_FORMAT_ABGR8888;
+	output->vsync.period_ns = mode_period_ns(mode);
 
+	/* every progressive mode is a config, the one found above is active */
+	output->modes.clear();
+	output->config = UINT32_MAX;
+	for (i = 0; i < connector->count_modes; i++) {
+		const drmModeModeInfo *m = &connector->modes[i];
+		auto same = std::find_if(output->modes.begin(), output->modes.end(),
+				[m](const drmModeModeInfo &other) {
+			return other.hdisplay == m->hdisplay && other.vdisplay == m->vdisplay &&
+				mode_period_ns(&other) == mode_period_ns(m);
+		});
+		if (same != output->modes.end()) {
+			if (m == mode)
+				output->config = uint32_t(same - output->modes.begin());
+			continue;
+		}
+		if ((m->flags & DRM_MODE_FLAG_INTERLACE) && m != mode)
+			continue;
+		if (m == mode)
+			output->config = output->modes.size();
+		output->modes.push_back(*m);
+	}
+	if (output->config == UINT32_MAX) {
+		/* a forced mode the connector doesn't list */
+		output->config = output->modes.size();
+		output->modes.push_back(*mode);
+	}
+	/* a config of the same timing may stand in for it */
+	output->mode = output->modes[output->config];
+	add_content_modes(kms_fd, output);
+
+	output->mm_width = connector->mmWidth;
+	output->mm_height = connector->mmHeight;
 	if (connector->mmWidth && connector->mmHeight) {
 		output->xdpi = (output->mode.hdisplay * 25.4 / connector->mmWidth);
 		output->ydpi = (output->mode.vdisplay * 25.4 / connector->mmHeight);
@@ -471,52 +1976,288 @@ int hwc_context::init_with_connector(struct kms_output *output,
 
 
 /*
- * Fetch a connector of particular type
+ * Make a display of a connector, a connected one gets set up right away.
  */
-drmModeConnectorPtr hwc_context::fetch_connector(uint32_t type)
+int hwc_context::add_output(drmModeConnectorPtr connector)
 {
-	int i;
-	primary_connector = -1;
+	auto output = std::make_unique<struct kms_output>();
+	int ret = 0;
+	output->connector_id = connector->connector_id;
+	if (connector->connection == DRM_MODE_CONNECTED) {
+		ret = init_with_connector(output.get(), connector);
+		if (ret)
+			ALOGW("no crtc for connector %u", connector->connector_id);
+	}
 
-	if (!resources)
-		return NULL;
+	hwc2_display_t display_id = outputs.size();
+	const char *type = drmModeGetConnectorTypeName(connector->connector_type);
+	output->name = std::string(type ? type : "Unknown") + "-" +
+		std::to_string(connector->connector_type_id);
+	output->active = 1;
+	output->modeset = true;
+	output->event_data = { this, display_id };
+	output->commit.client_fence = -1;
+	output->commit.done_fence = -1;
+	output->commit.readback_fence = -1;
+	output->commit.timeline = output->commit.readback_timeline = -1;
+	output->commit.readback_release_fence = output->readback_release_fence = -1;
+	ALOGI("display %" PRIu64 " is %s on crtc %u", display_id, output->name.c_str(),
+			output->crtc_id);
+	outputs.push_back(std::move(output));
+	return ret;
+}
 
-	for (i = 0; i < resources->count_connectors; i++) {
-		drmModeConnectorPtr connector =
-			connector = drmModeGetConnector(kms_fd,
-				resources->connectors[i]);
-		if (connector) {
-			if (connector->connector_type == type &&
-				connector->connection == DRM_MODE_CONNECTED) {
-				primary_connector = i;
-				return connector;
-			}
-			drmModeFreeConnector(connector);
-		}
+/*
+ * Switch off the CRTC of a display whose sink is gone, and give its CRTC
+ * and planes back for other displays.
+ */
+void hwc_context::release_output(hwc2_display_t display_id, struct kms_output *output)
+{
+	discard_frame(output);
+
+	kms_atomic_req req;
+	req.add(output->connector_id, output->connector_props, CONNECTOR_PROP_CRTC_ID, 0);
+	req.add(output->crtc_id, output->crtc_props, CRTC_PROP_ACTIVE, 0);
+	req.add(output->crtc_id, output->crtc_props, CRTC_PROP_MODE_ID, 0);
+	plane_disable(req, &output->primary_plane);
+	for (const auto &plane : output->overlay_planes)
+		plane_disable(req, &plane);
+	if (output->cursor_plane.plane_id)
+		plane_disable(req, &output->cursor_plane);
+	/* a connector can't stay on a CRTC that is off */
+	if (output->writeback && output->writeback->connector_id != output->connector_id)
+		req.add(output->writeback->connector_id, output->writeback->props,
+				CONNECTOR_PROP_CRTC_ID, 0);
+	if (req.commit(kms_fd, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL))
+		ALOGW("failed to switch off crtc %u (%s)", output->crtc_id, strerror(errno));
+	output->readback_fb_id = 0;
+	wait_readback_release(output);
+
+	used_crtcs &= ~(1u << output->pipe);
+	used_planes.erase(std::remove_if(used_planes.begin(), used_planes.end(),
+			[output](uint32_t plane_id) { return find_plane(output, plane_id) != NULL; }),
+			used_planes.end());
+	fbs.pin(uint32_t(display_id), {});
+
+	{
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		output->commit.flip_pending = false;
+		/* the pending flip has no CRTC to come from any more */
+		signal_frames(output);
+		output->commit.cursor_moved = false;
+		/* the client sets the color up again for the next sink */
+		output->commit.ctm_enabled = output->commit.ctm_changed = false;
+		output->commit.dim = 0;
+		output->commit.gamma_blob = 0;
+		output->commit.gamma_changed = output->commit.color_flush = false;
+		for (const auto &entry : output->gamma_blobs)
+			drmModeDestroyPropertyBlob(kms_fd, entry.second);
+		output->gamma_blobs.clear();
+		/* another sink may take longer */
+		std::fill(std::begin(output->commit.latency_samples),
+				std::end(output->commit.latency_samples), 0);
+		if (output->commit.done_fence >= 0)
+			close(output->commit.done_fence);
+		output->commit.done_fence = -1;
+		if (output->writeback)
+			output->writeback->crtc_id = 0;
+		/* the one of a virtual display is its connector */
+		if (!output->is_virtual)
+			output->writeback = NULL;
 	}
-	return NULL;
+	{
+		std::lock_guard<std::mutex> lock(vsync_mutex);
+		output->vsync.queued = false;
+		output->vsync.predicted = false;
+		output->vsync.parked = false;
+		output->vsync.last_ns = 0;
+	}
+
+	/* the next sink starts out on */
+	output->active = 1;
+	output->crtc_id = 0;
+	output->primary_plane = {};
+	output->overlay_planes.clear();
+	output->cursor_plane = {};
+	output->plane_test_cache.clear();
+	output->modes.clear();
+	output->connector_modes.clear();
+	output->client_fb_id = 0;
+	output->modeset = true;
 }
 
-drmModeConnectorPtr hwc_context::fetch_connector2(uint32_t type)
+/*
+ * Probe the connector of a display again. A display that got connected is
+ * set up, one that got disconnected gives back its CRTC, and one that lists
+ * other modes than before, i.e. another monitor, is set up anew. A forced
+ * display stays until a sink gets connected.
+ */
+bool hwc_context::reprobe(hwc2_display_t display_id, bool *was_connected, bool *connected)
 {
-	int i;
+	struct kms_output *output = get_output(display_id);
+	if (!output || output->is_virtual || !resources)
+		return false;
+
+	*was_connected = *connected = output->crtc_id != 0;
+	drmModeConnectorPtr connector = drmModeGetConnector(kms_fd, output->connector_id);
+	bool now = connector && connector->connection == DRM_MODE_CONNECTED &&
+		connector->count_modes > 0;
+	bool same = now && *was_connected &&
+		output->connector_modes.size() == size_t(connector->count_modes) &&
+		std::equal(output->connector_modes.begin(), output->connector_modes.end(),
+				connector->modes, [](const drmModeModeInfo &a, const drmModeModeInfo &b) {
+			return memcmp(&a, &b, sizeof(a)) == 0;
+		});
+	if (same || (!now && !*was_connected) || (!now && output->forced)) {
+		drmModeFreeConnector(connector);
+		return false;
+	}
 
-	if (!resources)
-		return NULL;
+	{
+		std::lock_guard<std::mutex> lock(kms_mutex);
+		if (*was_connected)
+			release_output(display_id, output);
+		if (now && init_with_connector(output, connector))
+			ALOGW("no crtc for connector %u", output->connector_id);
+	}
+	drmModeFreeConnector(connector);
+	output->forced = false;
+	output->modeset = true;
+
+	*connected = output->crtc_id != 0;
+	ALOGI("display %" PRIu64 " (%s) %s on crtc %u", display_id, output->name.c_str(),
+			*connected ? "connected" : "disconnected", output->crtc_id);
+	return true;
+}
 
-	for (i = 0; i < resources->count_connectors; i++) {
-		if (i == primary_connector) continue;
-		drmModeConnectorPtr connector =
-			connector = drmModeGetConnector(kms_fd,
-				resources->connectors[i]);
-		if (connector) {
-			if (connector->connector_type == type &&
-				connector->connection == DRM_MODE_CONNECTED)
-				return connector;
-			drmModeFreeConnector(connector);
+/*
+ * Keep a writeback connector with the CRTCs it can read back and the
+ * formats it writes.
+ */
+void hwc_context::add_writeback(drmModeConnectorPtr connector)
+{
+	struct kms_writeback writeback = {};
+	writeback.connector_id = connector->connector_id;
+	kms_connector_props_init(kms_fd, connector->connector_id, &writeback.props);
+	if (!writeback.props.has(CONNECTOR_PROP_WRITEBACK_FB_ID) ||
+			!writeback.props.has(CONNECTOR_PROP_WRITEBACK_OUT_FENCE_PTR))
+		return;
+
+	for (int i = 0; i < connector->count_encoders; i++) {
+		drmModeEncoderPtr encoder = drmModeGetEncoder(kms_fd, connector->encoders[i]);
+		if (encoder) {
+			writeback.possible_crtcs |= encoder->possible_crtcs;
+			drmModeFreeEncoder(encoder);
 		}
 	}
-	return NULL;
+
+	drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(kms_fd,
+			uint32_t(writeback.props.value(CONNECTOR_PROP_WRITEBACK_PIXEL_FORMATS)));
+	if (blob) {
+		const uint32_t *formats = static_cast<const uint32_t *>(blob->data);
+		writeback.formats.assign(formats, formats + blob->length / sizeof(uint32_t));
+		drmModeFreePropertyBlob(blob);
+	}
+
+	ALOGI("writeback connector %u, crtcs 0x%x, %zu formats", writeback.connector_id,
+			writeback.possible_crtcs, writeback.formats.size());
+	writebacks.push_back(std::move(writeback));
+}
+
+/*
+ * Make the slot of a virtual display that composes through a writeback
+ * connector. It gets a CRTC when the client creates the display.
+ */
+void hwc_context::add_virtual_output(struct kms_writeback *writeback)
+{
+	auto output = std::make_unique<struct kms_output>();
+	hwc2_display_t display_id = outputs.size();
+	output->name = "Virtual-" + std::to_string(writeback->connector_id);
+	output->connector_id = writeback->connector_id;
+	output->connector_props = writeback->props;
+	output->writeback = writeback;
+	output->is_virtual = true;
+	output->active = 1;
+	output->modeset = true;
+	output->event_data = { this, display_id };
+	output->commit.client_fence = -1;
+	output->commit.done_fence = -1;
+	output->commit.readback_fence = -1;
+	output->commit.timeline = output->commit.readback_timeline = -1;
+	output->commit.readback_release_fence = output->readback_release_fence = -1;
+	ALOGI("display %" PRIu64 " is %s", display_id, output->name.c_str());
+	outputs.push_back(std::move(output));
+}
+
+/* any timing does for memory, the blanking is that of CVT reduced blanking */
+static void virtual_mode(uint32_t width, uint32_t height, drmModeModeInfo *mode)
+{
+	memset(mode, 0, sizeof(*mode));
+	mode->hdisplay = width;
+	mode->hsync_start = width + 48;
+	mode->hsync_end = width + 80;
+	mode->htotal = width + 160;
+	mode->vdisplay = height;
+	mode->vsync_start = height + 3;
+	mode->vsync_end = height + 8;
+	mode->vtotal = height + 30;
+	mode->vrefresh = 60;
+	mode->clock = uint32_t(uint64_t(mode->htotal) * mode->vtotal * 60 / 1000);
+	mode->flags = DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_NVSYNC;
+	mode->type = DRM_MODE_TYPE_USERDEF;
+	snprintf(mode->name, sizeof(mode->name), "%ux%u", width, height);
+}
+
+/*
+ * Set up a virtual display of the given size on a CRTC its writeback
+ * connector can read back. Returns -EBUSY while no such CRTC is free, or
+ * the writeback connector reads back another display.
+ */
+int hwc_context::create_virtual(hwc2_display_t display_id, uint32_t width, uint32_t height)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output || !output->is_virtual || output->crtc_id || !width || !height ||
+			width > UINT16_MAX || height > UINT16_MAX)
+		return -EINVAL;
+
+	std::lock_guard<std::mutex> lock(kms_mutex);
+	struct kms_writeback *writeback = output->writeback;
+	{
+		std::lock_guard<std::mutex> commit_lock(commit_mutex);
+		if (writeback->crtc_id)
+			return -EBUSY;
+	}
+	if (claim_crtc(output, writeback->possible_crtcs))
+		return -EBUSY;
+	{
+		std::lock_guard<std::mutex> commit_lock(commit_mutex);
+		writeback->crtc_id = output->crtc_id;
+	}
+
+	drmModeModeInfo mode;
+	virtual_mode(width, height, &mode);
+	output->mode = mode;
+	output->modes.assign(1, mode);
+	output->config = 0;
+	output->drm_format = DRM_FORMAT_ABGR8888;
+	output->xdpi = output->ydpi = 75;
+	output->modeset = true;
+	{
+		std::lock_guard<std::mutex> vsync_lock(vsync_mutex);
+		output->vsync.period_ns = mode_period_ns(&mode);
+	}
+	ALOGI("%s set up %ux%u on crtc %u", output->name.c_str(), width, height, output->crtc_id);
+	return 0;
+}
+
+void hwc_context::destroy_virtual(hwc2_display_t display_id)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output || !output->is_virtual || !output->crtc_id)
+		return;
+
+	std::lock_guard<std::mutex> lock(kms_mutex);
+	release_output(display_id, output);
 }
 
 /*
@@ -524,8 +2265,6 @@ drmModeConnectorPtr hwc_context::fetch_connector2(uint32_t type)
  */
 int hwc_context::init_kms()
 {
-	drmModeConnectorPtr primary;
-	drmModeConnectorPtr secondary;
 	int i;
 
 	int ret = drmSetClientCap(kms_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
@@ -540,6 +2279,16 @@ int hwc_context::init_kms()
 		return ret;
 	}
 
+	if (drmSetClientCap(kms_fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1))
+		ALOGI("no writeback connectors");
+
+	/* without the caps the cursor planes are assumed to take 64x64 */
+	uint64_t cap;
+	if (!drmGetCap(kms_fd, DRM_CAP_CURSOR_WIDTH, &cap) && cap)
+		cursor_width = cap;
+	if (!drmGetCap(kms_fd, DRM_CAP_CURSOR_HEIGHT, &cap) && cap)
+		cursor_height = cap;
+
 	resources = drmModeGetResources(kms_fd);
 	if (!resources) {
 		ALOGE("failed to get modeset resources");
@@ -552,86 +2301,92 @@ int hwc_context::init_kms()
 		return -EINVAL;
 	}
 
-	/* find the crtc/connector/mode to use */
-	primary = fetch_connector(DRM_MODE_CONNECTOR_HDMIA);
-	if (primary) {
-		init_with_connector(&primary_output, primary);
-		drmModeFreeConnector(primary);
-		primary_output.active = 1;
-		secondary = fetch_connector2(DRM_MODE_CONNECTOR_HDMIA);
-		if (secondary) {
-			init_with_connector(&secondary_output, secondary);
-			drmModeFreeConnector(secondary);
-			secondary_output.active = 1;
+	/* every connector is a display, connected ones first, HDMI ones first */
+	std::vector<drmModeConnectorPtr> connectors;
+	int lastValidConnectorIndex = -1;
+	for (i = 0; i < resources->count_connectors; i++) {
+		drmModeConnectorPtr connector = drmModeGetConnector(kms_fd,
+				resources->connectors[i]);
+		if (!connector)
+			continue;
+		lastValidConnectorIndex = i;
+		if (connector->connector_type == DRM_MODE_CONNECTOR_WRITEBACK) {
+			add_writeback(connector);
+			drmModeFreeConnector(connector);
+		} else {
+			connectors.push_back(connector);
 		}
 	}
+	std::stable_partition(connectors.begin(), connectors.end(), [](drmModeConnectorPtr c) {
+		return c->connector_type == DRM_MODE_CONNECTOR_HDMIA;
+	});
+	std::stable_partition(connectors.begin(), connectors.end(), [](drmModeConnectorPtr c) {
+		return c->connection == DRM_MODE_CONNECTED;
+	});
+	bool connected = false;
+	for (auto connector : connectors) {
+		connected |= add_output(connector) == 0 &&
+			connector->connection == DRM_MODE_CONNECTED;
+		drmModeFreeConnector(connector);
+	}
 
-	/* if still no connector, find first connected connector and try it */
-	int lastValidConnectorIndex = -1;
-	if (!primary_output.active) {
-
-		for (i = 0; i < resources->count_connectors; i++) {
-			drmModeConnectorPtr connector;
-
-			connector = drmModeGetConnector(kms_fd,
-					resources->connectors[i]);
-			if (connector) {
-				lastValidConnectorIndex = i;
-				if (connector->connection == DRM_MODE_CONNECTED) {
-					if (!init_with_connector(
-							&primary_output, connector))
-						break;
+	/* if no connected connector found, try to enforce the use of the last valid one */
+	if (!connected) {
+		if (lastValidConnectorIndex > -1) {
+			ALOGD("no connected connector found, enforcing the use of valid connector %d", lastValidConnectorIndex);
+			drmModeConnectorPtr connector = drmModeGetConnector(kms_fd, resources->connectors[lastValidConnectorIndex]);
+			for (auto &output : outputs) {
+				if (connector && output->connector_id == connector->connector_id) {
+					connected = init_with_connector(output.get(), connector) == 0;
+					output->forced = connected;
 				}
-
-				drmModeFreeConnector(connector);
 			}
+			drmModeFreeConnector(connector);
 		}
+		if (!connected) {
+			ALOGE("failed to find a valid crtc/connector/mode combination");
+			drmModeFreeResources(resources);
+			resources = NULL;
 
-		/* if no connected connector found, try to enforce the use of the last valid one */
-		if (i == resources->count_connectors) {
-			if (lastValidConnectorIndex > -1) {
-				ALOGD("no connected connector found, enforcing the use of valid connector %d", lastValidConnectorIndex);
-				drmModeConnectorPtr connector = drmModeGetConnector(kms_fd, resources->connectors[lastValidConnectorIndex]);
-				init_with_connector(&primary_output, connector);
-				drmModeFreeConnector(connector);
-			}
-			else {
-				ALOGE("failed to find a valid crtc/connector/mode combination");
-				drmModeFreeResources(resources);
-				resources = NULL;
-
-				return -EINVAL;
-			}
+			return -EINVAL;
 		}
 	}
 
-	first_post = 1;
-	first_post2 = 1;
+	/* a virtual display for each writeback connector, after the others */
+	for (auto &writeback : writebacks)
+		add_virtual_output(&writeback);
+
 	return 0;
 }
 
-hwc_context::hwc_context() {
+/* framebuffers kept around for buffers the client may still present */
+#define FB_CACHE_SIZE 64
+
+hwc_context::hwc_context() : fbs(FB_CACHE_SIZE) {
     char path[PROPERTY_VALUE_MAX];
     property_get("gralloc.drm.kms", path, "/dev/dri/card0");
+    sync_present = property_get_bool("debug.drm.sync_present", false);
 
-    fps = 60.0;
     kms_fd = open(path, O_RDWR|O_CLOEXEC);
+    fbs.init(kms_fd, [this](const private_handle_t *hnd, uint32_t gem_handle,
+                                 uint32_t *fb_id) {
+        return create_fb(hnd, gem_handle, fb_id);
+    });
    	if (kms_fd > 0) {
    		int error = init_kms();
    	    if (error != 0) {
    	        ALOGE("failed hwc_init_kms() %d", error);
    	    } else {
-   	        width = (uint32_t)primary_output.mode.hdisplay;
-   	        height = (uint32_t)primary_output.mode.vdisplay;
-   	        fps = (float)primary_output.mode.vrefresh;
-                format = HAL_PIXEL_FORMAT_RGBA_8888;
-   	        xdpi = (float)primary_output.xdpi;
-   	        ydpi = (float)primary_output.ydpi;
+   	        start_events();
    	    }
     } else {
         ALOGE("hwc_context() failed to open %s", path);
     }
 }
 
+hwc_context::~hwc_context() {
+    stop_events();
+}
+
 } // namespace aidl::android::hardware::graphics::composer3::impl
 
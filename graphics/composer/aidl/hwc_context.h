@@ -19,62 +19,488 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include <hardware/hwcomposer_defs.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
 #include <drm_handle.h>
 
+#ifndef ANDROID_HARDWARE_HWCOMPOSER2_H
+typedef uint64_t hwc2_display_t;
+#endif
+
+#include "fb_cache.h"
+#include "kms_atomic.h"
+
 namespace aidl::android::hardware::graphics::composer3::impl {
 
-struct kms_output
+struct kms_plane
 {
     uint32_t plane_id;
+    uint32_t possible_crtcs;
+    std::vector<uint32_t> formats;
+    /* format and modifier pairs from IN_FORMATS, empty without it */
+    std::vector<std::pair<uint32_t, uint64_t>> modifiers;
+
+    kms_plane_props props;
+};
+
+/*
+ * A layer the composer wants scanned out directly. Layers are passed
+ * bottom-to-top; plane_id is filled in by hwc_context::assign_planes(),
+ * fb_id by hwc_context when the buffer is looked up in the fb cache.
+ */
+struct kms_layer
+{
+    buffer_handle_t handle;
+    hwc_frect_t source_crop;
+    hwc_rect_t display_frame;
+    uint32_t plane_id;
+    uint32_t fb_id;
+    int32_t acquire_fence; /* -1 if none */
+    /*
+     * What changed since the last frame on the plane, in buffer coordinates.
+     * Empty if all of it may have, a single empty rect if nothing did.
+     */
+    std::vector<hwc_rect_t> damage;
+    /* a cursor, it gets the cursor plane if it is the top-most layer and fits */
+    bool cursor;
+};
+
+/*
+ * Vsync of an output. Timestamps come from vblank events of the CRTC; while
+ * there are none, e.g. before the first modeset, they are predicted from the
+ * last vblank and the frame period of the mode.
+ */
+struct kms_vsync
+{
+    bool enabled;
+    bool queued;    /* a vblank event is pending */
+    bool predicted; /* no vblank events, timestamps are predicted */
+    bool parked;    /* the CRTC is off, no vsync until it is back on */
+    int64_t last_ns;
+    int64_t period_ns;
+};
+
+/* commit to flip times kept to tell the latency of a commit */
+#define COMMIT_LATENCY_SAMPLES 32
+
+/*
+ * Commits of an output. Frames reach the event thread through a mailbox
+ * that holds the latest one, which gets submitted as soon as the page flip
+ * of the previous commit completed, or when it is due for the vblank it is
+ * expected at. Their present fences are points of a sw_sync timeline at the
+ * number of the frame, the timeline advances to a frame once it flipped,
+ * which signals those of the frames it replaced in the mailbox too.
+ */
+struct kms_commit
+{
+    bool flip_pending;
+    bool has_frame;
+    uint32_t client_fb_id;
+    int32_t client_fence;
+    std::vector<hwc_rect_t> client_damage;
+    std::vector<kms_layer> layers; /* the mailbox owns the acquire fences */
+    /* fences of the mailbox frame that the kernel can't wait for */
+    int fences_pending;
+    /* numbers of the last frame posted and the last one taken from the mailbox */
+    uint64_t posted;
+    uint64_t done;
+    int64_t posted_ns; /* when the last frame was posted */
+    /*
+     * result and out-fence of the last commit, without a timeline the
+     * present waits for them, for two frame periods at most
+     */
+    int done_ret;
+    int32_t done_fence;
+    /* the present fence timeline, -1 without sw_sync, and the frame it is at */
+    int timeline;
+    uint64_t signaled;
+    uint64_t flip_seq; /* the frame of the pending flip, 0 if not a frame */
+    /* likewise for readbacks, a frame is signaled once it is written back */
+    int readback_timeline;
+    uint64_t readback_signaled;
+
+    uint64_t frames;
+    uint64_t dropped;  /* replaced in the mailbox by a newer frame */
+    uint64_t deferred; /* posted while a flip was pending */
+    uint64_t failed;
+    uint64_t merged;   /* committed together with frames of other outputs */
+
+    /* vblank the mailbox frame is expected at, 0 for as soon as possible */
+    int64_t expected_ns;
+    bool schedule_held; /* the mailbox frame waited for its commit deadline */
+    /* the pending flip of a frame: when it was committed, 0 if not a frame */
+    int64_t flip_commit_ns;
+    int64_t flip_expected_ns;
+    bool flip_scheduled;
+    /* commit to flip times of frames committed once ready, 0 if none */
+    int64_t latency_samples[COMMIT_LATENCY_SAMPLES];
+    unsigned latency_index;
+    uint64_t scheduled; /* held back until the commit deadline of their vblank */
+    uint64_t missed;    /* flipped after the vblank they were expected at */
+    uint64_t early;     /* flipped before it */
+
+    /* HDMI content type, goes out with the next commit if changed */
+    uint32_t content_type;
+    bool content_type_changed;
+
+    /* color transform of the CRTC, goes out with the next commit if changed */
+    struct drm_color_ctm ctm;
+    bool ctm_enabled;
+    bool ctm_changed;
+    /* brightness as steps below full and its GAMMA_LUT, likewise */
+    int dim;
+    uint32_t gamma_blob;
+    bool gamma_changed;
+    /* the color changes go out without waiting for a frame */
+    bool color_flush;
+
+    /*
+     * writeback buffer of the mailbox frame, and the fence of the last
+     * readback, a point of readback_timeline for frames of the mailbox
+     */
+    uint32_t readback_fb_id;
+    int32_t readback_fence;
+    /* the buffer is free to be written once this signals, the frame waits for it */
+    int32_t readback_release_fence;
+
+    /* a commit failed, the planes don't show what the next frame's damage is against */
+    bool full_damage;
+
+    /* where the cursor moved since the last commit, see set_cursor_position() */
+    bool cursor_moved;
+    uint32_t cursor_plane_id;
+    int32_t cursor_x, cursor_y;
+    uint64_t cursor_moves;
+};
+
+/* a frame of one output on its way into an atomic commit */
+struct kms_frame
+{
+    hwc2_display_t display_id;
+    struct kms_output *output;
+    uint32_t client_fb_id;
+    int32_t client_fence;
+    std::vector<kms_layer> layers;
+    uint64_t seq;
+    int32_t out_fence;
+    int ret;
+    bool set_content_type;
+    uint32_t content_type;
+    uint32_t readback_fb_id;
+    int32_t readback_fence;
+    std::vector<hwc_rect_t> client_damage;
+    bool set_ctm;
+    bool ctm_enabled;
+    struct drm_color_ctm ctm;
+    bool set_gamma;
+    uint32_t gamma_blob;
+    int64_t expected_ns;
+    bool scheduled;
+};
+
+/*
+ * A writeback connector. It is attached to the CRTC of the first output
+ * that reads back its composition, and stays there while the CRTC is on.
+ */
+struct kms_writeback
+{
+    uint32_t connector_id;
+    uint32_t possible_crtcs;
+    std::vector<uint32_t> formats;
+    kms_connector_props props;
+    uint32_t crtc_id;
+};
+
+/* user data of the DRM events of an output */
+struct kms_event_data
+{
+    class hwc_context *ctx;
+    hwc2_display_t display_id;
+};
+
+struct kms_output
+{
+    std::string name;
+    struct kms_plane primary_plane;
+    std::vector<struct kms_plane> overlay_planes;
+    struct kms_plane cursor_plane; /* plane_id 0 if the CRTC has none */
     uint32_t crtc_id;
     uint32_t connector_id;
     uint32_t pipe;
     drmModeModeInfo mode;
+    /* the configs of the display, config is the one of the next modeset */
+    std::vector<drmModeModeInfo> modes;
+    uint32_t config;
+    uint32_t mm_width, mm_height;
+    /* the modes as probed, to tell another monitor on the connector apart */
+    std::vector<drmModeModeInfo> connector_modes;
     int xdpi, ydpi;
     uint32_t drm_format;
     int bpp;
-    uint32_t active;
+    uint32_t active; /* 0 while switched off by set_power() */
+    bool modeset; /* the next frame sets the mode */
+    bool forced;  /* set up without a sink connected */
+    /* a virtual display, its connector is a writeback connector */
+    bool is_virtual;
 
-    uint32_t prop_fb_id;
-    uint32_t prop_crtc_id;
-    uint32_t prop_out_fence;
+    kms_crtc_props crtc_props;
+    kms_connector_props connector_props;
+    uint32_t client_fb_id;
+    /* written back by the next frame, through the writeback connector of the output */
+    uint32_t readback_fb_id;
+    int32_t readback_release_fence;
+    struct kms_writeback *writeback;
+    /* vblank the next frame is expected at, see set_expected_present() */
+    int64_t expected_present_ns;
+
+    /* GAMMA_LUT blobs by brightness step, the most recently used last */
+    std::vector<std::pair<int, uint32_t>> gamma_blobs;
+
+    /* assign_planes() results, keyed by hash of the layer configuration */
+    std::unordered_map<size_t, size_t> plane_test_cache;
+    kms_atomic_req test_req;
+
+    struct kms_vsync vsync;
+    struct kms_commit commit;
+    struct kms_event_data event_data;
 };
 
-#ifndef ANDROID_HARDWARE_HWCOMPOSER2_H
-typedef uint64_t hwc2_display_t;
-#endif
+/* what the composer reports about a display and each of its configs */
+struct kms_config_info
+{
+    uint32_t width;
+    uint32_t height;
+    int64_t vsync_period_ns;
+    float xdpi;
+    float ydpi;
+    /* configs of a group only differ in their refresh rate */
+    uint32_t group;
+};
 
+struct kms_display_info
+{
+    std::string name;
+    std::vector<struct kms_config_info> configs;
+    uint32_t active_config;
+    bool content_types; /* the sink can be told the content type */
+    bool connected;
+    bool is_virtual;
+    uint32_t cursor_plane_id; /* 0 if there is none */
+    bool brightness; /* the CRTC can dim through its GAMMA_LUT */
+};
+
+/*
+ * Every connector but writeback ones is a display, numbered from 0: the
+ * connected ones first, HDMI before the others, then the disconnected ones.
+ * Only connected displays have a CRTC, planes and configs; hotplug events
+ * connect and disconnect displays, the numbers stay. After them come the
+ * virtual displays, one for each writeback connector, which are connected
+ * while the client has created them.
+ */
 class hwc_context {
   public :
     hwc_context();
-    int hwc_post(hwc2_display_t display_id, buffer_handle_t handle, int32_t *out_fence);
-    bool is_display2_active();
+    ~hwc_context();
+    /*
+     * The acquire fences stay owned by the caller. client_damage is what
+     * changed in the client target, like the damage of a kms_layer.
+     */
+    int hwc_post(hwc2_display_t display_id, buffer_handle_t handle, int32_t acquire_fence,
+                 const std::vector<hwc_rect_t> &client_damage,
+                 std::vector<kms_layer> &layers, int32_t *out_fence);
+    size_t assign_planes(hwc2_display_t display_id, std::vector<kms_layer> &layers,
+                         bool client_target);
+    size_t num_displays() const { return outputs.size(); }
+    int get_display_info(hwc2_display_t display_id, struct kms_display_info *info);
+    /* switch to another config with the next frame */
+    int set_config(hwc2_display_t display_id, uint32_t config);
+    /* whether the driver can switch to a config without a full modeset */
+    bool config_is_seamless(hwc2_display_t display_id, uint32_t config);
+    /*
+     * Switch to a config of the size of the current mode right away, with
+     * the planes showing what they do, e.g. to drop the refresh rate of a
+     * display that went idle. A commit of the mode alone without
+     * ALLOW_MODESET, which fails rather than blank the screen, and with
+     * -EBUSY while a flip is pending.
+     */
+    int switch_config(hwc2_display_t display_id, uint32_t config);
+    /*
+     * Switch the CRTC of a display off or back on. Off, its planes are
+     * disabled and their framebuffers unpinned, vsync is parked and frames
+     * are dropped. The mode stays cached, the first frame after switching
+     * on sets it in the same commit.
+     */
+    int set_power(hwc2_display_t display_id, bool on);
+    /* DRM "content type" value, sent to the sink with the next frame */
+    int set_content_type(hwc2_display_t display_id, uint32_t content_type);
+    /*
+     * Color transform of the CRTC from the next frame on, a row-major 4x4
+     * matrix as composer clients pass it, NULL for none. Fails if the CRTC
+     * can't apply it.
+     */
+    int set_color_transform(hwc2_display_t display_id, const float *matrix);
+    /*
+     * Brightness of the CRTC from the next frame on, from 0 to 1 or -1 for
+     * off, dimming the image through its GAMMA_LUT for sinks without a
+     * backlight to dim. flush_color() commits it without a frame.
+     */
+    int set_brightness(hwc2_display_t display_id, float brightness);
+    void flush_color(hwc2_display_t display_id);
+    void release_buffer(buffer_handle_t buffer);
+    /*
+     * Reading back the composition through a writeback connector. The next
+     * frame is written into the buffer, the fence of the last frame written
+     * is handed out once.
+     */
+    int get_readback_format(hwc2_display_t display_id, int32_t *format);
+    int set_readback_buffer(hwc2_display_t display_id, buffer_handle_t buffer,
+                            int32_t release_fence);
+    int get_readback_fence(hwc2_display_t display_id, int32_t *fence);
+    /*
+     * Virtual displays compose like the others, the output buffer is their
+     * readback buffer and its fence their present fence.
+     */
+    int create_virtual(hwc2_display_t display_id, uint32_t width, uint32_t height);
+    void destroy_virtual(hwc2_display_t display_id);
+    /*
+     * Move the plane showing the cursor without a frame: the event thread
+     * commits the position alone once the last page flip is done, or the
+     * next frame takes it along.
+     */
+    int set_cursor_position(hwc2_display_t display_id, uint32_t plane_id, int32_t x, int32_t y);
+    /*
+     * The vblank the next frame is expected at, 0 for as soon as possible.
+     * The event thread holds the frame back until the latest commit still
+     * makes that vblank, so that it doesn't flip a vblank early.
+     */
+    void set_expected_present(hwc2_display_t display_id, int64_t timestamp);
 
-    uint32_t  width;
-    uint32_t  height;
-    int       format;
-    float     fps;
-    float     xdpi;
-    float     ydpi;
+    /* called from the event thread, without locks held */
+    using vsync_callback = std::function<void(hwc2_display_t display_id, int64_t timestamp,
+                                              int64_t period)>;
+    void set_vsync_callback(vsync_callback callback);
+    /*
+     * Called from the event thread, without locks held, for the displays
+     * whose connector a hotplug event may have changed. The receiver must
+     * not block the event thread, presents may wait for it; it calls
+     * reprobe() from a thread of its own, while nothing else uses the display.
+     */
+    using hotplug_callback = std::function<void(hwc2_display_t display_id)>;
+    void set_hotplug_callback(hotplug_callback callback);
+    /* returns whether the display changed, and if it was and is connected */
+    bool reprobe(hwc2_display_t display_id, bool *was_connected, bool *connected);
+    void set_vsync_enabled(hwc2_display_t display_id, bool enabled);
+    std::string dump();
 
   private:
     int init_kms();
-    drmModeConnectorPtr fetch_connector(uint32_t type);
-    drmModeConnectorPtr fetch_connector2(uint32_t type);
+    int add_output(drmModeConnectorPtr connector);
+    void add_writeback(drmModeConnectorPtr connector);
+    void add_virtual_output(struct kms_writeback *writeback);
+    int claim_crtc(struct kms_output *output, uint32_t possible_crtcs);
+    void release_output(hwc2_display_t display_id, struct kms_output *output);
     int init_with_connector(struct kms_output *output,
     		drmModeConnectorPtr connector);
+    int init_plane(struct kms_plane *plane, drmModePlanePtr p);
+    struct kms_output *get_output(hwc2_display_t display_id);
+    bool layer_supported(const struct kms_output *output, const kms_layer &layer);
+    bool cursor_fits(const struct kms_output *output, const kms_layer &layer);
+    bool map_planes(struct kms_output *output, std::vector<kms_layer> &layers,
+                    size_t first, bool client_target);
+    void set_planes(kms_atomic_req &req, struct kms_output *output, uint32_t client_fb_id,
+                    int32_t client_fence, const std::vector<hwc_rect_t> &client_damage,
+                    const std::vector<kms_layer> &layers,
+                    std::vector<uint32_t> *damage_blobs = NULL);
+    uint32_t damage_blob(const struct kms_plane *plane, const std::vector<hwc_rect_t> &damage,
+                         std::vector<uint32_t> *blobs);
+    void destroy_blobs(std::vector<uint32_t> &blobs);
+    struct kms_writeback *find_writeback(const struct kms_output *output);
+    void set_writeback(kms_atomic_req &req, struct kms_output *output, uint32_t fb_id,
+                       int32_t *fence);
 
-    int add_fb(const private_handle_t *hnd);
-    int first_post, first_post2;
-    int atomic_commit(hwc2_display_t display_id, struct kms_output *output,
-		      const private_handle_t *hnd, int32_t *out_fence);
+    int create_fb(const private_handle_t *hnd, uint32_t gem_handle, uint32_t *fb_id);
+    int add_fb(const private_handle_t *hnd, uint32_t *fb_id);
+    void pin_fbs(hwc2_display_t display_id, const struct kms_output *output,
+                 const std::vector<kms_layer> &layers, uint32_t readback_fb_id = 0);
+    int atomic_commit(struct kms_frame *frames, size_t count);
+    void set_ctm(kms_atomic_req &req, struct kms_output *output, bool enabled,
+                 const struct drm_color_ctm &ctm, std::vector<uint32_t> *blobs);
+    uint32_t gamma_blob(struct kms_output *output, int dim);
+    void take_color_changes(struct kms_frame *frame);
+    void keep_color_changes(const struct kms_frame *frame);
+    int commit_cursor(struct kms_output *output, uint32_t plane_id, int32_t x, int32_t y);
+    int atomic_modeset(hwc2_display_t display_id, struct kms_output *output,
+                       uint32_t client_fb_id, int32_t client_fence,
+                       const std::vector<kms_layer> &layers, int32_t *out_fence);
 
     int kms_fd;
     drmModeResPtr resources;
     drmModePlaneResPtr plane_resources;
-    int primary_connector;
-    struct kms_output primary_output;
-    struct kms_output secondary_output;
+    std::vector<std::unique_ptr<struct kms_output>> outputs;
+    /* guards used_crtcs and used_planes once the event thread runs */
+    std::mutex kms_mutex;
+    uint32_t used_crtcs = 0;
+    std::vector<uint32_t> used_planes;
+    /* largest cursor the cursor planes take */
+    uint64_t cursor_width = 64;
+    uint64_t cursor_height = 64;
+    /* not displays, but kept for reading back the composition */
+    std::vector<struct kms_writeback> writebacks;
+    fb_cache fbs;
+
+    /* DRM event thread, see hwc_events.cpp */
+    void start_events();
+    void stop_events();
+    void wake_events();
+    void event_loop();
+    int64_t arm_vsync();
+    void predict_vsync();
+    void on_vblank(hwc2_display_t display_id, int64_t timestamp);
+    static void sequence_handler(int fd, uint64_t sequence, uint64_t ns, uint64_t user_data);
+    int queue_frame(hwc2_display_t display_id, struct kms_output *output,
+                    uint32_t client_fb_id, int32_t client_fence,
+                    const std::vector<hwc_rect_t> &client_damage,
+                    const std::vector<kms_layer> &layers, int32_t *out_fence);
+    void discard_frame(struct kms_output *output);
+    void wait_readback_release(struct kms_output *output);
+    void signal_frames(struct kms_output *output);
+    void on_readback(hwc2_display_t display_id, uint64_t seq);
+    int64_t submit_frames();
+    int64_t commit_latency(const struct kms_output *output);
+    void on_flip(uint32_t crtc_id, int64_t timestamp);
+    void on_fence(hwc2_display_t display_id, uint64_t seq);
+    bool kernel_waits(const struct kms_output *output, uint32_t plane_id);
+    static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+                                  unsigned int tv_usec, unsigned int crtc_id, void *user_data);
+    void handle_uevent();
+
+    std::thread event_thread;
+    std::atomic<bool> events_running{false};
+    int event_fd = -1;
+    int timer_fd = -1;
+    int uevent_fd = -1;
+    /* guards the callbacks too */
+    std::mutex vsync_mutex;
+    vsync_callback vsync_cb;
+    hotplug_callback hotplug_cb;
+    std::mutex commit_mutex;
+    std::condition_variable commit_cond;
+    /* frames of all outputs flip together, see submit_frames() */
+    bool sync_present = false;
+
+    /* reused across frames, see kms_atomic_req */
+    kms_atomic_req commit_req;
 };
 
 } // namespace aidl::android::hardware::graphics::composer3::impl
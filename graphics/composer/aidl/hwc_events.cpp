@@ -0,0 +1,924 @@
+/*
+ * Copyright 2026 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * DRM event handling of hwc_context: one thread reads the events of the DRM
+ * fd, turns vblank events into vsync callbacks and submits the atomic
+ * commits, one page flip at a time per CRTC.
+ */
+
+#define LOG_TAG "composer-hwc_events"
+//#define LOG_NDEBUG 0
+#include <utils/Log.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+
+#include <hardware_legacy/uevent.h>
+
+#include <chrono>
+#include <vector>
+
+#include "fence_monitor.h"
+#include "hwc_context.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t frame_period(const struct kms_output *output)
+{
+	return output->vsync.period_ns > 0 ? output->vsync.period_ns : 16666667;
+}
+
+/* commit latency until a frame committed once ready flipped */
+#define DEFAULT_COMMIT_LATENCY_NS 2000000
+/* slack of a commit deadline, for waking up late */
+#define COMMIT_MARGIN_NS 1000000
+/* frames expected further ahead than this many frame periods go right away */
+#define MAX_SCHEDULE_PERIODS 4
+
+/*
+ * Add the damage of a frame dropped from the mailbox to that of the frame
+ * replacing it, all of it if either is.
+ */
+static void merge_damage(std::vector<hwc_rect_t> &damage, const std::vector<hwc_rect_t> &dropped)
+{
+	if (dropped.empty())
+		damage.clear();
+	else if (!damage.empty())
+		damage.insert(damage.end(), dropped.begin(), dropped.end());
+}
+
+/* the sw_sync interface, it has no uapi header */
+struct sw_sync_create_fence_data {
+	uint32_t value;
+	char name[32];
+	int32_t fence;
+};
+#define SW_SYNC_IOC_MAGIC 'W'
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR(SW_SYNC_IOC_MAGIC, 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW(SW_SYNC_IOC_MAGIC, 1, uint32_t)
+
+/* every open of sw_sync is a timeline of its own */
+static int timeline_create()
+{
+	int fd = open("/sys/kernel/debug/sync/sw_sync", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		fd = open("/dev/sw_sync", O_RDWR | O_CLOEXEC);
+	return fd;
+}
+
+/*
+ * A fence that signals once the timeline reached seq. The points are 32 bit,
+ * sw_sync compares them with wraparound.
+ */
+static int32_t timeline_fence(int timeline, uint64_t seq, const char *name)
+{
+	struct sw_sync_create_fence_data data = {};
+	data.value = uint32_t(seq);
+	snprintf(data.name, sizeof(data.name), "%s", name);
+	if (ioctl(timeline, SW_SYNC_IOC_CREATE_FENCE, &data) < 0) {
+		ALOGE("failed to create %s fence (%s)", name, strerror(errno));
+		return -1;
+	}
+	return data.fence;
+}
+
+static void timeline_signal(int timeline, uint64_t *signaled, uint64_t seq)
+{
+	if (timeline < 0 || seq <= *signaled)
+		return;
+	uint32_t count = uint32_t(seq - *signaled);
+	if (ioctl(timeline, SW_SYNC_IOC_INC, &count) < 0)
+		ALOGE("failed to advance timeline (%s)", strerror(errno));
+	*signaled = seq;
+}
+
+/* the color changes of an output go out with a frame, commit_mutex held */
+void hwc_context::take_color_changes(struct kms_frame *frame)
+{
+	struct kms_commit &commit = frame->output->commit;
+	frame->set_ctm = commit.ctm_changed;
+	frame->ctm_enabled = commit.ctm_enabled;
+	frame->ctm = commit.ctm;
+	commit.ctm_changed = false;
+	frame->set_gamma = commit.gamma_changed;
+	frame->gamma_blob = commit.gamma_blob;
+	commit.gamma_changed = false;
+	commit.color_flush = false;
+}
+
+/* the frame didn't make it, its color changes go out with the next one */
+void hwc_context::keep_color_changes(const struct kms_frame *frame)
+{
+	struct kms_commit &commit = frame->output->commit;
+	if (frame->set_ctm)
+		commit.ctm_changed = true;
+	if (frame->set_gamma)
+		commit.gamma_changed = true;
+}
+
+static void close_fences(int32_t *client_fence, std::vector<kms_layer> &layers)
+{
+	if (*client_fence >= 0)
+		close(*client_fence);
+	*client_fence = -1;
+	for (auto &layer : layers) {
+		if (layer.acquire_fence >= 0)
+			close(layer.acquire_fence);
+		layer.acquire_fence = -1;
+	}
+}
+
+void hwc_context::set_vsync_callback(vsync_callback callback)
+{
+	std::lock_guard<std::mutex> lock(vsync_mutex);
+	vsync_cb = callback;
+}
+
+void hwc_context::set_hotplug_callback(hotplug_callback callback)
+{
+	std::lock_guard<std::mutex> lock(vsync_mutex);
+	hotplug_cb = callback;
+}
+
+void hwc_context::set_vsync_enabled(hwc2_display_t display_id, bool enabled)
+{
+	struct kms_output *output = get_output(display_id);
+	if (!output)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(vsync_mutex);
+		output->vsync.enabled = enabled;
+	}
+	wake_events();
+}
+
+void hwc_context::start_events()
+{
+	event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (event_fd < 0 || timer_fd < 0) {
+		ALOGE("failed to create event thread fds (%s)", strerror(errno));
+		return;
+	}
+	/* the uevent socket belongs to libhardware_legacy, it is never closed */
+	uevent_fd = uevent_init() ? uevent_get_fd() : -1;
+	if (uevent_fd < 0)
+		ALOGW("no uevent socket, hotplug goes unnoticed");
+
+	for (hwc2_display_t id = 0; id < outputs.size(); id++) {
+		struct kms_commit &commit = get_output(id)->commit;
+		commit.timeline = timeline_create();
+		commit.readback_timeline = commit.timeline >= 0 ? timeline_create() : -1;
+		if (commit.readback_timeline < 0 && commit.timeline >= 0) {
+			close(commit.timeline);
+			commit.timeline = -1;
+		}
+	}
+	if (!outputs.empty() && outputs[0]->commit.timeline < 0)
+		ALOGW("no sw_sync (%s), presents wait for their commit", strerror(errno));
+
+	events_running = true;
+	event_thread = std::thread(&hwc_context::event_loop, this);
+}
+
+void hwc_context::stop_events()
+{
+	if (events_running) {
+		events_running = false;
+		wake_events();
+		event_thread.join();
+	}
+	for (hwc2_display_t id = 0; id < outputs.size(); id++) {
+		struct kms_output *output = get_output(id);
+		struct kms_commit &commit = output->commit;
+		close_fences(&commit.client_fence, commit.layers);
+		/* no fence handed out may be left unsignaled */
+		{
+			std::lock_guard<std::mutex> lock(commit_mutex);
+			signal_frames(output);
+		}
+		if (commit.timeline >= 0)
+			close(commit.timeline);
+		if (commit.readback_timeline >= 0)
+			close(commit.readback_timeline);
+		commit.timeline = commit.readback_timeline = -1;
+		if (commit.done_fence >= 0)
+			close(commit.done_fence);
+		commit.done_fence = -1;
+		if (commit.readback_fence >= 0)
+			close(commit.readback_fence);
+		commit.readback_fence = -1;
+		if (commit.readback_release_fence >= 0)
+			close(commit.readback_release_fence);
+		commit.readback_release_fence = -1;
+	}
+	if (event_fd >= 0)
+		close(event_fd);
+	if (timer_fd >= 0)
+		close(timer_fd);
+	event_fd = timer_fd = -1;
+}
+
+void hwc_context::wake_events()
+{
+	uint64_t one = 1;
+	if (event_fd >= 0 && write(event_fd, &one, sizeof(one)) < 0)
+		ALOGW("failed to wake event thread (%s)", strerror(errno));
+}
+
+void hwc_context::sequence_handler(int /*fd*/, uint64_t /*sequence*/, uint64_t ns,
+		uint64_t user_data)
+{
+	auto data = reinterpret_cast<struct kms_event_data *>(user_data);
+	data->ctx->on_vblank(data->display_id, int64_t(ns));
+}
+
+void hwc_context::on_vblank(hwc2_display_t display_id, int64_t timestamp)
+{
+	struct kms_output *output = get_output(display_id);
+	vsync_callback callback;
+	int64_t period;
+
+	{
+		std::lock_guard<std::mutex> lock(vsync_mutex);
+		struct kms_vsync &vsync = output->vsync;
+		vsync.queued = false;
+		vsync.predicted = false;
+		vsync.last_ns = timestamp;
+		/* the vblank of a CRTC switched off by a hotplug or set_power() */
+		if (!vsync.enabled || vsync.parked || !output->crtc_id)
+			return;
+		callback = vsync_cb;
+		period = vsync.period_ns;
+	}
+
+	if (callback)
+		callback(display_id, timestamp, period);
+}
+
+void hwc_context::set_expected_present(hwc2_display_t display_id, int64_t timestamp)
+{
+	struct kms_output *output = get_output(display_id);
+	if (output)
+		output->expected_present_ns = timestamp;
+}
+
+/*
+ * Hand a frame to the event thread. Its present fence is a point of the
+ * timeline of the output, so the call returns right away; without sw_sync
+ * it waits up to two frame periods for the frame to be committed and
+ * returns the out-fence of the commit. A readback of the frame gets a fence of the readback timeline
+ * likewise. The mailbox keeps its own copies of the acquire fences, as the
+ * frame may outlive the call. Fences of planes without IN_FENCE_FD hold the
+ * frame back until the fence monitor saw them signal, all others are only
+ * watched to account their wait.
+ */
+int hwc_context::queue_frame(hwc2_display_t display_id, struct kms_output *output,
+		uint32_t client_fb_id, int32_t client_fence,
+		const std::vector<hwc_rect_t> &client_damage,
+		const std::vector<kms_layer> &layers, int32_t *out_fence)
+{
+	std::unique_lock<std::mutex> lock(commit_mutex);
+	struct kms_commit &commit = output->commit;
+
+	std::vector<hwc_rect_t> queued_damage = client_damage;
+	std::vector<kms_layer> queued = layers;
+	if (commit.has_frame) {
+		close_fences(&commit.client_fence, commit.layers);
+		commit.dropped++;
+		/* the planes never showed the dropped frame, its damage adds to this one */
+		if (commit.client_fb_id)
+			merge_damage(queued_damage, commit.client_damage);
+		for (auto &layer : queued) {
+			auto dropped = std::find_if(commit.layers.begin(), commit.layers.end(),
+					[&](const kms_layer &l) { return l.plane_id == layer.plane_id; });
+			if (dropped != commit.layers.end())
+				merge_damage(layer.damage, dropped->damage);
+			else
+				layer.damage.clear();
+		}
+	} else if (commit.flip_pending) {
+		commit.deferred++;
+	}
+	commit.client_fb_id = client_fb_id;
+	commit.client_fence = client_fence >= 0 ? dup(client_fence) : -1;
+	commit.client_damage.swap(queued_damage);
+	commit.layers.swap(queued);
+	for (auto &layer : commit.layers) {
+		if (layer.acquire_fence >= 0)
+			layer.acquire_fence = dup(layer.acquire_fence);
+	}
+	/* a dropped frame passes its readback on */
+	if (output->readback_fb_id) {
+		commit.readback_fb_id = output->readback_fb_id;
+		if (commit.readback_release_fence >= 0)
+			close(commit.readback_release_fence);
+		commit.readback_release_fence = output->readback_release_fence;
+		output->readback_release_fence = -1;
+	}
+	output->readback_fb_id = 0;
+	commit.expected_ns = output->expected_present_ns;
+	commit.schedule_held = false;
+	output->expected_present_ns = 0;
+	commit.has_frame = true;
+	commit.posted_ns = now_ns();
+	uint64_t seq = ++commit.posted;
+	*out_fence = -1;
+	if (commit.timeline >= 0)
+		*out_fence = timeline_fence(commit.timeline, seq, "present");
+	if (*out_fence >= 0 && commit.readback_fb_id) {
+		if (commit.readback_fence >= 0)
+			close(commit.readback_fence);
+		commit.readback_fence = timeline_fence(commit.readback_timeline, seq, "readback");
+	}
+
+	std::vector<std::pair<int, bool>> fences;
+	auto add_fence = [&](int32_t fence, uint32_t plane_id) {
+		if (fence >= 0)
+			fences.emplace_back(dup(fence), !kernel_waits(output, plane_id));
+	};
+	if (client_fb_id)
+		add_fence(commit.client_fence, output->primary_plane.plane_id);
+	for (const auto &layer : commit.layers)
+		add_fence(layer.acquire_fence, layer.plane_id);
+	/* the writeback has no in-fence, the buffer release always holds the frame */
+	if (commit.readback_fb_id && commit.readback_release_fence >= 0)
+		fences.emplace_back(dup(commit.readback_release_fence), true);
+	commit.fences_pending = 0;
+	for (const auto &[fence, gating] : fences)
+		commit.fences_pending += gating;
+
+	/* a continuation may run right away and take the lock */
+	lock.unlock();
+	for (const auto &[fence, gating] : fences) {
+		if (gating)
+			fence_monitor::get().watch(fence, "acquire (user space)",
+					[this, display_id, seq](int64_t) { on_fence(display_id, seq); });
+		else
+			fence_monitor::get().watch(fence, "acquire", nullptr);
+	}
+	wake_events();
+	lock.lock();
+
+	if (*out_fence >= 0)
+		return 0;
+
+	/*
+	 * Calls for a display are serialized, nothing replaces the frame
+	 * meanwhile. A frame that isn't committed in time gets the out-fence
+	 * of the last commit, which signals before it flips, but not before
+	 * the frame before it is on screen.
+	 */
+	auto timeout = std::chrono::nanoseconds(2 * frame_period(output));
+	bool committed = commit_cond.wait_for(lock, timeout, [&] { return commit.done >= seq; });
+	if (!committed)
+		ALOGV("frame %" PRIu64 " of display %" PRIu64 " not committed yet",
+				seq, display_id);
+	*out_fence = commit.done_fence >= 0 ? dup(commit.done_fence) : -1;
+	return committed ? commit.done_ret : 0;
+}
+
+/*
+ * Drop the frame waiting in the mailbox, before a modeset replaces it.
+ */
+void hwc_context::discard_frame(struct kms_output *output)
+{
+	std::lock_guard<std::mutex> lock(commit_mutex);
+	struct kms_commit &commit = output->commit;
+	if (commit.has_frame) {
+		close_fences(&commit.client_fence, commit.layers);
+		commit.has_frame = false;
+		commit.layers.clear();
+		commit.readback_fb_id = 0;
+		if (commit.readback_release_fence >= 0)
+			close(commit.readback_release_fence);
+		commit.readback_release_fence = -1;
+		commit.dropped++;
+		/* the frame the planes show stays on screen, the dropped one never is */
+		timeline_signal(commit.readback_timeline, &commit.readback_signaled, commit.posted);
+		if (!commit.flip_seq)
+			timeline_signal(commit.timeline, &commit.signaled, commit.posted);
+	}
+}
+
+/*
+ * Nothing of an output is going to flip any more, e.g. its CRTC is gone.
+ * Called with commit_mutex held.
+ */
+void hwc_context::signal_frames(struct kms_output *output)
+{
+	struct kms_commit &commit = output->commit;
+	timeline_signal(commit.timeline, &commit.signaled, commit.posted);
+	timeline_signal(commit.readback_timeline, &commit.readback_signaled, commit.posted);
+	commit.flip_seq = 0;
+}
+
+/* the writeback of a frame is done */
+void hwc_context::on_readback(hwc2_display_t display_id, uint64_t seq)
+{
+	std::lock_guard<std::mutex> lock(commit_mutex);
+	struct kms_commit &commit = get_output(display_id)->commit;
+	timeline_signal(commit.readback_timeline, &commit.readback_signaled, seq);
+}
+
+/*
+ * How long before a vblank a commit has to be made to flip at it. A commit
+ * never flips sooner than it can, so the commit to flip time of a frame
+ * committed once ready bounds the latency, and the shortest of the last
+ * ones bounds it tightly once they fell at various phases of the frame.
+ * Never so long that a frame could make the vblank before its own.
+ */
+int64_t hwc_context::commit_latency(const struct kms_output *output)
+{
+	int64_t latency = 0;
+	for (int64_t sample : output->commit.latency_samples) {
+		if (sample > 0 && (!latency || sample < latency))
+			latency = sample;
+	}
+	if (!latency)
+		latency = DEFAULT_COMMIT_LATENCY_NS;
+	return std::min<int64_t>(latency, frame_period(output) - 2 * COMMIT_MARGIN_NS);
+}
+
+/*
+ * Commit the mailbox frames of the outputs whose previous page flip is done,
+ * each in a commit of its own, a frame expected at a later vblank once the
+ * commit deadline of that vblank came. With sync_present they all go into
+ * a single commit instead, so they flip at the same vblank. A ready frame is then
+ * held back for at most half a frame period while another output that
+ * posted during the last two frame periods has no frame ready yet, virtual
+ * displays don't hold back others. Outputs without a frame to commit whose
+ * cursor moved get a commit of the cursor position, those with color
+ * changes to flush one of the CTM and GAMMA_LUT. Runs on
+ * the event thread, which is the only user of commit_req. Returns when the
+ * held frames are due, 0 if there are none.
+ */
+int64_t hwc_context::submit_frames()
+{
+	std::vector<struct kms_frame> frames;
+	std::vector<struct kms_output *> cursors;
+	std::vector<struct kms_frame> colors;
+	int64_t scheduled = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		int64_t now = now_ns();
+		int64_t due = 0;
+		bool waiting = false;
+
+		for (hwc2_display_t id = 0; id < outputs.size(); id++) {
+			struct kms_output *output = get_output(id);
+			struct kms_commit &commit = output->commit;
+			int64_t deadline = commit.expected_ns ?
+				commit.expected_ns - commit_latency(output) - COMMIT_MARGIN_NS : 0;
+			if (deadline - now > MAX_SCHEDULE_PERIODS * frame_period(output))
+				deadline = 0;
+			/* without a timeline the present waits for the commit, holding would stall it */
+			if (commit.timeline < 0)
+				deadline = 0;
+			if (commit.has_frame && !commit.flip_pending && !commit.fences_pending &&
+					now < deadline) {
+				if (!commit.schedule_held)
+					commit.scheduled++;
+				commit.schedule_held = true;
+				if (!scheduled || deadline < scheduled)
+					scheduled = deadline;
+			} else if (commit.has_frame && !commit.flip_pending && !commit.fences_pending) {
+				frames.push_back({ id, output, commit.client_fb_id, -1, {},
+						commit.posted, -1, 0 });
+				int64_t t = commit.posted_ns + frame_period(output) / 2;
+				if (!due || t < due)
+					due = t;
+			} else if (output->crtc_id && !output->is_virtual && output->active &&
+					commit.posted_ns &&
+					now - commit.posted_ns < 2 * frame_period(output)) {
+				waiting = true;
+			}
+		}
+
+		if (sync_present && waiting && !frames.empty() && now < due)
+			return scheduled && scheduled < due ? scheduled : due;
+
+		for (auto &frame : frames) {
+			struct kms_commit &commit = frame.output->commit;
+			frame.client_fence = commit.client_fence;
+			commit.client_fence = -1;
+			frame.client_damage.swap(commit.client_damage);
+			frame.layers.swap(commit.layers);
+			commit.has_frame = false;
+			frame.set_content_type = commit.content_type_changed;
+			frame.content_type = commit.content_type;
+			commit.content_type_changed = false;
+			take_color_changes(&frame);
+			frame.readback_fb_id = commit.readback_fb_id;
+			commit.readback_fb_id = 0;
+			/* it signaled, else the frame would still be held */
+			if (commit.readback_release_fence >= 0)
+				close(commit.readback_release_fence);
+			commit.readback_release_fence = -1;
+			frame.expected_ns = commit.expected_ns;
+			frame.scheduled = commit.schedule_held;
+			/* the frame has the position the cursor moved to */
+			commit.cursor_moved = false;
+		}
+
+		for (hwc2_display_t id = 0; id < outputs.size(); id++) {
+			struct kms_output *output = get_output(id);
+			struct kms_commit &commit = output->commit;
+			if (commit.cursor_moved && !commit.flip_pending && output->active) {
+				commit.cursor_moved = false;
+				commit.flip_pending = true;
+				commit.flip_commit_ns = 0;
+				cursors.push_back(output);
+			}
+		}
+
+		for (hwc2_display_t id = 0; id < outputs.size(); id++) {
+			struct kms_output *output = get_output(id);
+			struct kms_commit &commit = output->commit;
+			if (!commit.color_flush || commit.flip_pending || !output->active)
+				continue;
+			if (commit.ctm_changed || commit.gamma_changed) {
+				colors.push_back({ id, output });
+				take_color_changes(&colors.back());
+				commit.flip_pending = true;
+				commit.flip_commit_ns = 0;
+			}
+			commit.color_flush = false;
+		}
+	}
+
+	for (struct kms_output *output : cursors) {
+		struct kms_commit &commit = output->commit;
+		int ret = commit_cursor(output, commit.cursor_plane_id, commit.cursor_x,
+				commit.cursor_y);
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		if (ret)
+			commit.flip_pending = false;
+		else
+			commit.cursor_moves++;
+	}
+	for (auto &frame : colors) {
+		atomic_commit(&frame, 1);
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		if (frame.ret) {
+			keep_color_changes(&frame);
+			frame.output->commit.flip_pending = false;
+		}
+	}
+	if (frames.empty())
+		return scheduled;
+
+	int64_t committed = now_ns();
+	bool merged = sync_present && frames.size() > 1 &&
+			atomic_commit(frames.data(), frames.size()) == 0;
+	if (!merged) {
+		for (auto &frame : frames)
+			atomic_commit(&frame, 1);
+	}
+
+	std::vector<struct kms_frame *> readbacks;
+	{
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		for (auto &frame : frames) {
+			struct kms_commit &commit = frame.output->commit;
+			bool flip = frame.client_fb_id || !frame.layers.empty();
+			/* the kernel holds its own references of the fences it was given */
+			close_fences(&frame.client_fence, frame.layers);
+			if (frame.ret)
+				commit.failed++;
+			else
+				commit.frames++;
+			/* the content type and CTM go out with the next frame then */
+			if (frame.ret && frame.set_content_type)
+				commit.content_type_changed = true;
+			if (frame.ret || !flip)
+				keep_color_changes(&frame);
+			if (merged)
+				commit.merged++;
+			commit.flip_pending = flip && !frame.ret;
+			if (commit.flip_pending) {
+				commit.flip_commit_ns = committed;
+				commit.flip_expected_ns = frame.expected_ns;
+				commit.flip_scheduled = frame.scheduled;
+				commit.flip_seq = frame.seq;
+			} else {
+				/* a failed frame never shows, don't let anyone wait for it */
+				timeline_signal(commit.timeline, &commit.signaled, frame.seq);
+			}
+			if (commit.done_fence >= 0)
+				close(commit.done_fence);
+			commit.done = frame.seq;
+			commit.done_ret = frame.ret;
+			commit.done_fence = frame.out_fence;
+			if (commit.readback_timeline >= 0 && frame.readback_fb_id) {
+				/* a readback that failed to commit has nothing to wait for */
+				if (frame.readback_fence >= 0)
+					readbacks.push_back(&frame);
+				else
+					timeline_signal(commit.readback_timeline, &commit.readback_signaled,
+							frame.seq);
+			} else if (frame.readback_fb_id && commit.readback_timeline < 0) {
+				if (commit.readback_fence >= 0)
+					close(commit.readback_fence);
+				commit.readback_fence = frame.readback_fence;
+			}
+		}
+	}
+	commit_cond.notify_all();
+	for (const struct kms_frame *frame : readbacks) {
+		hwc2_display_t display_id = frame->display_id;
+		uint64_t seq = frame->seq;
+		fence_monitor::get().watch(frame->readback_fence, "writeback",
+				[this, display_id, seq](int64_t) { on_readback(display_id, seq); });
+	}
+	return scheduled;
+}
+
+void hwc_context::page_flip_handler(int /*fd*/, unsigned int /*sequence*/,
+		unsigned int tv_sec, unsigned int tv_usec, unsigned int crtc_id,
+		void *user_data)
+{
+	auto data = static_cast<struct kms_event_data *>(user_data);
+	data->ctx->on_flip(crtc_id, int64_t(tv_sec) * 1000000000 + int64_t(tv_usec) * 1000);
+}
+
+/*
+ * A commit of several CRTCs sends a flip event for each of them. The flip of
+ * a frame tells how long the commit took to reach the screen, and whether it
+ * did at the vblank it was expected at.
+ */
+void hwc_context::on_flip(uint32_t crtc_id, int64_t timestamp)
+{
+	std::lock_guard<std::mutex> lock(commit_mutex);
+	for (const auto &output : outputs) {
+		struct kms_commit &commit = output->commit;
+		if (output->crtc_id != crtc_id)
+			continue;
+		commit.flip_pending = false;
+		/* frames dropped from the mailbox meanwhile never show either */
+		if (commit.flip_seq)
+			timeline_signal(commit.timeline, &commit.signaled,
+					commit.has_frame ? commit.flip_seq : commit.posted);
+		commit.flip_seq = 0;
+		if (!commit.flip_commit_ns || timestamp <= commit.flip_commit_ns)
+			continue;
+
+		int64_t latency = timestamp - commit.flip_commit_ns;
+		int64_t expected = commit.flip_expected_ns;
+		int64_t period = frame_period(output.get());
+		/* a frame held back for its deadline flips when it was expected, or later */
+		if (!commit.flip_scheduled) {
+			commit.latency_samples[commit.latency_index] = latency;
+			commit.latency_index = (commit.latency_index + 1) % COMMIT_LATENCY_SAMPLES;
+		}
+		if (expected && timestamp > expected + period / 2) {
+			commit.missed++;
+			ALOGV("frame of crtc %u flipped %.1f ms after it was expected", crtc_id,
+					(timestamp - expected) / 1e6);
+			/* the deadline was too late, the latency is longer than it was taken for */
+			if (commit.flip_scheduled) {
+				int64_t longer = expected - commit.flip_commit_ns + COMMIT_MARGIN_NS;
+				for (int64_t &sample : commit.latency_samples)
+					sample = std::max(sample, longer);
+			}
+		} else if (expected && timestamp < expected - period / 2) {
+			commit.early++;
+		}
+		commit.flip_commit_ns = 0;
+	}
+}
+
+void hwc_context::on_fence(hwc2_display_t display_id, uint64_t seq)
+{
+	{
+		std::lock_guard<std::mutex> lock(commit_mutex);
+		struct kms_commit &commit = get_output(display_id)->commit;
+		/* the frame may have been replaced meanwhile */
+		if (!commit.has_frame || commit.posted != seq || !commit.fences_pending)
+			return;
+		if (--commit.fences_pending)
+			return;
+	}
+	wake_events();
+}
+
+std::string hwc_context::dump()
+{
+	std::lock_guard<std::mutex> lock(commit_mutex);
+	std::string out;
+	char line[320];
+
+	if (sync_present)
+		out += "frames of all displays flip together\n";
+	for (hwc2_display_t id = 0; id < outputs.size(); id++) {
+		const struct kms_output *output = get_output(id);
+		const struct kms_commit &commit = output->commit;
+		if (!output->crtc_id)
+			continue;
+		snprintf(line, sizeof(line),
+				"display %" PRIu64 ": crtc %u frames %" PRIu64 " dropped %" PRIu64
+				" deferred %" PRIu64 " failed %" PRIu64 " merged %" PRIu64
+				" cursor moves %" PRIu64 " scheduled %" PRIu64 " missed %" PRIu64
+				" early %" PRIu64 " commit latency %.1f ms%s%s\n",
+				id, output->crtc_id, commit.frames, commit.dropped,
+				commit.deferred, commit.failed, commit.merged, commit.cursor_moves,
+				commit.scheduled, commit.missed, commit.early,
+				commit_latency(output) / 1e6,
+				commit.flip_pending ? " (flip pending)" : "",
+				output->active ? "" : " (off)");
+		out += line;
+	}
+	return out;
+}
+
+/*
+ * Queue a vblank event for every output that wants vsync and has none
+ * pending. Outputs whose CRTC can't deliver one fall back to prediction.
+ * Returns the time of the earliest predicted vsync, 0 if there is none.
+ */
+int64_t hwc_context::arm_vsync()
+{
+	std::lock_guard<std::mutex> lock(vsync_mutex);
+	int64_t next = 0;
+
+	for (hwc2_display_t id = 0; id < outputs.size(); id++) {
+		struct kms_output *output = get_output(id);
+		struct kms_vsync &vsync = output->vsync;
+		if (!output->crtc_id || !vsync.enabled || vsync.parked || vsync.queued)
+			continue;
+
+		int ret = drmCrtcQueueSequence(kms_fd, output->crtc_id,
+				DRM_CRTC_SEQUENCE_RELATIVE | DRM_CRTC_SEQUENCE_NEXT_ON_MISS, 1,
+				NULL, reinterpret_cast<uint64_t>(&output->event_data));
+		if (ret == 0) {
+			vsync.queued = true;
+			continue;
+		}
+
+		if (!vsync.predicted)
+			ALOGV("no vblank events on crtc %u (%s), predicting vsync",
+					output->crtc_id, strerror(errno));
+		vsync.predicted = true;
+		if (!vsync.last_ns)
+			vsync.last_ns = now_ns();
+		int64_t t = vsync.last_ns + vsync.period_ns;
+		if (!next || t < next)
+			next = t;
+	}
+	return next;
+}
+
+/*
+ * Deliver the predicted vsyncs that are due.
+ */
+void hwc_context::predict_vsync()
+{
+	struct due { hwc2_display_t id; int64_t timestamp; int64_t period; };
+	std::vector<due> deliver;
+	vsync_callback callback;
+	int64_t now = now_ns();
+
+	{
+		std::lock_guard<std::mutex> lock(vsync_mutex);
+		for (hwc2_display_t id = 0; id < outputs.size(); id++) {
+			struct kms_vsync &vsync = get_output(id)->vsync;
+			if (!vsync.enabled || vsync.parked || !vsync.predicted ||
+					vsync.period_ns <= 0)
+				continue;
+			int64_t t = vsync.last_ns + vsync.period_ns;
+			if (t > now)
+				continue;
+			/* skip the vsyncs missed meanwhile, keeping the phase */
+			t += (now - t) / vsync.period_ns * vsync.period_ns;
+			vsync.last_ns = t;
+			deliver.push_back({ id, t, vsync.period_ns });
+		}
+		callback = vsync_cb;
+	}
+
+	if (!callback)
+		return;
+	for (const auto &d : deliver)
+		callback(d.id, d.timestamp, d.period);
+}
+
+/*
+ * A DRM hotplug uevent names the connector that changed, older kernels
+ * don't, then every display is probed again.
+ */
+void hwc_context::handle_uevent()
+{
+	char msg[1024];
+	int len = uevent_next_event(msg, sizeof(msg) - 2);
+	if (len <= 0)
+		return;
+	msg[len] = msg[len + 1] = '\0';
+
+	bool drm = false, hotplug = false;
+	uint32_t connector_id = 0;
+	for (const char *s = msg; *s; s += strlen(s) + 1) {
+		if (!strcmp(s, "SUBSYSTEM=drm"))
+			drm = true;
+		else if (!strcmp(s, "HOTPLUG=1"))
+			hotplug = true;
+		else if (!strncmp(s, "CONNECTOR=", 10))
+			connector_id = strtoul(s + 10, NULL, 10);
+	}
+	if (!drm || !hotplug)
+		return;
+
+	hotplug_callback callback;
+	{
+		std::lock_guard<std::mutex> lock(vsync_mutex);
+		callback = hotplug_cb;
+	}
+	if (!callback)
+		return;
+	ALOGI("hotplug event, connector %u", connector_id);
+	for (hwc2_display_t id = 0; id < outputs.size(); id++) {
+		if (!connector_id || get_output(id)->connector_id == connector_id)
+			callback(id);
+	}
+}
+
+void hwc_context::event_loop()
+{
+	prctl(PR_SET_NAME, "hwc_events", 0, 0, 0);
+
+	drmEventContext ctx = {};
+	ctx.version = 4;
+	ctx.page_flip_handler2 = page_flip_handler;
+	ctx.sequence_handler = sequence_handler;
+
+	while (events_running) {
+		int64_t held = submit_frames();
+
+		int64_t next = arm_vsync();
+		if (held && (!next || held < next))
+			next = held;
+		struct itimerspec timer = {};
+		timer.it_value.tv_sec = next / 1000000000;
+		timer.it_value.tv_nsec = next % 1000000000;
+		timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+
+		struct pollfd fds[4] = {
+			{ kms_fd, POLLIN, 0 },
+			{ event_fd, POLLIN, 0 },
+			{ timer_fd, POLLIN, 0 },
+			{ uevent_fd, POLLIN, 0 },
+		};
+		if (poll(fds, 4, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("event thread poll() failed (%s)", strerror(errno));
+			break;
+		}
+
+		uint64_t count;
+		if (fds[1].revents & POLLIN)
+			(void)read(event_fd, &count, sizeof(count));
+		if (fds[0].revents & POLLIN)
+			drmHandleEvent(kms_fd, &ctx);
+		if (fds[2].revents & POLLIN) {
+			(void)read(timer_fd, &count, sizeof(count));
+			predict_vsync();
+		}
+		if (fds[3].revents & POLLIN)
+			handle_uevent();
+	}
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
@@ -33,7 +33,80 @@ std::unique_ptr<IBufferReleaser> ResourceManager::createReleaser(bool isBuffer)
     return std::make_unique<BufferReleaser>(isBuffer);
 }
 
+void ResourceManager::setBufferReleasedCallback(BufferReleased callback) {
+    mBufferReleased = callback;
+}
+
+void ResourceManager::releaseLayerSlot(int64_t display, int64_t layer, uint32_t slot) {
+    if (!mBufferReleased) {
+        return;
+    }
+
+    Display hwcDisplay;
+    Layer hwcLayer;
+    a2h::translate(display, hwcDisplay);
+    a2h::translate(layer, hwcLayer);
+
+    ComposerResources::ReplacedHandle unused(true);
+    const native_handle_t* handle = nullptr;
+    Error hwcErr = mResources->getLayerBuffer(hwcDisplay, hwcLayer, slot, /*fromCache*/ true,
+                                              nullptr, &handle, &unused);
+    if (hwcErr == Error::NONE && handle) {
+        mBufferReleased(handle);
+    }
+}
+
+void ResourceManager::releaseClientTargetSlot(int64_t display, uint32_t slot) {
+    if (!mBufferReleased) {
+        return;
+    }
+
+    Display hwcDisplay;
+    a2h::translate(display, hwcDisplay);
+
+    ComposerResources::ReplacedHandle unused(true);
+    const native_handle_t* handle = nullptr;
+    Error hwcErr = mResources->getDisplayClientTarget(hwcDisplay, slot, /*fromCache*/ true,
+                                                      nullptr, &handle, &unused);
+    if (hwcErr == Error::NONE && handle) {
+        mBufferReleased(handle);
+    }
+}
+
+void ResourceManager::releaseDisplaySlots(int64_t display) {
+    std::vector<std::pair<int64_t, uint32_t>> layers;
+    {
+        std::lock_guard<std::mutex> lock(mSlotMutex);
+        auto it = mLayerSlots.lower_bound({display, std::numeric_limits<int64_t>::min()});
+        while (it != mLayerSlots.end() && it->first.first == display) {
+            layers.emplace_back(it->first.second, it->second);
+            it = mLayerSlots.erase(it);
+        }
+    }
+    for (const auto& [layer, slots] : layers) {
+        for (uint32_t slot = 0; slot < slots; slot++) {
+            releaseLayerSlot(display, layer, slot);
+        }
+    }
+
+    size_t clientTargetSlots = 0;
+    if (getDisplayClientTargetCacheSize(display, &clientTargetSlots) == 0) {
+        for (uint32_t slot = 0; slot < clientTargetSlots; slot++) {
+            releaseClientTargetSlot(display, slot);
+        }
+    }
+}
+
 void ResourceManager::clear(RemoveDisplay removeDisplay) {
+    std::set<int64_t> displays;
+    {
+        std::lock_guard<std::mutex> lock(mSlotMutex);
+        displays.swap(mDisplays);
+    }
+    for (auto display : displays) {
+        releaseDisplaySlots(display);
+    }
+
     mResources->clear([removeDisplay](Display hwcDisplay, bool isVirtual,
                                       const std::vector<Layer> hwcLayers) {
         int64_t display;
@@ -60,6 +133,10 @@ int32_t ResourceManager::addPhysicalDisplay(int64_t display) {
 
     int32_t err;
     h2a::translate(hwcErr, err);
+    if (err == 0) {
+        std::lock_guard<std::mutex> lock(mSlotMutex);
+        mDisplays.insert(display);
+    }
     return err;
 }
 
@@ -72,6 +149,10 @@ int32_t ResourceManager::addVirtualDisplay(int64_t display, uint32_t outputBuffe
 
     int32_t err;
     h2a::translate(hwcErr, err);
+    if (err == 0) {
+        std::lock_guard<std::mutex> lock(mSlotMutex);
+        mDisplays.insert(display);
+    }
     return err;
 }
 
@@ -79,6 +160,12 @@ int32_t ResourceManager::removeDisplay(int64_t display) {
     Display hwcDisplay;
     a2h::translate(display, hwcDisplay);
 
+    releaseDisplaySlots(display);
+    {
+        std::lock_guard<std::mutex> lock(mSlotMutex);
+        mDisplays.erase(display);
+    }
+
     Error hwcErr = mResources->removeDisplay(hwcDisplay);
 
     int32_t err;
@@ -131,6 +218,10 @@ int32_t ResourceManager::addLayer(int64_t display, int64_t layer, uint32_t buffe
 
     int32_t err;
     h2a::translate(hwcErr, err);
+    if (err == 0) {
+        std::lock_guard<std::mutex> lock(mSlotMutex);
+        mLayerSlots[{display, layer}] = bufferCacheSize;
+    }
     return err;
 }
 
@@ -140,6 +231,20 @@ int32_t ResourceManager::removeLayer(int64_t display, int64_t layer) {
 
     a2h::translate(display, hwcDisplay);
     a2h::translate(layer, hwcLayer);
+
+    uint32_t slots = 0;
+    {
+        std::lock_guard<std::mutex> lock(mSlotMutex);
+        auto it = mLayerSlots.find({display, layer});
+        if (it != mLayerSlots.end()) {
+            slots = it->second;
+            mLayerSlots.erase(it);
+        }
+    }
+    for (uint32_t slot = 0; slot < slots; slot++) {
+        releaseLayerSlot(display, layer, slot);
+    }
+
     Error hwcErr = mResources->removeLayer(hwcDisplay, hwcLayer);
 
     int32_t err;
@@ -184,6 +289,10 @@ int32_t ResourceManager::getDisplayClientTarget(int64_t display, uint32_t slot,
     Display hwcDisplay;
     a2h::translate(display, hwcDisplay);
 
+    if (!fromCache) {
+        releaseClientTargetSlot(display, slot);
+    }
+
     auto br = static_cast<BufferReleaser*>(bufReleaser);
     Error hwcErr = mResources->getDisplayClientTarget(hwcDisplay, slot, fromCache, handle,
                                                       &outHandle, br->getReplacedHandle());
@@ -219,6 +328,10 @@ int32_t ResourceManager::getLayerBuffer(int64_t display, int64_t layer, uint32_t
     Layer hwcLayer;
     a2h::translate(layer, hwcLayer);
 
+    if (!fromCache) {
+        releaseLayerSlot(display, layer, slot);
+    }
+
     auto br = static_cast<BufferReleaser*>(bufReleaser);
     Error hwcErr = mResources->getLayerBuffer(hwcDisplay, hwcLayer, slot, fromCache,
                                                 rawHandle, &outBufferHandle,
@@ -18,6 +18,11 @@
 
 #include <composer-resources/2.2/ComposerResources.h>
 
+#include <limits>
+#include <map>
+#include <mutex>
+#include <set>
+
 #include "include/IResourceManager.h"
 
 using android::hardware::graphics::composer::V2_2::hal::ComposerResources;
@@ -42,6 +47,7 @@ class ResourceManager : public IResourceManager {
     virtual ~ResourceManager() = default;
 
     std::unique_ptr<IBufferReleaser> createReleaser(bool isBuffer) override;
+    void setBufferReleasedCallback(BufferReleased callback) override;
     void clear(RemoveDisplay removeDisplay) override;
     bool hasDisplay(int64_t display) override;
     int32_t addPhysicalDisplay(int64_t display) override;
@@ -73,7 +79,18 @@ class ResourceManager : public IResourceManager {
                                    buffer_handle_t& outStreamHandle,
                                    IBufferReleaser* bufReleaser) override;
   private:
+    // hand the buffers cached in slots to mBufferReleased before they are dropped
+    void releaseLayerSlot(int64_t display, int64_t layer, uint32_t slot);
+    void releaseClientTargetSlot(int64_t display, uint32_t slot);
+    void releaseDisplaySlots(int64_t display);
+
     std::unique_ptr<ComposerResources> mResources = ComposerResources::create();
+
+    BufferReleased mBufferReleased;
+    std::mutex mSlotMutex;
+    // layer buffer slot counts by display and layer
+    std::map<std::pair<int64_t, int64_t>, uint32_t> mLayerSlots;
+    std::set<int64_t> mDisplays;
 };
 
 } // namespace aidl::android::hardware::graphics::composer3::impl
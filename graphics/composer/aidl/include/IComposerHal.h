@@ -35,6 +35,7 @@
 #include <aidl/android/hardware/graphics/composer3/ClientTarget.h>
 #include <aidl/android/hardware/graphics/composer3/ClientTargetProperty.h>
 #include <aidl/android/hardware/graphics/composer3/ClientTargetPropertyWithBrightness.h>
+#include <aidl/android/hardware/graphics/composer3/ClockMonotonicTimestamp.h>
 #include <aidl/android/hardware/graphics/composer3/Color.h>
 #include <aidl/android/hardware/graphics/composer3/ColorMode.h>
 #include <aidl/android/hardware/graphics/composer3/CommandError.h>
@@ -112,6 +113,41 @@ class IComposerHal {
 
     virtual int32_t getDisplayName(int64_t display, std::string* outName) = 0;
     virtual int32_t getDisplayVsyncPeriod(int64_t display, int32_t* outVsyncPeriod) = 0;
+    virtual int32_t getDisplayConfigs(int64_t display, std::vector<int32_t>* outConfigs) = 0;
+    virtual int32_t getActiveConfig(int64_t display, int32_t* outConfig) = 0;
+    virtual int32_t setActiveConfigWithConstraints(
+            int64_t display, int32_t config, const VsyncPeriodChangeConstraints& constraints,
+            VsyncPeriodChangeTimeline* outTimeline) = 0;
+    virtual int32_t getSupportedContentTypes(int64_t display,
+                                             std::vector<ContentType>* outTypes) = 0;
+    virtual int32_t setContentType(int64_t display, ContentType type) = 0;
+    virtual int32_t setColorTransform(int64_t display, const std::vector<float>& matrix) = 0;
+    virtual int32_t getDisplayCapabilities(int64_t display,
+                                           std::vector<DisplayCapability>* outCaps) = 0;
+    virtual int32_t setDisplayBrightness(int64_t display, float brightness) = 0; // cmd
+    virtual int32_t flushDisplayBrightnessChange(int64_t display) = 0;
+    virtual int32_t getDisplayedContentSamplingAttributes(
+            int64_t display, DisplayContentSamplingAttributes* outAttrs) = 0;
+    virtual int32_t setDisplayedContentSamplingEnabled(int64_t display, bool enable,
+                                                       FormatColorComponent componentMask,
+                                                       int64_t maxFrames) = 0;
+    virtual int32_t getDisplayedContentSample(int64_t display, int64_t maxFrames,
+                                              int64_t timestamp,
+                                              DisplayContentSample* outSamples) = 0;
+    virtual int32_t getReadbackBufferAttributes(int64_t display,
+                                                ReadbackBufferAttributes* outAttributes) = 0;
+    virtual int32_t setReadbackBuffer(int64_t display, buffer_handle_t buffer,
+                                      const ndk::ScopedFileDescriptor& releaseFence) = 0;
+    virtual int32_t getReadbackBufferFence(int64_t display,
+                                           ndk::ScopedFileDescriptor* outFence) = 0;
+    virtual int32_t getMaxVirtualDisplayCount(int32_t* outCount) = 0;
+    virtual int32_t createVirtualDisplay(uint32_t width, uint32_t height, common::PixelFormat format,
+                                         VirtualDisplay* outDisplay) = 0;
+    virtual int32_t destroyVirtualDisplay(int64_t display) = 0;
+    virtual int32_t setOutputBuffer(int64_t display, buffer_handle_t buffer,
+                                    const ndk::ScopedFileDescriptor& releaseFence) = 0; // cmd
+    virtual int32_t setExpectedPresentTime(
+            int64_t display, const std::optional<ClockMonotonicTimestamp>& expectedPresentTime) = 0;
     virtual int32_t presentDisplay(int64_t display, ndk::ScopedFileDescriptor& fence,
                                    std::vector<int64_t>* outLayers,
                                    std::vector<ndk::ScopedFileDescriptor>* outReleaseFences) = 0;
@@ -119,8 +155,30 @@ class IComposerHal {
                                     const ndk::ScopedFileDescriptor& fence,
                                     common::Dataspace dataspace,
                                     const std::vector<common::Rect>& damage) = 0; // cmd
+    virtual int32_t setLayerBuffer(int64_t display, int64_t layer, buffer_handle_t buffer,
+                                   const ndk::ScopedFileDescriptor& acquireFence) = 0;
+    virtual int32_t setLayerBlendMode(int64_t display, int64_t layer, common::BlendMode mode) = 0;
+    virtual int32_t setLayerCursorPosition(int64_t display, int64_t layer, int32_t x,
+                                           int32_t y) = 0;
+    virtual int32_t setLayerColorTransform(int64_t display, int64_t layer,
+                                           const std::vector<float>& matrix) = 0;
+    virtual int32_t setLayerBrightness(int64_t display, int64_t layer, float brightness) = 0;
     virtual int32_t setLayerCompositionType(int64_t display, int64_t layer, Composition type) = 0;
+    virtual int32_t setLayerDisplayFrame(int64_t display, int64_t layer,
+                                         const common::Rect& frame) = 0;
+    virtual int32_t setLayerPlaneAlpha(int64_t display, int64_t layer, float alpha) = 0;
+    virtual int32_t setLayerSourceCrop(int64_t display, int64_t layer,
+                                       const common::FRect& crop) = 0;
+    virtual int32_t setLayerSurfaceDamage(int64_t display, int64_t layer,
+                                          const std::vector<std::optional<common::Rect>>& damage) = 0;
+    virtual int32_t setLayerTransform(int64_t display, int64_t layer,
+                                      common::Transform transform) = 0;
+    virtual int32_t setLayerZOrder(int64_t display, int64_t layer, uint32_t z) = 0;
     virtual int32_t setVsyncEnabled(int64_t display, bool enabled) = 0;
+    virtual int32_t setIdleTimerEnabled(int64_t display, int32_t timeout) = 0;
+    virtual int32_t setPowerMode(int64_t display, PowerMode mode) = 0;
+    // buffer is about to be freed by the resource manager
+    virtual void releaseBuffer(buffer_handle_t buffer) = 0;
     virtual int32_t validateDisplay(int64_t display, std::vector<int64_t>* outChangedLayers,
                                     std::vector<Composition>* outCompositionTypes,
                                     uint32_t* outDisplayRequestMask,
@@ -34,8 +34,11 @@ public:
     static std::unique_ptr<IResourceManager> create();
     using RemoveDisplay = std::function<void(int64_t display, bool isVirtual,
                                              const std::vector<int64_t>& layers)>;
+    // Called with a buffer that is dropped from a slot, before it is freed.
+    using BufferReleased = std::function<void(buffer_handle_t buffer)>;
     virtual ~IResourceManager() = default;
     virtual std::unique_ptr<IBufferReleaser> createReleaser(bool isBuffer) = 0;
+    virtual void setBufferReleasedCallback(BufferReleased callback) = 0;
 
     virtual void clear(RemoveDisplay removeDisplay) = 0;
     virtual bool hasDisplay(int64_t display) = 0;
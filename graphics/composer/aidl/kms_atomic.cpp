@@ -0,0 +1,146 @@
+/*
+ * Copyright 2026 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "composer-kms_atomic"
+//#define LOG_NDEBUG 0
+#include <utils/Log.h>
+#include <errno.h>
+#include <string.h>
+
+#include "kms_atomic.h"
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+/* indexed by enum kms_plane_prop */
+static const char *const plane_prop_names[] = {
+	"type",
+	"FB_ID",
+	"CRTC_ID",
+	"SRC_X",
+	"SRC_Y",
+	"SRC_W",
+	"SRC_H",
+	"CRTC_X",
+	"CRTC_Y",
+	"CRTC_W",
+	"CRTC_H",
+	"zpos",
+	"alpha",
+	"rotation",
+	"pixel blend mode",
+	"IN_FENCE_FD",
+	"FB_DAMAGE_CLIPS",
+	"IN_FORMATS",
+};
+
+/* indexed by enum kms_crtc_prop */
+static const char *const crtc_prop_names[] = {
+	"ACTIVE",
+	"MODE_ID",
+	"OUT_FENCE_PTR",
+	"VRR_ENABLED",
+	"CTM",
+	"DEGAMMA_LUT",
+	"DEGAMMA_LUT_SIZE",
+	"GAMMA_LUT",
+	"GAMMA_LUT_SIZE",
+};
+
+/* indexed by enum kms_connector_prop */
+static const char *const connector_prop_names[] = {
+	"CRTC_ID",
+	"DPMS",
+	"EDID",
+	"link-status",
+	"content type",
+	"WRITEBACK_FB_ID",
+	"WRITEBACK_OUT_FENCE_PTR",
+	"WRITEBACK_PIXEL_FORMATS",
+};
+
+static_assert(sizeof(plane_prop_names) / sizeof(plane_prop_names[0]) == PLANE_PROP_COUNT);
+static_assert(sizeof(crtc_prop_names) / sizeof(crtc_prop_names[0]) == CRTC_PROP_COUNT);
+static_assert(sizeof(connector_prop_names) / sizeof(connector_prop_names[0]) == CONNECTOR_PROP_COUNT);
+
+/*
+ * Resolve all properties of an object against a name table with a single
+ * drmModeObjectGetProperties() and one drmModeGetProperty() per property.
+ */
+static int props_init(int fd, uint32_t object_id, uint32_t object_type,
+		const char *const names[], size_t count, struct kms_prop *out)
+{
+	memset(out, 0, sizeof(*out) * count);
+
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, object_id, object_type);
+	if (!props) {
+		ALOGE("failed to get properties of object %u", object_id);
+		return -EINVAL;
+	}
+
+	for (uint32_t i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+		for (size_t p = 0; p < count; p++) {
+			if (strcmp(prop->name, names[p]))
+				continue;
+			out[p].id = prop->prop_id;
+			out[p].flags = prop->flags;
+			out[p].value = props->prop_values[i];
+			if ((prop->flags & DRM_MODE_PROP_RANGE) && prop->count_values >= 2) {
+				out[p].min = prop->values[0];
+				out[p].max = prop->values[1];
+			}
+			break;
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+	return 0;
+}
+
+int kms_plane_props_init(int fd, uint32_t plane_id, kms_plane_props *props)
+{
+	return props_init(fd, plane_id, DRM_MODE_OBJECT_PLANE,
+			plane_prop_names, PLANE_PROP_COUNT, props->prop);
+}
+
+int kms_crtc_props_init(int fd, uint32_t crtc_id, kms_crtc_props *props)
+{
+	return props_init(fd, crtc_id, DRM_MODE_OBJECT_CRTC,
+			crtc_prop_names, CRTC_PROP_COUNT, props->prop);
+}
+
+int kms_connector_props_init(int fd, uint32_t connector_id, kms_connector_props *props)
+{
+	return props_init(fd, connector_id, DRM_MODE_OBJECT_CONNECTOR,
+			connector_prop_names, CONNECTOR_PROP_COUNT, props->prop);
+}
+
+int kms_atomic_req::add(uint32_t object_id, uint32_t prop_id, uint64_t value)
+{
+	if (!prop_id)
+		return 0;
+	int ret = drmModeAtomicAddProperty(req, object_id, prop_id, value);
+	return ret < 0 ? ret : 0;
+}
+
+int kms_atomic_req::commit(int fd, uint32_t flags, void *user_data)
+{
+	return drmModeAtomicCommit(fd, req, flags, user_data);
+}
+
+} // namespace aidl::android::hardware::graphics::composer3::impl
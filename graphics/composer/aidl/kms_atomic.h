@@ -0,0 +1,126 @@
+/*
+ * Copyright 2026 Android-RPi Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+namespace aidl::android::hardware::graphics::composer3::impl {
+
+enum kms_plane_prop {
+    PLANE_PROP_TYPE,
+    PLANE_PROP_FB_ID,
+    PLANE_PROP_CRTC_ID,
+    PLANE_PROP_SRC_X,
+    PLANE_PROP_SRC_Y,
+    PLANE_PROP_SRC_W,
+    PLANE_PROP_SRC_H,
+    PLANE_PROP_CRTC_X,
+    PLANE_PROP_CRTC_Y,
+    PLANE_PROP_CRTC_W,
+    PLANE_PROP_CRTC_H,
+    PLANE_PROP_ZPOS,
+    PLANE_PROP_ALPHA,
+    PLANE_PROP_ROTATION,
+    PLANE_PROP_PIXEL_BLEND_MODE,
+    PLANE_PROP_IN_FENCE_FD,
+    PLANE_PROP_FB_DAMAGE_CLIPS,
+    PLANE_PROP_IN_FORMATS,
+    PLANE_PROP_COUNT
+};
+
+enum kms_crtc_prop {
+    CRTC_PROP_ACTIVE,
+    CRTC_PROP_MODE_ID,
+    CRTC_PROP_OUT_FENCE_PTR,
+    CRTC_PROP_VRR_ENABLED,
+    CRTC_PROP_CTM,
+    CRTC_PROP_DEGAMMA_LUT,
+    CRTC_PROP_DEGAMMA_LUT_SIZE,
+    CRTC_PROP_GAMMA_LUT,
+    CRTC_PROP_GAMMA_LUT_SIZE,
+    CRTC_PROP_COUNT
+};
+
+enum kms_connector_prop {
+    CONNECTOR_PROP_CRTC_ID,
+    CONNECTOR_PROP_DPMS,
+    CONNECTOR_PROP_EDID,
+    CONNECTOR_PROP_LINK_STATUS,
+    CONNECTOR_PROP_CONTENT_TYPE,
+    CONNECTOR_PROP_WRITEBACK_FB_ID,
+    CONNECTOR_PROP_WRITEBACK_OUT_FENCE_PTR,
+    CONNECTOR_PROP_WRITEBACK_PIXEL_FORMATS,
+    CONNECTOR_PROP_COUNT
+};
+
+/*
+ * Property ids of one KMS object, looked up once by name. A zero id means
+ * the driver doesn't expose the property. value holds the value at lookup
+ * time, min/max the range of range properties.
+ */
+struct kms_prop {
+    uint32_t id;
+    uint32_t flags;
+    uint64_t value;
+    uint64_t min;
+    uint64_t max;
+};
+
+template <size_t N>
+struct kms_props {
+    struct kms_prop prop[N];
+
+    uint32_t id(size_t p) const { return prop[p].id; }
+    uint64_t value(size_t p) const { return prop[p].value; }
+    bool has(size_t p) const { return prop[p].id != 0; }
+};
+
+using kms_plane_props = kms_props<PLANE_PROP_COUNT>;
+using kms_crtc_props = kms_props<CRTC_PROP_COUNT>;
+using kms_connector_props = kms_props<CONNECTOR_PROP_COUNT>;
+
+int kms_plane_props_init(int fd, uint32_t plane_id, kms_plane_props *props);
+int kms_crtc_props_init(int fd, uint32_t crtc_id, kms_crtc_props *props);
+int kms_connector_props_init(int fd, uint32_t connector_id, kms_connector_props *props);
+
+/*
+ * Atomic request that is kept across frames. reset() rewinds the request
+ * without giving back the property array libdrm grew for earlier frames.
+ * Properties the driver doesn't expose are silently skipped.
+ */
+class kms_atomic_req {
+  public:
+    kms_atomic_req() : req(drmModeAtomicAlloc()) {}
+    ~kms_atomic_req() { drmModeAtomicFree(req); }
+    kms_atomic_req(const kms_atomic_req&) = delete;
+    kms_atomic_req& operator=(const kms_atomic_req&) = delete;
+
+    void reset() { drmModeAtomicSetCursor(req, 0); }
+    int add(uint32_t object_id, uint32_t prop_id, uint64_t value);
+    template <size_t N>
+    int add(uint32_t object_id, const kms_props<N> &props, size_t p, uint64_t value) {
+        return add(object_id, props.id(p), value);
+    }
+    int commit(int fd, uint32_t flags, void *user_data);
+    drmModeAtomicReqPtr get() const { return req; }
+
+  private:
+    drmModeAtomicReqPtr req;
+};
+
+} // namespace aidl::android::hardware::graphics::composer3::impl